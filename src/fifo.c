@@ -1,5 +1,5 @@
-#define	_POSIX_SOURCE
-#define _POSIX_C_SOURCE 200112L
+
+#define _POSIX_C_SOURCE 200809L
 
 #include 	<time.h>
 #include 	<sys/time.h>
@@ -11,69 +11,648 @@
 #include	<string.h>
 #include	<dirent.h>
 #include	<stdlib.h>
+#include	<stddef.h>
 #include	<errno.h>
+#include	<stdint.h>
+#include	<stdatomic.h>
+#include	<sched.h>
+#include	<signal.h>
+#include	<sys/mman.h>
+#include	<poll.h>
+#ifdef __linux__
+#include	<sys/inotify.h>
+#endif
 
 #include	"fifo.h"
 
-static int fifoWriteParams(const char* dirname, const FifoParameters* fpa );
-static int fifoReadParams(const char* dirname, FifoParameters* fpa );
-static char* fifoAbsfilename( const char* filename );
-static long fifoGetCurrent(const char* filename);
-static char* fifoCurrentAbsfilename(const char* dirname, unsigned long current);
+/*
+ * Open file description locks (Linux 3.15 and later) belong to the open file,
+ * not to the process, so they exclude threads and processes alike and are not
+ * dropped by closing other descriptors of the same file. Without them, classic
+ * record locks are combined with process internal pthread locks per queue.
+ * Compile with -DFIFO_PTHREAD_LOCKS to force the latter.
+ */
+#if !defined(FIFO_PTHREAD_LOCKS) && !defined(F_OFD_SETLKW) && defined(__linux__)
+#define	F_OFD_SETLK	37
+#define	F_OFD_SETLKW	38
+#endif
+#if !defined(FIFO_PTHREAD_LOCKS) && defined(F_OFD_SETLKW)
+#define	FIFO_SETLK	F_OFD_SETLK
+#define	FIFO_SETLKW	F_OFD_SETLKW
+#else
+#ifndef FIFO_PTHREAD_LOCKS
+#define	FIFO_PTHREAD_LOCKS
+#endif
+#define	FIFO_SETLK	F_SETLK
+#define	FIFO_SETLKW	F_SETLKW
+#include	<pthread.h>
+#endif
+
+/*
+ * With -DFIFO_STATS each descriptor counts messages and measures the latency
+ * of its operations, see fifoStats, and publishes them in the statistics segment
+ * of the queue, see fifoStatsList. Without, the instrumentation is compiled out.
+ */
+#ifdef FIFO_STATS
+#define	STATSSTART(t)	uint64_t t = fifoStatsNow()
+#define	STATSTIME(fp, timer, t)	fifoStatsTime((fp)->stats, (timer), (t))
+#define	STATSADD(fp, field, v)	fifoStatsAdd((fp)->stats, STATSWORD(field), (v))
+#else
+#define	STATSSTART(t)
+#define	STATSTIME(fp, timer, t)	((void)0)
+#define	STATSADD(fp, field, v)	((void)0)
+#endif
+
+/*
+ * Static probes for perf, bpftrace or SystemTap in the provider fifo, if
+ * <sys/sdt.h> is available. A probe not attached costs a single nop.
+ * Arguments are the queue path, the generation and a size, position or result.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(FIFO_NO_SDT)
+#include	<sys/sdt.h>
+#endif
+#endif
+#ifdef STAP_PROBE3
+#define	PROBE2(name, a, b)	STAP_PROBE2(fifo, name, a, b)
+#define	PROBE3(name, a, b, c)	STAP_PROBE3(fifo, name, a, b, c)
+#else
+#define	PROBE2(name, a, b)	((void)0)
+#define	PROBE3(name, a, b, c)	((void)0)
+#endif
+
+/* static functions ahead declarations */
+static int createqueue(FifoParameters* fpa, const char* dirname);
+static int fifoMarks(const FifoParameters* fpa);
+static int fifoWriteParams(const FifoParameters* fpa );
+static int fifoReadParams(FifoParameters* fpa );
+static int fifoOpenDirectory(FifoParameters* fpa, const char* dirname);
+static int fifoDupDirectory(FifoParameters* fpa, int dirfd);
+static FifoDescriptor* openwriter(const char* filename, int dirfd, off_t* recovered);
+static void fifoCloseDirectory(FifoParameters* fpa);
+static int fifoMapTail(FifoParameters* fpa);
+static void fifoTailWait(FifoDescriptor* fwd, uint64_t value);
+static void reclaim(FifoDescriptor* fwd, uint64_t c, uint64_t end);
+static int fifoSlotTake(FifoParameters* fpa);
+static void fifoSlotDrop(FifoParameters* fpa);
+static int fifoWriterAlive(uint64_t owner);
+static uint64_t fifoProcessStart(pid_t pid);
+static ssize_t fifoWriteAll(int fd, const char* buffer, size_t size, off_t pos);
+static int fifoPad(FifoDescriptor* fwd, off_t pos, size_t size);
+static int fifoWriterLock(FifoParameters* fpa);
+static int fifoWriterShare(FifoParameters* fpa);
+static int fifoWriterJoin(FifoParameters* fpa);
+static void fifoWriterUnlock(FifoParameters* fpa);
+static void fifoFree(FifoDescriptor* fp);
+static int fifoScanProducer(const FifoParameters* fpa, unsigned long gen, uint32_t producer, off_t stop, uint64_t* hwm);
+static void fifoProducerMark(const FifoParameters* fpa, struct FifoProducer* pd, uint64_t sequence);
+static void fifoFreeProducer(struct FifoProducer* pd);
+static ssize_t stage(FifoDescriptor* fwd, const char* buffer, size_t size);
+static void fifoFreeTransaction(struct FifoTransaction* tx);
+static char* fifoSubqueuePath(const char* dirname, const char* prefix, int n);
+static int fifoReadCount(const FifoParameters* fpa, const char* name);
+static int fifoOpenLanes(FifoDescriptor* fp, const char* readpf);
+static ssize_t readlanes(FifoDescriptor* frd, char* buffer, size_t size);
+static ssize_t releaselane(FifoDescriptor* frd);
+static FifoPartitions* fifoOpenPart(const char* dirname, const char* readpf, const int* bind, int nbind);
+static void fifoFreePart(FifoPartitions* fp);
+static int pollwatch(const FifoPoll* fpl, int dirfd, const char* sub);
+static void pollunwatch(FifoPoll* fpl, int slot);
+static void pollshard(FifoPoll* fpl, int i);
+static void pollremove(FifoPoll* fpl, int i);
+static void pollfree(FifoPoll* fpl);
+static char* fifoShardname(const FifoParameters* fpa, unsigned long current, char* name);
+static long fifoGetCurrent(const FifoParameters* fpa);
+static long fifoScanGenerations(const FifoParameters* fpa, unsigned long* first, unsigned long* last);
+static int fifoWriteRetention(const FifoParameters* fpa);
+static int fifoReadRetention(FifoParameters* fpa);
+static long collect(const FifoParameters* fpa, int wait);
+static int recordend(const FifoParameters* fpa, const char* buffer, ssize_t i, int first);
+static off_t recover(FifoDescriptor* fwd);
+static int fifoRepairPointers(const FifoParameters* fpa, unsigned long gen, off_t end);
+#ifdef FIFO_STATS
+static uint64_t fifoStatsNow(void);
+static void fifoStatsAdd(struct FifoStatsBlock* s, size_t word, uint64_t v);
+static void fifoStatsTime(struct FifoStatsBlock* s, FifoTimer timer, uint64_t t0);
+static void fifoStatsMerge(uint64_t* sum, const _Atomic uint64_t* word);
+static struct FifoStatsSegment* fifoStatsMap(const FifoParameters* fpa);
+#endif
+static int fifoStatsAlive(uint64_t owner);
+static void fifoStatsOpen(FifoDescriptor* fp, char role, const char* readpf);
+static void fifoStatsClose(FifoDescriptor* fp);
+static int fifoGetRange(const FifoParameters* fpa, unsigned long* first, unsigned long* last);
+static int fifoManifestRoll(const FifoParameters* fpa, unsigned long oldgen, off_t size, unsigned long newgen);
+static char* fifoCurrentFilename(const FifoParameters* fpa, unsigned long current, char* name);
+static int fifoMakeShard(const FifoParameters* fpa, unsigned long current);
 static char* fifoFormatWriteBuffer(FifoParameters*, const char* buff, size_t*);
-static ssize_t writelocked(FifoDescriptor*, const char* buffer, size_t);
+static void fifoPut(char* p, uint64_t value, int n);
+static uint64_t fifoGet(const char* p, int n);
+static ssize_t writelocked(FifoDescriptor*, const char* buffer, size_t, int count, int sync);
+static void fifoDueMin(struct FifoTail* t, uint64_t bucket);
+static int fifoDue(const FifoParameters* fpa);
+static ssize_t delaylocked(FifoDescriptor* fwd, uint64_t bucket, const char* buffer, size_t size);
+static long promote(FifoDescriptor* fwd);
+static long promotereader(FifoDescriptor* frd);
+static int fifoWpOpen(const FifoParameters* fpa);
+static void fifoWpRelease(int fd);
 static void err( const char* text );
+static void errpath( const char* text, const char* path );
 static ssize_t fifoFormatReadBuffer(FifoParameters *fp, char* buffer, ssize_t*);
 static ssize_t readlocked(FifoDescriptor*, char* buffer, size_t);
+static int txskip(FifoDescriptor* frd, char* buffer, ssize_t size);
+static ssize_t readwait(FifoDescriptor *frd, char* buffer, size_t size, long wtim, long maxtime);
+static ssize_t waitread(ssize_t (*attempt)(void*, char*, size_t), void* arg, char* buffer, size_t size, long wtim, long maxtime);
+static ssize_t readonce(void* frd, char* buffer, size_t size);
+static ssize_t readparts(void* fpr, char* buffer, size_t size);
+static ssize_t fifoParseHeader(const FifoDescriptor* frd, char* buffer, ssize_t size, FifoHeader* header, char** payload);
+static ssize_t fifoStripHeader(const FifoDescriptor* frd, char* buffer, ssize_t size);
 static ssize_t release(FifoDescriptor* frd);
 static int fifoOpenFilePointer(FifoDescriptor* frd, const char* readpf);
 static int fifoReadFilePointer(FifoDescriptor* frd);
 static int fifoWriteFilePointer(FifoDescriptor* frd);
 static int fifoReOpenRead(FifoDescriptor* frd);
+static int fifoReOpenWrite(FifoDescriptor* fwd, unsigned long current);
+static int fifoGenerationBase(const FifoParameters* fpa, unsigned long gen, uint64_t* base);
+static int lagof(const FifoParameters* fpa, int fd, const char* pname, FifoLag* lag);
+static long laglist(const char* dirname, FifoLag* lags, long max, long count);
+static int dolock(int fd, int type);
+static int trylock(int fd, int type);
 static int takewritelock(int fd);
 static int takereadlock(int fd);
 static int releaselock(int fd);
+#ifdef FIFO_PTHREAD_LOCKS
+static int fifoLocksAcquire(FifoParameters* fpa);
+static void fifoLocksRelease(FifoParameters* fpa);
+static int lwlock(pthread_rwlock_t*);
+static int lrlock(pthread_rwlock_t*);
+static int lulock(pthread_rwlock_t*);
+#else
+/* file locks suffice, no process internal locks */
+#define	lwlock(lock)	0
+#define	lrlock(lock)	0
+#define	lulock(lock)	((void)0)
+#endif
+
+/* names of administration files in queue directory */
+#define	PARFILE		".param"
+#define	WPFILE		".wp"
+#define	RPPREFIX	".rp_"
+#define	RETAINFILE	".retain"
+#define	SHARDPREFIX	"s"
+#define	MANIFEST	".manifest"
+#define	TAILFILE	".tail"
+#define	WRITERFILE	".writers"
+#define	PARTFILE	".partitions"
+#define	PARTPREFIX	"p"
+#define	LANEFILE	".lanes"
+#define	LANEPREFIX	"l"
+#define	DELAYDIR	".delay"
+#define	DELAYLOCK	".delay/.lock"
+#define	PRODPREFIX	".pd_"
+#define	STATSFILE	".stats"
+
+/* first byte of a message with binary header, preceded by escape character */
+#define	HEADMARK	'H'
+/* size of binary header: time, sequence, producer, size of attributes */
+#define	HEADLEN		22
+/* markers around the messages of a transaction, preceded by escape character */
+#define	TXBEGIN		'B'
+#define	TXCOMMIT	'C'
+/* record skipped by readers, filling a range not written, preceded by escape character */
+#define	PADMARK		'P'
+/* line of record size and record type fingerprint in .param */
+#define	RECORDMARK	'R'
+/* characters following the escape character in markers, not usable as escape */
+static const char markers[] = { '@', HEADMARK, TXBEGIN, TXCOMMIT, PADMARK };
+
+/* buffer size for data file name relative to queue directory: s<shard>/<A-T><number> */
+#define	FIFONAMELEN	48
+
+/* watches of a descriptor in a poll set: its lanes and its current shard */
+#define	POLLWATCHES	(FIFOLANES + 1)
+/* ms between checks of a poll set without inotify */
+#define	POLLINTERVAL	10
+/* ms until pending commits are checked again */
+#define	POLLRETRY	1
+
+/* bytes at the end of the current data file checked by recovery */
+#define	RECOVERLEN	8192
+
+/* bytes read at a time by the scan for the last header of a producer */
+#define	SCANCHUNK	65536
+/* max. size of an escaped binary header with its mark */
+#define	HEADSPAN	(2 + 2 * HEADLEN)
+
+/* manifest line length and number of removed records triggering compaction */
+#define	MANRECLEN	84
+#define	MANCOMPACT	1024
+
+typedef
+struct	{
+	unsigned long	first;	/* oldest live generation */
+	unsigned long	last;	/* newest generation */
+	unsigned long	base;	/* generation of first record */
+	off_t	total;		/* size of closed generations first .. last-1 */
+}	FifoManifest;
+
+static int manifestLock(const FifoParameters* fpa, int type, FifoManifest* m);
+static void manifestUnlock(const FifoParameters* fpa, int fd);
+
+/*
+ * Tail and commit words of the shared header: the low bits of the generation
+ * above the size of the data file, so a word of an old generation never
+ * matches the current one. During rollover the size is frozen to a value,
+ * which fits no message.
+ */
+#define	TAILBITS	40
+#define	TAILMASK	((UINT64_C(1) << TAILBITS) - 1)
+#define	TAILFROZEN	((off_t) TAILMASK)
+#define	TAILWORD(gen, pos)	(((uint64_t)(gen) << TAILBITS) | (uint64_t)(pos))
+#define	TAILPOS(w)	((off_t) ((w) & TAILMASK))
+#define	TAILSAME(w, gen)	(((w) & ~TAILMASK) == TAILWORD(gen, 0))
+#define	TAILMAGIC	UINT64_C(0x6669666f7461696c)
+#define	TAILSPINS	64	/* yields before sleeping while waiting for the commit */
+#define	TAILSTUCK	10000	/* sleeps of 0.1 ms without commit, until its writer is checked */
+#define	TAILSLOTS	256	/* max. number of open writers */
+
+/*
+ * Slot of an open writer in the shared header. The start of a range is
+ * stored before it is reserved and cleared after it is committed, so a range
+ * at the commit word without live owner was left by a dead writer.
+ */
+typedef
+struct	FifoSlot	{
+	_Alignas(64) _Atomic uint64_t	owner;	/* pid and start time of the process, 0: free */
+	_Atomic uint64_t	start;	/* tail word of the range being written, 0: none */
+}	FifoSlot;
+
+/*
+ * Header dir/.tail mapped by all writers and readers of the queue.
+ * Writers reserve the range of a message by advancing tail and make it
+ * visible to the readers by advancing commit, when all preceding ranges
+ * are written. tail and commit are kept in separate cache lines.
+ * The logical offset of the data, counted from the creation of the queue, is
+ * the offset of the start of the generation in the write pointer plus the
+ * position of the commit word.
+ */
+typedef
+struct	FifoTail	{
+	_Atomic uint64_t	magic;	/* TAILMAGIC, when initialized by a writer */
+	_Atomic uint64_t	gen;	/* current generation of the writers */
+	_Atomic uint64_t	due;	/* earliest bucket of delayed messages, 0: none */
+	_Atomic uint64_t	seq;	/* last sequence number of messages with header */
+	_Alignas(64) _Atomic uint64_t	tail;	/* end of reserved ranges */
+	_Alignas(64) _Atomic uint64_t	commit;	/* end of completely written data */
+	_Atomic uint64_t	messages;	/* messages written up to commit */
+	FifoSlot	slot[TAILSLOTS];	/* writers, see fifoSlotTake */
+}	FifoTail;
 
-char fifoERROR[10240];
+/* idempotent producer of a write pointer */
+typedef
+struct	FifoProducer	{
+	uint32_t	id;		/* producer id */
+	int	fd;		/* locked file dir/.pd_<id> */
+	uint64_t*	hwm;	/* mapped words: high-water mark of sequence numbers, generation
+				 * and position of the end of the committed data, when it was set */
+}	FifoProducer;
 
+/* words of the producer file dir/.pd_<id> */
+#define	PRODWORDS	3
 
+/* messages of a write pointer staged until commit */
+typedef
+struct	FifoTransaction	{
+	char*	buffer;		/* formatted messages */
+	size_t	size;		/* used size of buffer */
+	size_t	allocated;	/* allocated size of buffer */
+	int	count;		/* number of messages */
+	uint64_t	sequence;	/* last sequence number of the producer */
+}	FifoTransaction;
+
+/* FifoStats as array of words, each written by the thread using the descriptor */
+#define	STATSWORDS	(sizeof(FifoStats) / sizeof(uint64_t))
+#define	STATSWORD(field)	(offsetof(FifoStats, field) / sizeof(uint64_t))
+#define	STATSHIST	(sizeof(FifoHistogram) / sizeof(uint64_t))
+#define	STATSSLOTS	64	/* slots in the statistics segment */
+#define	STATSNAMELEN	32	/* max. length of read pointer name in a slot */
+#define	STATSMAGIC	(UINT64_C(0x6669666f73740000) | STATSWORDS)
+#define	STATSRETRIES	1000	/* attempts to copy a slot, while it is written */
+
+/*
+ * Slot of a descriptor in the statistics segment dir/.stats, which the
+ * processes of the queue map into memory. Only the thread using the descriptor
+ * writes the slot, making seq odd meanwhile; a copy is valid, if seq was even
+ * and unchanged. No system call is needed to publish the statistics.
+ */
+typedef
+struct	FifoStatsSlot	{
+	_Alignas(64) _Atomic uint64_t	owner;	/* pid and number of descriptor in process, 0: free */
+	_Atomic uint64_t	seq;	/* odd, while the slot is written */
+	char	role;		/* 'w' writer, 'r' reader */
+	char	reader[STATSNAMELEN];	/* name of read pointer */
+	_Atomic uint64_t	word[STATSWORDS];
+}	FifoStatsSlot;
+
+typedef
+struct	FifoStatsSegment	{
+	_Atomic uint64_t	magic;	/* STATSMAGIC, 0 in a new segment */
+	FifoStatsSlot	slot[STATSSLOTS];
+}	FifoStatsSegment;
+
+#ifdef FIFO_STATS
+
+/* statistics of the descriptors of one queue in this process */
+typedef
+struct	FifoStatsQueue	{
+	dev_t	dev;		/* device and inode of queue directory */
+	ino_t	ino;
+	int	refs;		/* number of open descriptors */
+	uint64_t	closed[STATSWORDS];	/* sum of closed descriptors */
+	FifoStatsSegment*	segment;	/* mapped dir/.stats, NULL: not available */
+	struct FifoStatsBlock*	blocks;	/* open descriptors */
+	struct FifoStatsQueue*	next;
+}	FifoStatsQueue;
+
+/* statistics of a descriptor */
+typedef
+struct	FifoStatsBlock	{
+	FifoStatsSlot*	slot;	/* slot in the segment or local */
+	FifoStatsSlot	local;	/* used, if no slot is free */
+	FifoStatsQueue*	queue;
+	struct FifoStatsBlock*	next;
+}	FifoStatsBlock;
+
+/* number of descriptors opened by this process, distinguishes owners of slots */
+static _Atomic uint32_t statsOpened = 0;
+
+/* registry of the queues, only used at open, close and query */
+static FifoStatsQueue* statsList = NULL;
+static atomic_flag statsRegistry = ATOMIC_FLAG_INIT;
+#endif
+
+#ifdef FIFO_PTHREAD_LOCKS
+/* process internal (pthread) locks of one queue, shared by all its descriptors */
+typedef
+struct	FifoLocks	{
+	dev_t	dev;		/* device and inode of queue directory */
+	ino_t	ino;
+	int	refs;		/* number of open directories using the locks */
+	pthread_rwlock_t	data;	/* data files */
+	pthread_rwlock_t	wadm;	/* write pointer, parameters and retention files */
+	pthread_rwlock_t	radm;	/* read pointer files */
+	pthread_rwlock_t	mani;	/* manifest */
+	pthread_rwlock_t	dely;	/* delayed message buckets */
+	int	writers;	/* open writers of this process */
+	int	wfd;		/* dir/.writers locked shared for them */
+	int	recovering;	/* wfd is locked exclusively by a writer recovering the queue */
+	int	wpfd;		/* dir/.wp of fifoWpOpen, -1: not open */
+	struct FifoLocks*	next;
+}	FifoLocks;
+
+/* registry of the locks of all open queues */
+static FifoLocks* lockList = NULL;
+static pthread_mutex_t lockRegistry = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* error state of the last failed call, separate for each thread */
+static _Thread_local FifoError lastError;
+
+/**
+ * Create (if no directory with given name exists) a new file queu structure.
+ * It consists of a base directory, containing configuration and metadata files and
+ * a flexible number of data files.
+ * The files are in detail:
+ * - dir/.param contains static parameters of the file queue
+ *              - rollover data size
+ *              - escape character, none of the marker characters '@', 'H', 'B', 'C', 'P'
+ *              - message separator character
+ *              - optional number of generations per subdirectory
+ *              - optional record size and fingerprint of the record type
+ * - dir/.wp write pointer, contains current file number for writing
+ *              and logical offset and messages before it
+ * - dir/.pr_xxxx one of several possible read pointers contains
+ *   			- file number for reading using this pointer
+ *   			- position to read next message
+ *   			- logical offset of the file and messages released
+ * - dir/.manifest first and last live data file number and size and times
+ *              of each data file; rebuilt from the directory if missing
+ * - dir/.retain optional retention policy
+ * - dir/.tail header shared by writers and readers: current generation,
+ *              reserved and completely written size of its data file
+ * - dir/.lanes optional number of priority lanes, lanes 1 .. are queues
+ *              dir/l1, dir/l2, .. of the same structure
+ * - dir/.delay/<time> delayed messages, not readable before time
+ * - dir/.pd_<id> high-water mark of sequence numbers of an idempotent producer
+ * - dir/.writers locked by each open writer, the first one recovers the queue
+ * - dir/.stats statistics segment, one slot per descriptor of processes built with FIFO_STATS
+ *
+ *  Data files
+ * - dir/A0 .. A9 B10.. B99 C100 .. C999 D1000 .. D9999 
+ *   or in sharded layout dir/s0/A0 .. dir/s0/D9999 dir/s1/E10000 ..
+ *
+ */
 int fifoCreate( const char* dirname, off_t switchSize, char esc, char sep ) {
-	int res;
+	return fifoCreateShards(dirname, switchSize, esc, sep, 0);
+}
+
+/**
+ * Create file queue like fifoCreate. If shardSize > 0, the data files are
+ * stored in subdirectories dir/s0, dir/s1, .. each containing shardSize generations.
+ */
+int fifoCreateShards( const char* dirname, off_t switchSize, char esc, char sep, unsigned long shardSize ) {
 	FifoParameters fpa;
 	fpa.switchSize = switchSize;
+	fpa.shardSize = shardSize;
 	fpa.escape[0] = esc;
 	fpa.separator[0] = sep;
-	
+	fpa.recordSize = 0;
+	fpa.fingerprint = 0;
+	return createqueue(&fpa, dirname);
+}
+
+/**
+ * Create file queue like fifoCreate for records of a type identified by
+ * fingerprint, which is stored in dir/.param for the readers to check.
+ * If recordSize > 0, the records have this fixed size and are stored as they
+ * are, without escape characters, separators and roll-marks; esc and sep are
+ * ignored. Each write and read then transfers a whole number of records.
+ * Binary headers, delayed messages and transactions are not supported.
+ * If recordSize is 0, the records are framed like messages by esc and sep.
+ */
+int fifoCreateRecords( const char* dirname, off_t switchSize, char esc, char sep,
+						size_t recordSize, uint64_t fingerprint ) {
+	FifoParameters fpa;
+	fpa.switchSize = switchSize;
+	fpa.shardSize = 0;
+	fpa.escape[0] = recordSize > 0 ? ' ' : esc;
+	fpa.separator[0] = recordSize > 0 ? ' ' : sep;
+	fpa.recordSize = recordSize;
+	fpa.fingerprint = fingerprint;
+	return createqueue(&fpa, dirname);
+}
+
+/**
+ * Create the queue directory with the parameters, unless it exists with
+ * valid parameters.
+ */
+static int createqueue( FifoParameters* fpa, const char* dirname ) {
+	int res;
+	fpa->pathName = (char*) dirname;
+	fpa->dirfd = -1;
+	fpa->locks = NULL;
+	fpa->tail = NULL;
+	fpa->writers = -1;
+	fpa->slot = -1;
+
 	err(NULL);
+	if ( fpa->recordSize == 0 && fpa->escape[0] != ' ' && !fifoMarks(fpa) ) {
+		/* an escaped message would be read as a marker */
+		errno = EINVAL;
+		err("fifoCreate escape character of a marker:");
+		res = -1;
+		goto RETURN;
+	}
 	res = mkdir(dirname, 0777);
 	if ( res < 0 && errno != EEXIST ) {
 		err("fifoCreate mkdir:");
 		goto RETURN;
 	}
+	if ( fifoOpenDirectory(fpa, dirname) < 0 ) {
+		err("fifoCreate:");
+		res = -1;
+		goto RETURN;
+	}
 	if ( res < 0 ) {
 		/* directory existed already */
-		res = fifoReadParams(dirname, &fpa);
+		res = fifoReadParams(fpa);
 		if ( res < 0 ) {
 			err(NULL);
-			res = fifoWriteParams(dirname, &fpa);
+			res = fifoWriteParams(fpa);
 		}	
 	} else {
 		/* directory was just created */
-		res = fifoWriteParams(dirname, &fpa);
+		res = fifoWriteParams(fpa);
+	}
+RETURN:
+	fifoCloseDirectory(fpa);
+	return res;
+}
+
+/**
+ * Return 1, if the escape character of the queue frames markers, 0 if it is
+ * none or, in a queue created before it was refused, a marker character.
+ */
+static int fifoMarks( const FifoParameters* fpa ) {
+	return fpa->escape[0] != ' ' && memchr(markers, fpa->escape[0], sizeof(markers)) == NULL;
+}
+
+/**
+ * Create file queue like fifoCreate with the given number of priority lanes.
+ * Lane 0 is the queue itself, lanes 1 .. lanes-1 are queues in dir/l1, dir/l2, ..
+ * each with its own generations and pointers. Readers drain higher lanes first.
+ * The number of lanes of an existing queue is not changed.
+ */
+int fifoCreateLanes( const char* dirname, off_t switchSize, char esc, char sep, int lanes ) {
+	int i;
+	int fd = -1;
+	int res = -1;
+	char buffer[24];
+	char* path;
+	FifoParameters fpa;
+	fpa.pathName = (char*) dirname;
+	fpa.dirfd = -1;
+	fpa.locks = NULL;
+	fpa.tail = NULL;
+	fpa.writers = -1;
+	fpa.slot = -1;
+
+	if ( lanes <= 0 || lanes > FIFOLANES ) {
+		err(NULL);
+		errno = EINVAL;
+		err("fifoCreateLanes number of lanes:");
+		goto RETURN;
+	}
+	res = fifoCreate(dirname, switchSize, esc, sep);
+	if ( res < 0 ) {
+		err("fifoCreateLanes:");
+		goto RETURN;
+	}
+	res = fifoOpenDirectory(&fpa, dirname);
+	if ( res < 0 ) {
+		err("fifoCreateLanes:");
+		goto RETURN;
+	}
+	fd = openat(fpa.dirfd, LANEFILE, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if ( fd < 0 && errno != EEXIST ) {
+		errpath("fifoCreateLanes open:", LANEFILE);
+		res = -1;
+		goto RETURN;
+	}
+	if ( fd >= 0 ) {
+		sprintf(buffer, "%d\n", lanes);
+		if ( write(fd, buffer, strlen(buffer)) < 0 ) {
+			errpath("fifoCreateLanes write:", LANEFILE);
+			res = -1;
+			goto RETURN;
+		}
+	}
+	res = fifoReadCount(&fpa, LANEFILE);
+	if ( res <= 0 ) {
+		err("fifoCreateLanes:");
+		res = -1;
+		goto RETURN;
+	}
+	lanes = res;
+	for ( i = 1; i < lanes; ++i ) {
+		path = fifoSubqueuePath(dirname, LANEPREFIX, i);
+		if ( path == NULL ) {
+			res = -1;
+			goto RETURN;
+		}
+		res = fifoCreate(path, switchSize, esc, sep);
+		free(path);
+		if ( res < 0 ) {
+			err("fifoCreateLanes:");
+			goto RETURN;
+		}
 	}
+	res = 0;
 RETURN:
+	if ( fd >= 0 ) close(fd);
+	fifoCloseDirectory(&fpa);
 	return res;
 }
 
+/**
+ * Open file for writing.
+ * Take write locks during change of the write pointer file.
+ * The write pointer structure must be used in the same thread, which opened it.
+ * Return write pointer.
+ */
 FifoDescriptor* fifoOpenW( const char* filename ) {
+	err(NULL);
+	return openwriter(filename, -1, NULL);
+}
 
-	char* name;
+/**
+ * Open write pointer on the queue with the given name or, if dirfd >= 0,
+ * on the open queue directory.
+ * The first writer recovers the queue from a crash of its predecessors and
+ * stores the number of bytes cut off in recovered, if not NULL.
+ */
+static FifoDescriptor* openwriter(const char* filename, int dirfd, off_t* recovered) {
+
+	char name[FIFONAMELEN];
 	int res = -1;
-	long resl;
+	long resl = 0;
+	off_t cut;
+	int lres = -1;
+	int fres = -1;
+	struct stat st;
+	FifoTail* t;
 	FifoDescriptor* fwd;
 	FifoDescriptor* fp = NULL;
 
-	err(NULL);
 	fwd = (FifoDescriptor*) malloc(sizeof(*fwd));
 	if ( fwd == NULL ) {
 		err("fifoOpenW malloc descriptor:");
@@ -82,42 +661,90 @@ FifoDescriptor* fifoOpenW( const char* filename ) {
 
 	fwd->fdp = -1;
 	fwd->fd = -1;
+	fwd->filePointer = NULL;
+	fwd->lane = NULL;
+	fwd->producer = NULL;
+	fwd->transaction = NULL;
+	fwd->stats = NULL;
+	fwd->lanes = 1;
+	fwd->readLane = 0;
 
 	fwd->parameters = (FifoParameters*) malloc(sizeof(*fwd->parameters));
 	if ( fwd->parameters == NULL ) {
 		err("fifoOpenW malloc parameters:");
 		goto RETURN;
 	}
+	fwd->parameters->pathName = NULL;
+	fwd->parameters->archive = NULL;
+	fwd->parameters->dirfd = -1;
+	fwd->parameters->locks = NULL;
+	fwd->parameters->tail = NULL;
+	fwd->parameters->writers = -1;
+	fwd->parameters->slot = -1;
 
 	fwd->filePointer = (FifoFilePointer*) malloc(sizeof(*fwd->filePointer));
 	if ( fwd->filePointer == NULL ) {
-		err("fifoOpenR malloc filePointer:");
+		err("fifoOpenW malloc filePointer:");
 		goto RETURN;
 	}
+	fwd->filePointer->readPointerFile = NULL;
 
-	fwd->parameters->pathName = fifoAbsfilename(filename);
+	fwd->parameters->pathName = strdup(filename);
 	if ( fwd->parameters->pathName == NULL ) {
-		err("fifoOpenW fifoAbsfilename:");
+		err("fifoOpenW strdup:");
+		goto RETURN;
+	}
+
+	if ( dirfd >= 0 ) {
+		res = fifoDupDirectory(fwd->parameters, dirfd);
+	} else {
+		res = fifoOpenDirectory(fwd->parameters, filename);
+	}
+	if ( res < 0 ) {
+		err("fifoOpenW:");
 		goto RETURN;
 	}
 
-	res = fifoReadParams(filename, fwd->parameters);
+	res = fifoReadParams(fwd->parameters);
 	if ( res < 0 ) {
 		err("fifoOpenW read parameters:");
 		goto RETURN;
 	}
+	fifoStatsOpen(fwd, 'w', NULL);
+
+	res = fifoReadRetention(fwd->parameters);
+	if ( res < 0 ) {
+		err("fifoOpenW read retention:");
+		goto RETURN;
+	}
 	
 	res = fifoOpenFilePointer(fwd, NULL);
 	if ( res < 0 ) {
-		err("fifoOpenR open read pointer:");
+		err("fifoOpenW open write pointer:");
 		goto RETURN;
 	}
-	
-	takewritelock(fwd->fdp);
 
-	res = fifoReadFilePointer(fwd);
+	res = fifoMapTail(fwd->parameters);
+	if ( res < 0 ) {
+		err("fifoOpenW:");
+		goto RETURN;
+	}
+
+	res = fifoOpenLanes(fwd, NULL);
+	if ( res < 0 ) {
+		err("fifoOpenW:");
+		goto RETURN;
+	}
+
+	lres = lwlock(&fwd->parameters->locks->wadm);
+	fres = takewritelock(fwd->fdp);
+	if ( lres < 0 || fres < 0 ) {
+		err("fifoOpenW:");
+		goto RETURN;
+	}
+	res = fifoReadFilePointer(fwd); /* the write pointer */
 	if ( fwd->filePointer->current <= 0 ) {
-		resl = fifoGetCurrent(fwd->parameters->pathName);
+		resl = fifoGetCurrent(fwd->parameters);
 		fwd->filePointer->current = resl;
 	}
 
@@ -127,41 +754,73 @@ FifoDescriptor* fifoOpenW( const char* filename ) {
 		goto RETURN;
 	}
 
-	name = fifoCurrentAbsfilename(filename, fwd->current);
-	if ( name == NULL ) {
-		err("fifoOpenW fifoCurrentAbsfilename:");
+	fifoMakeShard(fwd->parameters, fwd->current);
+	fifoMakeShard(fwd->parameters, fwd->current + fwd->parameters->shardSize);
+	fifoCurrentFilename(fwd->parameters, fwd->current, name);
+	fwd->fd = openat(fwd->parameters->dirfd, name, O_WRONLY | O_CREAT, 0666);
+	if ( fwd->fd < 0 ) {
+		errpath("fifoOpenW open:", name);
 		goto RETURN;
 	}
 
-	fwd->fd = open(name ,O_WRONLY | O_CREAT, 0666);
-	free(name);
-	if ( fwd->fd < 0 ) {
-		err("fifoOpenW open ");
-		err(name);
-		err(":");
+	res = fifoWriterLock(fwd->parameters);
+	if ( res < 0 || fifoSlotTake(fwd->parameters) < 0 ) {
+		err("fifoOpenW:");
 		goto RETURN;
 	}
+	t = fwd->parameters->tail;
+	if ( res > 0 ) {
+		/* no other writer is open: repair the tail left by a crash */
+		cut = recover(fwd);
+		if ( fifoWriterShare(fwd->parameters) < 0 || cut < 0 ) {
+			err("fifoOpenW:");
+			goto RETURN;
+		}
+		if ( recovered ) *recovered = cut;
+	} else if ( atomic_load(&t->magic) != TAILMAGIC || atomic_load(&t->gen) != fwd->current ) {
+		/* first writer: continue at the end of the current data file */
+		if ( fstat(fwd->fd, &st) < 0 ) {
+			errpath("fifoOpenW fstat:", name);
+			goto RETURN;
+		}
+		atomic_store(&t->gen, fwd->current);
+		atomic_store(&t->messages, fwd->filePointer->messages);
+		atomic_store(&t->commit, TAILWORD(fwd->current, st.st_size));
+		atomic_store(&t->tail, TAILWORD(fwd->current, st.st_size));
+		atomic_store(&t->magic, TAILMAGIC);
+	}
 	
 	fifoWriteFilePointer(fwd);
 	fp = fwd;
 RETURN:
-	if ( fwd && fwd->fdp >= 0 ) releaselock(fwd->fdp);
+	if ( fres >= 0 ) releaselock(fwd->fdp);
+	if ( lres >= 0 ) lulock(&fwd->parameters->locks->wadm);
 	if ( fp == NULL ) {
-		if ( fwd && fwd->parameters ) {
-			if ( fwd->parameters->pathName ) {
-				free(fwd->parameters->pathName);
-			}
-			free(fwd->parameters);
-			free(fwd);
-		}
+		fifoFree(fwd);
 	}
 	return fp;
 }
 
+/**
+ * Open read stream for the file queue. Multiple read streams, identified by
+ * a unique name, can operate on the same file queue.
+ * Take a write lock on the read pointer file during operation.
+ * If the generation of the read pointer has already been removed,
+ * continue with the oldest remaining generation.
+ * The returned read pointer has to be used for all read and release operations
+ * for this read stream.
+ * Return read pointer.
+ */
 FifoDescriptor* fifoOpenR( const char* filename, const char* readpf) {
 
-	char* name;
+	char name[FIFONAMELEN];
 	int res = -1;
+	int lres = -1;
+	int fres = -1;
+	int fdm = -1;
+	int clamped = 0;
+	unsigned long first, last;
+	FifoManifest m;
 	FifoDescriptor* frd;
 	FifoDescriptor* fp = NULL;
 
@@ -172,32 +831,54 @@ FifoDescriptor* fifoOpenR( const char* filename, const char* readpf) {
 		goto RETURN;
 	}
 
+	frd->fd = -1;
+	frd->fdp = -1;
+	frd->filePointer = NULL;
+	frd->lane = NULL;
+	frd->producer = NULL;
+	frd->transaction = NULL;
+	frd->stats = NULL;
+	frd->lanes = 1;
+	frd->readLane = 0;
+
 	frd->parameters = (FifoParameters*) malloc(sizeof(*frd->parameters));
 	if ( frd->parameters == NULL ) {
 		err("fifoOpenR malloc parameters:");
 		goto RETURN;
 	}
-
-	frd->fd = -1;
-	frd->fdp = -1;
+	frd->parameters->pathName = NULL;
+	frd->parameters->archive = NULL;
+	frd->parameters->dirfd = -1;
+	frd->parameters->locks = NULL;
+	frd->parameters->tail = NULL;
+	frd->parameters->writers = -1;
+	frd->parameters->slot = -1;
 
 	frd->filePointer = (FifoFilePointer*) malloc(sizeof(*frd->filePointer));
 	if ( frd->filePointer == NULL ) {
 		err("fifoOpenR malloc filePointer:");
 		goto RETURN;
 	}
+	frd->filePointer->readPointerFile = NULL;
 
-	frd->parameters->pathName = fifoAbsfilename(filename);
+	frd->parameters->pathName = strdup(filename);
 	if ( frd->parameters->pathName == NULL ) {
-		err("fifoOpenR fifoAbsfilename:");
+		err("fifoOpenR strdup:");
+		goto RETURN;
+	}
+
+	res = fifoOpenDirectory(frd->parameters, filename);
+	if ( res < 0 ) {
+		err("fifoOpenR:");
 		goto RETURN;
 	}
 
-	res = fifoReadParams(filename, frd->parameters);
+	res = fifoReadParams(frd->parameters);
 	if ( res < 0 ) {
 		err("fifoOpenR read parameters:");
 		goto RETURN;
 	}
+	fifoStatsOpen(frd, 'r', readpf);
 	
 	res = fifoOpenFilePointer(frd, readpf);
 	if ( res < 0 ) {
@@ -205,774 +886,5241 @@ FifoDescriptor* fifoOpenR( const char* filename, const char* readpf) {
 		goto RETURN;
 	}
 
-	res = fifoReadFilePointer(frd);
+	res = fifoMapTail(frd->parameters);
+	if ( res < 0 ) {
+		err("fifoOpenR:");
+		goto RETURN;
+	}
 
-	name = fifoCurrentAbsfilename(filename, frd->filePointer->current);
-	if ( name == NULL ) {
-		err("fifoOpenR fifoCurrentAbsfilename:");
+	res = fifoOpenLanes(frd, readpf);
+	if ( res < 0 ) {
+		err("fifoOpenR:");
+		goto RETURN;
+	}
+	
+	lres = lwlock(&frd->parameters->locks->radm);
+	fres = takewritelock(frd->fdp);
+	if ( lres < 0 || fres < 0 ) {
+		err("fifoOpenRead:");
 		goto RETURN;
 	}
+	res = fifoReadFilePointer(frd);
+	/* the manifest lock keeps retention from removing the generation meanwhile */
+	fdm = manifestLock(frd->parameters, F_RDLCK, &m);
+	if ( fdm >= 0 ) {
+		first = m.first;
+	} else if ( fifoScanGenerations(frd->parameters, &first, &last) < 0 ) {
+		first = 0;
+	}
+	if ( frd->filePointer->current < first ) {
+		frd->filePointer->current = first;
+		frd->filePointer->readPos = 0;
+		frd->filePointer->releasePos = 0;
+		clamped = 1;
+	}
 
-	frd->fd = open(name, O_RDONLY|O_CREAT, 0666);
-	free(name);
+	fifoMakeShard(frd->parameters, frd->filePointer->current);
+	fifoCurrentFilename(frd->parameters, frd->filePointer->current, name);
+	frd->fd = openat(frd->parameters->dirfd, name, O_RDONLY|O_CREAT, 0666);
 	if ( frd->fd < 0 ) {
-		err("fifoOpenR open ");
-		err(name);
-		err(":");
+		errpath("fifoOpenR open:", name);
 		goto RETURN;
 	}
+	if ( fdm >= 0 ) manifestUnlock(frd->parameters, fdm);
+	fdm = -1;
+	if ( clamped ) {
+		fifoGenerationBase(frd->parameters, first, &frd->filePointer->base);
+		fifoWriteFilePointer(frd);
+	}
 	frd->current = frd->filePointer->current;
 	fp = frd;
 RETURN:
+	if ( fdm >= 0 ) manifestUnlock(frd->parameters, fdm);
+	if ( fres >= 0 ) releaselock(frd->fdp);
+	if ( lres >= 0 ) lulock(&frd->parameters->locks->radm);
 	if ( fp == NULL ) {
-		if ( frd ) {
-			if ( frd->parameters ) {
-				if ( frd->parameters->pathName ) {
-					free(frd->parameters->pathName);
-				}
-				free(frd->parameters);
-			}
-			if ( frd->filePointer ) {
-				if ( frd->filePointer->readPointerFile ) {
-					free(frd->filePointer->readPointerFile);
-				}
-				free(frd->filePointer);
-			}
-		free(frd);
-		}
+		fifoFree(frd);
 	}
 	return fp;
 }
 
+/**
+ * Write a message to the file queue.
+ * Format the message and write to current data file.
+ * In a record queue, write the records in buffer as they are, with a single
+ * reservation; size must be a multiple of the record size.
+ */
 ssize_t fifoWrite( FifoDescriptor* fwd, void* buffer, size_t size ) {
 
 	char* newbuffer;
 	ssize_t res = -1;
 	size_t siz = size;
+	const size_t rec = fwd->parameters->recordSize;
 
 	err(NULL);
+	if ( rec > 0 && (size == 0 || size % rec != 0) ) {
+		errno = EINVAL;
+		err("fifoWrite size is no multiple of the record size:");
+		return -1;
+	}
 	newbuffer = fifoFormatWriteBuffer(fwd->parameters, buffer, &siz);
 	if ( newbuffer == NULL ) {
 		err("fifoWrite:");
 		goto RETURN;
 	}
+	if ( fwd->transaction ) {
+		res = stage(fwd, newbuffer, siz);
+		goto RETURN;
+	}
 
-	res = writelocked(fwd, newbuffer, siz);
+	if ( fifoDue(fwd->parameters) && promote(fwd) < 0 ) {
+		/* the due messages stay delayed until the next attempt */
+		err(NULL);
+	}
+	res = writelocked(fwd, newbuffer, siz, rec > 0 ? (int) (size / rec) : 1, 0);
 
 RETURN:
 	if ( newbuffer && newbuffer != buffer ) free(newbuffer);
 	return res;
 
 }
-ssize_t fifoRead( FifoDescriptor* frd, void* buffer, size_t size ) {
-	ssize_t res;
-	err(NULL);
-	res = readlocked(frd, buffer, size);
-	return res;
-}
-ssize_t fifoRelease(FifoDescriptor* frd) {
-	err(NULL);
-	return release(frd);
-}
 
-void fifoCloseR( FifoDescriptor* fp ) {
-	err(NULL);
-	if ( fp == NULL ) return;
-	if ( fp->fd >= 0 ) close(fp->fd);
-	if ( fp->parameters ) {
-		if ( fp->parameters->pathName ) {
-			free(fp->parameters->pathName);
-		}
-		free(fp->parameters);
-	}
-	free(fp);
-}
+/**
+ * Write a message, which is not readable before the given time (seconds since
+ * the epoch). Until then it is kept in the time bucket dir/.delay/<time>.
+ * Due messages are written to the queue in time order by the next write
+ * or by a reader finding no message. Delayed messages cannot be part of
+ * a transaction.
+ */
+ssize_t fifoWriteAt( FifoDescriptor* fwd, time_t notBefore, void* buffer, size_t size ) {
 
-void fifoCloseW( FifoDescriptor* fp ) {
+	char* newbuffer;
+	ssize_t res = -1;
+	size_t siz = size;
+
+	if ( notBefore <= time(NULL) ) {
+		return fifoWrite(fwd, buffer, size);
+	}
 	err(NULL);
-	if ( fp == NULL ) return;
-	if ( fp->fd >= 0 ) close(fp->fd);
-	if ( fp->parameters ) {
-		if ( fp->parameters->pathName ) {
-			free(fp->parameters->pathName);
-		}
-		free(fp->parameters);
+	if ( fwd->transaction || fwd->parameters->recordSize > 0 ) {
+		errno = EINVAL;
+		err("fifoWriteAt delayed message in transaction or record queue:");
+		return -1;
 	}
-	free(fp);
-}
-
-
-static char* fifoParamsFilename(const char* dirname) {
-	int namelen;
-	char* name;
-	const char PARFILE[] = ".param";
-
-	namelen = strlen(dirname) + 2 + strlen(PARFILE);
-	name = (char*) malloc(namelen);
-	if ( name == NULL ) {
-		err("fifoParamsFilename malloc:");
+	newbuffer = fifoFormatWriteBuffer(fwd->parameters, buffer, &siz);
+	if ( newbuffer == NULL ) {
+		err("fifoWriteAt:");
 		goto RETURN;
 	}
-	strcpy(name, dirname);
-	strcat(name, "/");
-	strcat(name, PARFILE);
+
+	res = delaylocked(fwd, (uint64_t) notBefore, newbuffer, siz);
+
 RETURN:
-	return name;
+	if ( newbuffer && newbuffer != buffer ) free(newbuffer);
+	return res;
 }
 
-static int fifoWriteParams(const char* dirname, const FifoParameters* fpa ) {
-	int fd;
-	int res = -1;
-	char* name;
-	char buffer[50];
-	ssize_t wres;
-	long len;
+/**
+ * Write a message with binary header. Time and sequence number are set
+ * by the library, if 0; producer and attributes are taken from header.
+ * The header is escaped like the message, so it needs an escape character.
+ */
+ssize_t fifoWriteH( FifoDescriptor* fwd, FifoHeader* header, void* buffer, size_t size ) {
 
-	name = fifoParamsFilename(dirname);
-	if ( name == NULL ) {
-		err("fifoWriteParams:");
+	char* raw = NULL;
+	char* newbuffer = NULL;
+	ssize_t res = -1;
+	size_t siz;
+	struct timespec ts;
+	FifoParameters* fpa = fwd->parameters;
+
+	err(NULL);
+	if ( fpa->escape[0] == ' ' || header->attrSize > FIFOATTRLEN ) {
+		errno = EINVAL;
+		err("fifoWriteH no escape character or attributes too long:");
 		goto RETURN;
 	}
-
-	fd = open(name, O_WRONLY | O_CREAT, 0666);
-	if ( fd < 0 ) {
-		err("fifoWriteParams openw ");
-		err(name);
-		err(":");
+	if ( header->time == 0 ) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		header->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+	if ( header->sequence == 0 ) {
+		header->sequence = atomic_fetch_add(&fpa->tail->seq, 1) + 1;
+	}
+	siz = HEADLEN + header->attrSize + size;
+	raw = (char*) malloc(siz);
+	if ( raw == NULL ) {
+		err("fifoWriteH malloc:");
 		goto RETURN;
 	}
+	fifoPut(raw, header->time, 8);
+	fifoPut(raw + 8, header->sequence, 8);
+	fifoPut(raw + 16, header->producer, 4);
+	fifoPut(raw + 20, header->attrSize, 2);
+	if ( header->attrSize > 0 ) memcpy(raw + HEADLEN, header->attributes, header->attrSize);
+	memcpy(raw + HEADLEN + header->attrSize, buffer, size);
 
-	takewritelock(fd);
-	sprintf(buffer, "%ld ..\n", (long)fpa->switchSize);
-	len = strlen(buffer);
-	buffer[len-3] = fpa->escape[0];
-	buffer[len-2] = fpa->separator[0];
-	wres = write(fd, buffer, strlen(buffer));
-	if ( wres < 0 ) {
-		err("fifoWriteParams write:");
+	newbuffer = fifoFormatWriteBuffer(fpa, raw, &siz);
+	if ( newbuffer == NULL ) {
+		err("fifoWriteH:");
 		goto RETURN;
 	}
-	res = 0;
-RETURN:
-	if ( fd >= 0 ) {
-		close(fd);
+	/* mark the message: escape and HEADMARK, which is never escaped otherwise */
+	free(raw);
+	raw = (char*) malloc(siz + 2);
+	if ( raw == NULL ) {
+		err("fifoWriteH malloc:");
+		goto RETURN;
+	}
+	raw[0] = fpa->escape[0];
+	raw[1] = HEADMARK;
+	memcpy(raw + 2, newbuffer, siz);
+	if ( fwd->transaction ) {
+		res = stage(fwd, raw, siz + 2);
+		goto RETURN;
 	}
-	if ( name ) free(name);
+
+	if ( fifoDue(fpa) && promote(fwd) < 0 ) {
+		err(NULL);
+	}
+	res = writelocked(fwd, raw, siz + 2, 1, 0);
+
+RETURN:
+	if ( newbuffer ) free(newbuffer);
+	if ( raw ) free(raw);
 	return res;
 }
 
-static int fifoReadParams(const char* dirname, FifoParameters* fpa ) {
-	int fd;
+/**
+ * Make the write pointer an idempotent producer with the given id (> 0).
+ * The high-water mark of its sequence numbers is kept in dir/.pd_<id> and
+ * locked, so only one write pointer acts for a producer. With it the end of
+ * the committed data is kept: messages written before a crash, but missed by
+ * the high-water mark, are found behind it, in the data files written since.
+ * Return the highest sequence number written, so the producer continues
+ * with the next one.
+ */
+int fifoProducer( FifoDescriptor* fwd, uint32_t producer, uint64_t* sequence ) {
+	char name[FIFONAMELEN];
 	int res = -1;
-	char* name;
-	char buffer[50];
-	ssize_t rres;
-	long len;
-
-	fpa->switchSize = 0L;
-	fpa->escape[0] = ' ';
-	fpa->separator[0] = ' ';
+	int fd = -1;
+	void* p;
+	uint64_t hwm;
+	unsigned long gen, g;
+	int old;
+	FifoProducer* pd = NULL;
+	FifoParameters* fpa = fwd->parameters;
 
-	name = fifoParamsFilename(dirname);
-	if ( name == NULL ) {
-		err("fifoReadParams:");
+	err(NULL);
+	if ( producer == 0 || fwd->producer ) {
+		errno = EINVAL;
+		err("fifoProducer no producer id or already set:");
 		goto RETURN;
 	}
-
-	fd = open(name, O_RDONLY);
+	sprintf(name, "%s%lu", PRODPREFIX, (unsigned long) producer);
+	fd = openat(fpa->dirfd, name, O_RDWR | O_CREAT, 0666);
 	if ( fd < 0 ) {
-		err("fifoReadParams open ");
-		err(name);
-		err(":");
+		errpath("fifoProducer open:", name);
 		goto RETURN;
 	}
-	
-	takereadlock(fd);
-	rres = read(fd, buffer, sizeof(buffer)-1);
-	if ( rres < 0 ) {
-		err("fifoReadParams read:");
+	if ( trylock(fd, F_WRLCK) < 0 ) {
+		errpath("fifoProducer in use:", name);
 		goto RETURN;
 	}
-	buffer[rres] = 0;
-	sscanf(buffer, "%ld ", &fpa->switchSize);
-	len = strlen(buffer);
-	fpa->escape[0] = buffer[len-3];
-	fpa->separator[0] = buffer[len-2];
-	fpa->rollmark[0] = fpa->escape[0];
-	fpa->rollmark[1] = '@';
-	fpa->rollmark[2] = fpa->separator[0];
-	fpa->rollmark[3] = '\0';
-	res = 0;
-RETURN:
-	if ( fd >= 0 ) {
-		close(fd);
+	if ( ftruncate(fd, PRODWORDS * sizeof(uint64_t)) < 0 ) {
+		errpath("fifoProducer truncate:", name);
+		goto RETURN;
 	}
-	if ( name ) free(name);
-	return res;
-}
+	p = mmap(NULL, PRODWORDS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( p == MAP_FAILED ) {
+		errpath("fifoProducer mmap:", name);
+		goto RETURN;
+	}
+	pd = (FifoProducer*) malloc(sizeof(*pd));
+	if ( pd == NULL ) {
+		munmap(p, PRODWORDS * sizeof(uint64_t));
+		err("fifoProducer malloc:");
+		goto RETURN;
+	}
+	pd->id = producer;
+	pd->fd = fd;
+	pd->hwm = (uint64_t*) p;
+	fd = -1;
 
-static char* fifoAbsfilename( const char* filename ) {
-	char* dname;
-	char* name = NULL;
-	
-	if ( filename[0] != '/' ) {
-		dname = (char*) malloc(_POSIX_PATH_MAX+1);	
-		if ( dname == NULL ) goto RETURN;
-		if ( getcwd(dname, _POSIX_PATH_MAX+1) == NULL ) goto RETURN;
-		name = (char*) malloc(strlen(dname) + strlen(filename) + 2);
-		if ( name == NULL ) goto RETURN;
-		strcpy(name, dname);
-		strcat(name, "/");
-		strcat(name, filename);
-		free(dname);
-	} else {
-		name = (char*) malloc(strlen(filename) + 1);
-		if ( name == NULL ) goto RETURN;
-		strcpy(name, filename);
+	/* messages written after the mark was set, before a crash; a file of an
+	 * older version has no position: scan the current and previous generation */
+	hwm = pd->hwm[0];
+	gen = atomic_load(&fpa->tail->gen);
+	old = hwm != 0 && pd->hwm[1] == 0 && pd->hwm[2] == 0;
+	for ( g = gen; ; --g ) {
+		res = fifoScanProducer(fpa, g, producer, g == pd->hwm[1] && !old ? (off_t) pd->hwm[2] : 0, &hwm);
+		if ( res != 0 || g == 0 || g <= pd->hwm[1] || (old && g < gen) ) break;
+	}
+	if ( res < 0 ) {
+		err("fifoProducer:");
+		goto RETURN;
 	}
+	res = -1;
+	fifoProducerMark(fpa, pd, hwm);
+	*sequence = hwm;
+	fwd->producer = pd;
+	pd = NULL;
+	res = 0;
 RETURN:
-	return name;
+	if ( fd >= 0 ) close(fd);
+	fifoFreeProducer(pd);
+	return res;
 }
 
-static size_t fifoNamelen(int c) {
-	return c - 'A' + 1;
-}
+/**
+ * Write a message with the next sequence number of the producer.
+ * A sequence number not above the high-water mark is a duplicate:
+ * the message is dropped and 0 returned. In a transaction, the high-water
+ * mark is advanced at commit.
+ */
+ssize_t fifoWriteSeq( FifoDescriptor* fwd, uint64_t sequence, void* buffer, size_t size ) {
+	FifoHeader header;
+	ssize_t res;
+	uint64_t last;
+	FifoProducer* pd = fwd->producer;
+	FifoTransaction* tx = fwd->transaction;
 
-static char* fifoFilename(unsigned long current, char* name) {
-	sprintf(name+1, "%lu", current );
-	name[0] = 'A' + strlen(name+1) - 1;
-	return name;
+	err(NULL);
+	if ( pd == NULL || sequence == 0 ) {
+		errno = EINVAL;
+		err("fifoWriteSeq no producer or sequence number:");
+		return -1;
+	}
+	last = pd->hwm[0];
+	if ( tx && tx->sequence > last ) last = tx->sequence;
+	if ( sequence <= last ) {
+		/* duplicate */
+		return 0;
+	}
+	memset(&header, 0, sizeof(header));
+	header.producer = pd->id;
+	header.sequence = sequence;
+	res = fifoWriteH(fwd, &header, buffer, size);
+	if ( res >= 0 && tx ) {
+		tx->sequence = sequence;
+	} else if ( res >= 0 ) {
+		fifoProducerMark(fwd->parameters, pd, sequence);
+	}
+	return res;
 }
 
-static char* fifoCurrentAbsfilename(const char* dirname, unsigned long current) {
-	char* name = (char*) malloc(strlen(dirname) + 26 );
-	if ( name == NULL) goto RETURN;
-	strcpy(name, dirname);
-	strcat(name, "/");
-	fifoFilename(current, name+strlen(name));
-RETURN:
-	return name;
-}
+/**
+ * Begin a transaction on the write pointer. The following messages are
+ * staged in memory and written by fifoCommit as a group, which the readers
+ * see completely or not at all. The group is framed by escape 'B' with its
+ * size and escape 'C', so it needs a queue with escape character.
+ */
+int fifoBegin( FifoDescriptor* fwd ) {
+	FifoTransaction* tx;
 
-static long fifoGetCurrent(const char* filename) {
+	err(NULL);
+	if ( fwd->transaction || !fifoMarks(fwd->parameters) ) {
+		errno = EINVAL;
+		err("fifoBegin transaction active or no escape character for markers:");
+		return -1;
+	}
+	tx = (FifoTransaction*) calloc(1, sizeof(*tx));
+	if ( tx == NULL ) {
+		err("fifoBegin malloc:");
+		return -1;
+	}
+	fwd->transaction = tx;
+	return 0;
+}
 
-	DIR* dir;
-	unsigned long res;
-	unsigned long max = -1;
-	struct dirent* dirent;
-	char *cp;
+/**
+ * Commit the transaction of the write pointer. The staged messages are
+ * written with a single reservation, so the group is never split by rollover,
+ * and synced to disk before the commit watermark makes them visible.
+ * The transaction ends in any case.
+ * Return number of messages committed.
+ */
+int fifoCommit( FifoDescriptor* fwd ) {
+	char* buffer = NULL;
+	int res = -1;
+	int n;
+	FifoTransaction* tx = fwd->transaction;
+	FifoParameters* fpa = fwd->parameters;
 
-	dir = opendir(filename);
-	if ( dir == NULL ) {
-		err("fifoGetCurrent opendir ");
-		err(filename);
-		err(":");
+	err(NULL);
+	if ( tx == NULL ) {
+		errno = EINVAL;
+		err("fifoCommit no transaction:");
+		return -1;
+	}
+	if ( tx->count == 0 ) {
+		res = 0;
 		goto RETURN;
 	}
-
-	max = 0;
-	while ( (dirent = readdir(dir)) ) {
-		if ( fifoNamelen(dirent->d_name[0])+1 == strlen(dirent->d_name)) {
-			res = strtoul(dirent->d_name+1, &cp, 10);
-			if ( res == ULONG_MAX ) continue;
-			if ( *cp ) continue;
-			if ( res > max ) {
-				max = res;
-			}
-		}
+	buffer = (char*) malloc(tx->size + 32);
+	if ( buffer == NULL ) {
+		err("fifoCommit malloc:");
+		goto RETURN;
 	}
+	n = sprintf(buffer, "%c%c%lu%c", fpa->escape[0], TXBEGIN, (unsigned long) tx->size, fpa->separator[0]);
+	memcpy(buffer + n, tx->buffer, tx->size);
+	n += tx->size;
+	buffer[n++] = fpa->escape[0];
+	buffer[n++] = TXCOMMIT;
+	buffer[n++] = fpa->separator[0];
 
+	if ( fifoDue(fpa) && promote(fwd) < 0 ) {
+		err(NULL);
+	}
+	if ( writelocked(fwd, buffer, n, tx->count, 1) < 0 ) {
+		err("fifoCommit:");
+		goto RETURN;
+	}
+	if ( fwd->producer && tx->sequence > fwd->producer->hwm[0] ) {
+		fifoProducerMark(fpa, fwd->producer, tx->sequence);
+	}
+	res = tx->count;
 RETURN:
-	if ( dir ) closedir(dir);
-	return max;
+	if ( buffer ) free(buffer);
+	fifoFreeTransaction(tx);
+	fwd->transaction = NULL;
+	return res;
 }
 
-static char* fifoFormatWriteBuffer(FifoParameters *fp, const char* buffer, size_t *size) {
+/**
+ * Abort the transaction of the write pointer: drop the staged messages.
+ * Nothing has been written, so the readers see none of them.
+ * Return number of messages dropped.
+ */
+int fifoAbort( FifoDescriptor* fwd ) {
+	int res;
 
-	int res = 0;
-	char* newbuffer;
-	char ch;
-	size_t siz = *size;
-	size_t i;
-	size_t j;
+	err(NULL);
+	if ( fwd->transaction == NULL ) {
+		errno = EINVAL;
+		err("fifoAbort no transaction:");
+		return -1;
+	}
+	res = fwd->transaction->count;
+	fifoFreeTransaction(fwd->transaction);
+	fwd->transaction = NULL;
+	return res;
+}
 
-	if ( fp->escape[0] == ' ' ) return (char*) buffer;
-	for ( i = 0; i < siz; ++i ) {
-		ch = buffer[i];
-		if ( ch == fp->escape[0] || ch == fp->separator[0] ) {
-			res += 1;
-		}
+/**
+ * Write a message into the given priority lane of the file queue.
+ * Lane 0 is the queue itself. A transaction covers lane 0 only.
+ */
+ssize_t fifoWriteLane( FifoDescriptor* fwd, int lane, void* buffer, size_t size ) {
+	if ( lane == 0 ) {
+		return fifoWrite(fwd, buffer, size);
 	}
-	newbuffer = (char*) malloc(siz + res + 2);
-	if ( newbuffer == NULL ) return NULL;
+	if ( lane < 0 || lane >= fwd->lanes || fwd->transaction ) {
+		err(NULL);
+		errno = EINVAL;
+		err("fifoWriteLane no such lane or transaction:");
+		return -1;
+	}
+	return fifoWrite(fwd->lane[lane-1], buffer, size);
+}
 
-	for ( i = 0, j = 0; i < siz; ++i ) {
-		ch = buffer[i];
-		if ( ch == fp->escape[0] || ch == fp->separator[0] ) {
-			newbuffer[j++] = fp->escape[0];
-		}
-		newbuffer[j++] = ch;
+/**
+ * Read a message from open read stream of file queue.
+ * The message must fit into the provided buffer.
+ * Undo the message formatting done during write.
+ * With priority lanes, the message is taken from the highest non-empty lane.
+ */
+ssize_t fifoRead( FifoDescriptor* frd, void* buffer, size_t size ) {
+	ssize_t res;
+	err(NULL);
+	res = readlanes(frd, buffer, size);
+	if ( res < 0 && errno == EAGAIN && fifoDue(frd->parameters) && promotereader(frd) > 0 ) {
+		/* delayed messages became readable */
+		res = readlanes(frd, buffer, size);
 	}
-	newbuffer[j++] = fp->separator[0];
-	newbuffer[j] = '\0';
-	*size = j; 
-	return newbuffer;
+	if ( res >= 0 ) {
+		res = fifoStripHeader(frd, buffer, res);
+	}
+	return res;
 }
 
-static int dolock(int fd, int type) {
+/**
+ * Read a message with waiting like fifoReadW, but leave the payload in place:
+ * return its size and let payload point into buffer behind the binary header.
+ * The header is filled from the message, or set to 0 for a message without
+ * header; its attributes point into buffer.
+ */
+ssize_t fifoReadH( FifoDescriptor* frd, void* buffer, size_t size, long wtim, long maxtime,
+					FifoHeader* header, void** payload ) {
+	ssize_t res;
+	char* p;
+	err(NULL);
+	res = readwait(frd, buffer, size, wtim, maxtime);
+	if ( res >= 0 ) {
+		res = fifoParseHeader(frd, buffer, res, header, &p);
+		*payload = p;
+	}
+	return res;
+}
 
-	int fres;
-	struct flock flock;
+/**
+ * Release the previously read message from the open read stream.
+ * If no unreleased message exists, silently ignore this call.
+ * Note: only data files, which do not contain unreleased messages by any
+ * read pointer may be removed from file system.
+ */
+ssize_t fifoRelease(FifoDescriptor* frd) {
+	err(NULL);
+	return releaselane(frd);
+}
 
-	flock.l_whence = SEEK_SET;
-	flock.l_start = 0;
-	flock.l_len = 0;
+/**
+ * Check from the shared headers of its lanes without lock or system call,
+ * whether the read pointer may find a message. Return 1, if data is committed
+ * beyond its read position or delayed messages are due; 2, if data is reserved,
+ * but not yet committed, so the check is to be repeated soon; 0 otherwise.
+ * If due is not NULL, it is set to the time of the earliest delayed messages,
+ * 0 if none. A shared read pointer may have been advanced by others, so a read
+ * may still find no message.
+ */
+int fifoReadable( FifoDescriptor* frd, time_t* due ) {
+	int res = 0;
+	int i;
+	uint64_t w, d;
+	FifoDescriptor* fp;
+	FifoTail* t;
 
-	flock.l_type = type;
-	fres = fcntl(fd, F_SETLKW, &flock);
-	return fres;
+	if ( due ) *due = 0;
+	for ( i = 0; i < frd->lanes && res != 1; ++i ) {
+		fp = i == 0 ? frd : frd->lane[i-1];
+		t = fp->parameters->tail;
+		if ( atomic_load(&t->magic) != TAILMAGIC || fp->filePointer->current < atomic_load(&t->gen) ) {
+			/* unknown state or older generations to read */
+			res = 1;
+			break;
+		}
+		w = atomic_load(&t->commit);
+		if ( TAILSAME(w, fp->filePointer->current) && TAILPOS(w) > fp->filePointer->readPos ) {
+			res = 1;
+		} else if ( atomic_load(&t->tail) != w ) {
+			res = 2;
+		}
+		d = atomic_load(&t->due);
+		if ( d != 0 && d <= (uint64_t) time(NULL) ) {
+			res = 1;
+		} else if ( d != 0 && due && (*due == 0 || (time_t) d < *due) ) {
+			*due = (time_t) d;
+		}
+	}
+	return res;
 }
 
-static int takewritelock(int fd ) {
-	return dolock(fd, F_WRLCK);
-}
+/**
+ * Create a set of read descriptors, whose queues are waited for together by
+ * fifoPoll in one thread. On Linux fpl->fd is an inotify descriptor watching
+ * the directories of the queues; it becomes readable, when a queue of the set
+ * changes, and may be added to poll, select or epoll. Elsewhere it is -1 and
+ * fifoPoll checks the queues every POLLINTERVAL ms.
+ */
+FifoPoll* fifoPollCreate( void ) {
+	FifoPoll* fpl = NULL;
+	FifoPoll* res = NULL;
 
-static int takereadlock(int fd ) {
-	return dolock(fd, F_RDLCK);
+	err(NULL);
+	fpl = (FifoPoll*) calloc(1, sizeof(*fpl));
+	if ( fpl == NULL ) {
+		err("fifoPollCreate malloc:");
+		goto RETURN;
+	}
+	fpl->fd = -1;
+	fpl->wait = -1;
+#ifdef __linux__
+	fpl->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ( fpl->fd < 0 ) {
+		err("fifoPollCreate inotify_init1:");
+		goto RETURN;
+	}
+#endif
+	res = fpl;
+RETURN:
+	if ( res == NULL ) {
+		pollfree(fpl);
+	}
+	return res;
 }
 
-static int releaselock(int fd ) {
-	return dolock(fd, F_UNLCK);
+/**
+ * Add the read descriptor to the set. It must be removed, before it is closed.
+ */
+int fifoPollAdd( FifoPoll* fpl, FifoDescriptor* frd ) {
+	int res = -1;
+	int i, n;
+	FifoDescriptor** desc;
+	int* wd;
+	unsigned long* shard;
+
+	err(NULL);
+	for ( i = 0; i < fpl->count; ++i ) {
+		if ( fpl->desc[i] == frd ) {
+			errno = EEXIST;
+			err("fifoPollAdd descriptor in set:");
+			goto RETURN;
+		}
+	}
+	if ( fpl->count == fpl->size ) {
+		n = fpl->size > 0 ? 2 * fpl->size : 16;
+		desc = (FifoDescriptor**) realloc(fpl->desc, n * sizeof(*desc));
+		if ( desc != NULL ) fpl->desc = desc;
+		wd = (int*) realloc(fpl->wd, n * POLLWATCHES * sizeof(*wd));
+		if ( wd != NULL ) fpl->wd = wd;
+		shard = (unsigned long*) realloc(fpl->shard, n * sizeof(*shard));
+		if ( shard != NULL ) fpl->shard = shard;
+		if ( desc == NULL || wd == NULL || shard == NULL ) {
+			err("fifoPollAdd malloc:");
+			goto RETURN;
+		}
+		fpl->size = n;
+	}
+	i = fpl->count++;
+	fpl->desc[i] = frd;
+	fpl->shard[i] = 0;
+	wd = &fpl->wd[i * POLLWATCHES];
+	for ( n = 0; n < POLLWATCHES; ++n ) {
+		wd[n] = -1;
+	}
+	for ( n = 0; n < frd->lanes; ++n ) {
+		wd[n] = pollwatch(fpl, (n == 0 ? frd : frd->lane[n-1])->parameters->dirfd, NULL);
+		if ( wd[n] < 0 && fpl->fd >= 0 ) {
+			errpath("fifoPollAdd inotify_add_watch:", (n == 0 ? frd : frd->lane[n-1])->parameters->pathName);
+			pollremove(fpl, i);
+			goto RETURN;
+		}
+	}
+	pollshard(fpl, i);
+	res = 0;
+RETURN:
+	return res;
 }
 
-static int rolloverfile(FifoDescriptor* fwd) {
-	char* filename = NULL;
-	int fd = fwd->fd;
-	unsigned long newcurrent;
+/**
+ * Remove the read descriptor from the set.
+ */
+int fifoPollRemove( FifoPoll* fpl, FifoDescriptor* frd ) {
+	int i;
+
+	err(NULL);
+	for ( i = 0; i < fpl->count; ++i ) {
+		if ( fpl->desc[i] == frd ) {
+			pollremove(fpl, i);
+			return 0;
+		}
+	}
+	errno = ENOENT;
+	err("fifoPollRemove descriptor not in set:");
+	return -1;
+}
 
-	int fd2 = -1;
+/**
+ * Wait up to timeout ms (negative: without limit), until read descriptors of
+ * the set may find a message, and put up to max of them into ready. The
+ * descriptors are visited round robin, starting behind the last one reported,
+ * so no queue is starved. Return their number, 0 after timeout, -1 on error.
+ * Like poll, a queue is reported as long as it holds unread messages; a shared
+ * read pointer may have been advanced by others, so a read may find none.
+ * fpl->wait is set to the ms, after which the set has to be checked again
+ * without an event on fpl->fd (commits of reserved data, delayed messages and
+ * readable descriptors beyond max: 0), -1 if not needed. An event loop watching fpl->fd calls fifoPoll with timeout
+ * 0, when it becomes readable or fpl->wait expired.
+ */
+int fifoPoll( FifoPoll* fpl, FifoDescriptor** ready, int max, long timeout ) {
 	int res = -1;
-	char* rollmark = fwd->parameters->rollmark;
+	int i, k, n;
+	int last = 0;
+	int more;
+	long wait, step, elapsed;
+	time_t due, now;
+	struct timespec start, ts;
+	struct pollfd pfd;
+	char events[4096];
 
-	res = takewritelock(fwd->fdp);
+	err(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for ( ;; ) {
+		/* the events are only a wakeup, all queues are checked */
+		while ( fpl->fd >= 0 && read(fpl->fd, events, sizeof(events)) > 0 );
+		n = 0;
+		more = 0;
+		wait = fpl->fd >= 0 ? -1 : POLLINTERVAL;
+		now = time(NULL);
+		for ( i = 0; i < fpl->count; ++i ) {
+			k = (fpl->next + i) % fpl->count;
+			pollshard(fpl, k);
+			switch ( fifoReadable(fpl->desc[k], &due) ) {
+			case 1:
+				if ( n < max ) {
+					ready[n++] = fpl->desc[k];
+					last = k;
+				} else {
+					more = 1;
+				}
+				break;
+			case 2:
+				wait = POLLRETRY;
+				break;
+			default:
+				if ( due != 0 && (wait < 0 || (due - now) * 1000 < wait) ) {
+					wait = due > now ? (due - now) * 1000 : 0;
+				}
+				break;
+			}
+		}
+		/* the events were drained: readable ones left out are checked at once */
+		fpl->wait = more ? 0 : wait;
+		if ( n > 0 ) {
+			fpl->next = (last + 1) % fpl->count;
+			res = n;
+			goto RETURN;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		elapsed = (ts.tv_sec - start.tv_sec) * 1000 + (ts.tv_nsec - start.tv_nsec) / 1000000;
+		if ( timeout >= 0 && elapsed >= timeout ) {
+			res = 0;
+			goto RETURN;
+		}
+		step = timeout < 0 || (wait >= 0 && wait < timeout - elapsed) ? wait : timeout - elapsed;
+		pfd.fd = fpl->fd;
+		pfd.events = POLLIN;
+		if ( poll(&pfd, 1, step > INT_MAX ? INT_MAX : (int) step) < 0 && errno != EINTR ) {
+			err("fifoPoll poll:");
+			goto RETURN;
+		}
+	}
+RETURN:
+	return res;
+}
 
-	if (fd >= 0) write(fd, rollmark, strlen(rollmark));
+/**
+ * Free the set and remove its watches. The read descriptors stay open.
+ */
+void fifoPollClose( FifoPoll* fpl ) {
+	err(NULL);
+	pollfree(fpl);
+}
 
+/**
+ * Close read pointer.
+ */
+void fifoCloseR( FifoDescriptor* fp ) {
+	err(NULL);
+	fifoFree(fp);
+}
 
-	if ( res < 0 ) {
-		err("rolloverfile:");
-		goto RETURN;
-	}
-	
-	res = fifoReadFilePointer(fwd);
-	if ( res < 0 ) {
-		err("rolloverfile:");
-		goto RETURN;
+/**
+ * Close write pointer.
+ */
+void fifoCloseW( FifoDescriptor* fp ) {
+	err(NULL);
+	fifoFree(fp);
+}
+
+/**
+ * Store retention policy of the file queue in dir/.retain.
+ * Writers of the queue, which are opened later, remove released generations
+ * after each rollover according to this policy (see fifoCollect).
+ * A partitioned queue stores the policy in each partition, a queue with
+ * priority lanes in each lane.
+ */
+int fifoRetention(const char* dirname, long maxAge, off_t maxBytes, const char* archive) {
+	int res;
+	int i, n;
+	char* path;
+	FifoParameters fpa;
+	err(NULL);
+	fpa.pathName = (char*) dirname;
+	if ( fifoOpenDirectory(&fpa, dirname) < 0 ) {
+		err("fifoRetention:");
+		return -1;
 	}
-	
-	newcurrent = fwd->filePointer->current; 
-	if ( newcurrent == fwd->current ) {
-		newcurrent = fwd->current + 1;
+	n = fifoReadCount(&fpa, PARTFILE);
+	if ( n != 0 ) {
+		/* partitioned queue: store policy in each partition */
+		fifoCloseDirectory(&fpa);
+		for ( i = 0, res = n < 0 ? -1 : 0; i < n && res >= 0; ++i ) {
+			path = fifoSubqueuePath(dirname, PARTPREFIX, i);
+			res = path ? fifoRetention(path, maxAge, maxBytes, archive) : -1;
+			free(path);
+		}
+		return res;
 	}
-	filename = fifoCurrentAbsfilename(fwd->parameters->pathName, newcurrent);
-	if ( filename == NULL ) {
-		err("rolloverfile new filename:");
-		goto RETURN;
+	fpa.maxAge = maxAge;
+	fpa.maxBytes = maxBytes;
+	fpa.archive = (char*) archive;
+	res = fifoWriteRetention(&fpa);
+	n = fifoReadCount(&fpa, LANEFILE);
+	fifoCloseDirectory(&fpa);
+	for ( i = 1; i < n && res >= 0; ++i ) {
+		/* same policy for all priority lanes */
+		path = fifoSubqueuePath(dirname, LANEPREFIX, i);
+		res = path ? fifoRetention(path, maxAge, maxBytes, archive) : -1;
+		free(path);
 	}
-	fd2 = open(filename, O_WRONLY|O_CREAT, 0666);
-	if ( fd2 < 0 ) {
-		err("rolloverfile create and open new file ");
-		err(filename);
-		err(":");
+	return res;
+}
+
+/**
+ * Remove (or move to archive directory) all data file generations, which
+ * have been released by all read pointers. If maxAge > 0, also remove
+ * generations not modified since maxAge seconds. If maxBytes > 0, also
+ * remove oldest generations until the total size of the queue is below.
+ * Read pointers are advanced beyond removed generations.
+ * A partitioned queue is collected partition by partition, priority lanes
+ * lane by lane.
+ * Return the number of removed generations.
+ */
+long fifoCollect(const char* dirname, long maxAge, off_t maxBytes, const char* archive) {
+	long res = -1L;
+	long resl;
+	int i, n;
+	char* path;
+	FifoParameters fpa;
+	err(NULL);
+	fpa.pathName = (char*) dirname;
+	if ( fifoOpenDirectory(&fpa, dirname) < 0 ) {
+		err("fifoCollect:");
 		goto RETURN;
 	}
-	fwd->current = newcurrent;
-	fwd->filePointer->current = newcurrent;
-	res = fifoWriteFilePointer(fwd);
-	if ( res < 0 ) {
-		err("rolloverfile:");
+	n = fifoReadCount(&fpa, PARTFILE);
+	if ( n != 0 ) {
+		/* partitioned queue: collect each partition */
+		for ( i = 0, res = n < 0 ? -1L : 0L; i < n && res >= 0; ++i ) {
+			path = fifoSubqueuePath(dirname, PARTPREFIX, i);
+			resl = path ? fifoCollect(path, maxAge, maxBytes, archive) : -1L;
+			free(path);
+			res = resl < 0 ? -1L : res + resl;
+		}
 		goto RETURN;
 	}
-	releaselock(fwd->fdp);
-
-	res = takewritelock(fd2);
-	if ( res < 0 ) {
-		err("rolloverfile:");
+	if ( fifoReadParams(&fpa) < 0 ) {
+		err("fifoCollect:");
 		goto RETURN;
 	}
-	close(fd);
-	res = dup2(fd2, fd);
-	if ( res < 0 ) {
-		err("rolloverfile dup:");
+	fpa.maxAge = maxAge;
+	fpa.maxBytes = maxBytes;
+	fpa.archive = (char*) archive;
+	res = collect(&fpa, 1);
+	n = fifoReadCount(&fpa, LANEFILE);
+	for ( i = 1; i < n && res >= 0; ++i ) {
+		/* priority lanes are collected separately */
+		path = fifoSubqueuePath(dirname, LANEPREFIX, i);
+		resl = path ? fifoCollect(path, maxAge, maxBytes, archive) : -1L;
+		free(path);
+		res = resl < 0 ? -1L : res + resl;
 	}
 RETURN:
-	if ( fd2 >= 0 ) close(fd2);
-	if ( filename ) free(filename);
+	fifoCloseDirectory(&fpa);
 	return res;
 }
 
-static ssize_t writelocked(FifoDescriptor* fwd, const char* buffer, size_t size) {
-
-	ssize_t wres = -1;
-	off_t sres;
-	int fres;
-	int res;
-	const int fd = fwd->fd;
-	const off_t max = fwd->parameters->switchSize;
-
-	fres = takewritelock(fd);
-	if ( fres < 0 ) {
-		err("writelocked takewritelock:");
+/**
+ * Recover the queue after a crash of its writers, like the first fifoOpenW
+ * does: cut off an incomplete record or transaction group at the end of the
+ * current data file and repair write and read pointers. Fails with errno EAGAIN,
+ * if a writer of the queue is open. A partitioned queue is recovered partition
+ * by partition, priority lanes with their queue.
+ * Return number of bytes cut off.
+ */
+off_t fifoRecover(const char* dirname) {
+	off_t res = -1;
+	off_t cut = -1;
+	int i, n;
+	char* path;
+	FifoDescriptor* fwd;
+	FifoParameters fpa;
+	err(NULL);
+	fpa.pathName = (char*) dirname;
+	if ( fifoOpenDirectory(&fpa, dirname) < 0 ) {
+		err("fifoRecover:");
 		goto RETURN;
 	}
-	sres = lseek(fd, 0, SEEK_END);
-
-	while ( sres > 0 && sres + (off_t) size > max ) {
-		res = rolloverfile(fwd);
-		if ( res < 0 ) {
-			err("writelocked:");
-			goto RETURN;
+	n = fifoReadCount(&fpa, PARTFILE);
+	if ( n != 0 ) {
+		/* partitioned queue: recover each partition */
+		for ( i = 0, res = n < 0 ? -1 : 0; i < n && res >= 0; ++i ) {
+			path = fifoSubqueuePath(dirname, PARTPREFIX, i);
+			cut = path ? fifoRecover(path) : -1;
+			free(path);
+			res = cut < 0 ? -1 : res + cut;
 		}
-		sres = lseek(fd, 0, SEEK_END);
+		goto RETURN;
 	}
-	if ( sres < 0 ) {
-		err("writelocked: lseek failed:");
+	fwd = openwriter(dirname, fpa.dirfd, &cut);
+	if ( fwd == NULL ) {
+		err("fifoRecover:");
 		goto RETURN;
 	}
-	wres = write(fd, buffer, size);
-	if ( wres < 0 ) {
-		err("writelocked write:");
+	fifoFree(fwd);
+	if ( cut < 0 ) {
+		errno = EAGAIN;
+		err("fifoRecover writer open:");
+		goto RETURN;
 	}
-	releaselock(fd);
+	res = cut;
 RETURN:
-	return wres;
+	fifoCloseDirectory(&fpa);
+	return res;
 }
 
-static void err( const char* text ) {
-
-	if ( text == NULL ) {
-		fifoERROR[0] = '\0';
-		return;
-	}
+/**
+ * Compute the lag of an open read pointer behind the writers of its queue
+ * from the logical offsets and message counts kept in the write pointer, the
+ * shared header and the read pointer, without a scan of the data files.
+ * Priority lanes are summed up.
+ */
+int fifoLag(FifoDescriptor* frd, FifoLag* lag) {
+	int i;
+	FifoDescriptor* fp;
 
-	if ( strlen(fifoERROR) + strlen(text) + 2 > sizeof(fifoERROR) ) {
-		return;
+	err(NULL);
+	memset(lag, 0, sizeof(*lag));
+	snprintf(lag->reader, sizeof(lag->reader), "%s",
+			frd->filePointer->readPointerFile + strlen(RPPREFIX));
+	for ( i = 0; i < frd->lanes; ++i ) {
+		fp = i == 0 ? frd : frd->lane[i-1];
+		if ( lagof(fp->parameters, fp->fdp, NULL, lag) < 0 ) {
+			err("fifoLag:");
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	strcat(fifoERROR, text);
-	if ( text[strlen(text)-1] == ':' ) strcat(fifoERROR, "\n");
+/**
+ * Compute the lag of every read pointer of the queue like fifoLag, with the
+ * partitions and priority lanes summed up per read pointer name.
+ * Fill at most max entries of lags. Return the number of entries filled.
+ */
+long fifoLagList(const char* dirname, FifoLag* lags, long max) {
+	err(NULL);
+	return laglist(dirname, lags, max, 0);
 }
 
-/*************************************** READ *********************************/
-static ssize_t fifoFormatReadBuffer(FifoParameters *fp, char* buffer, ssize_t* s) {
+/**
+ * Create a partitioned file queue. It consists of a base directory with the
+ * file dir/.partitions, containing the number of partitions, and one file queue
+ * per partition dir/p0, dir/p1, .. created like fifoCreate, each with its own
+ * generations, write pointer and read pointers.
+ * The number of partitions of an existing queue is not changed.
+ */
+int fifoCreatePartitions( const char* dirname, off_t switchSize, char esc, char sep, int partitions ) {
+	int i;
+	int fd = -1;
+	int res = -1;
+	char buffer[24];
+	char* path;
+	FifoParameters fpa;
+	fpa.pathName = (char*) dirname;
+	fpa.dirfd = -1;
+	fpa.locks = NULL;
+	fpa.tail = NULL;
+	fpa.writers = -1;
+	fpa.slot = -1;
+
+	err(NULL);
+	if ( partitions <= 0 ) {
+		errno = EINVAL;
+		err("fifoCreatePartitions number of partitions:");
+		goto RETURN;
+	}
+	res = mkdir(dirname, 0777);
+	if ( res < 0 && errno != EEXIST ) {
+		err("fifoCreatePartitions mkdir:");
+		goto RETURN;
+	}
+	res = fifoOpenDirectory(&fpa, dirname);
+	if ( res < 0 ) {
+		err("fifoCreatePartitions:");
+		goto RETURN;
+	}
+	fd = openat(fpa.dirfd, PARTFILE, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if ( fd < 0 && errno != EEXIST ) {
+		errpath("fifoCreatePartitions open:", PARTFILE);
+		res = -1;
+		goto RETURN;
+	}
+	if ( fd >= 0 ) {
+		sprintf(buffer, "%d\n", partitions);
+		if ( write(fd, buffer, strlen(buffer)) < 0 ) {
+			errpath("fifoCreatePartitions write:", PARTFILE);
+			res = -1;
+			goto RETURN;
+		}
+	}
+	res = fifoReadCount(&fpa, PARTFILE);
+	if ( res <= 0 ) {
+		err("fifoCreatePartitions:");
+		res = -1;
+		goto RETURN;
+	}
+	partitions = res;
+	for ( i = 0; i < partitions; ++i ) {
+		path = fifoSubqueuePath(dirname, PARTPREFIX, i);
+		if ( path == NULL ) {
+			res = -1;
+			goto RETURN;
+		}
+		res = fifoCreate(path, switchSize, esc, sep);
+		free(path);
+		if ( res < 0 ) {
+			err("fifoCreatePartitions:");
+			goto RETURN;
+		}
+	}
+	res = 0;
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	fifoCloseDirectory(&fpa);
+	return res;
+}
+
+/**
+ * Return the number of partitions of the queue, 0 if it is not partitioned.
+ */
+int fifoPartitionCount( const char* dirname ) {
+	int res;
+	FifoParameters fpa;
+	err(NULL);
+	fpa.pathName = (char*) dirname;
+	if ( fifoOpenDirectory(&fpa, dirname) < 0 ) {
+		err("fifoPartitionCount:");
+		return -1;
+	}
+	res = fifoReadCount(&fpa, PARTFILE);
+	fifoCloseDirectory(&fpa);
+	return res;
+}
+
+/**
+ * Hash a key for fifoWritePart (FNV-1a).
+ * Messages with equal keys are written to the same partition.
+ */
+unsigned long fifoHash( const void* key, size_t size ) {
+	const unsigned char* p = (const unsigned char*) key;
+	uint64_t h = UINT64_C(14695981039346656037);
+	size_t i;
+
+	for ( i = 0; i < size; ++i ) {
+		h ^= p[i];
+		h *= UINT64_C(1099511628211);
+	}
+	return (unsigned long) h;
+}
+
+/**
+ * Open all partitions of a partitioned queue for writing.
+ * Return write pointer.
+ */
+FifoPartitions* fifoOpenPartW( const char* dirname ) {
+	err(NULL);
+	return fifoOpenPart(dirname, NULL, NULL, 0);
+}
+
+/**
+ * Open read streams for the given partitions of a partitioned queue.
+ * All partitions are bound, if bind is NULL. Consumers sharing the name of the
+ * read pointer, but binding different partitions, split the queue between them.
+ * Return read pointer.
+ */
+FifoPartitions* fifoOpenPartR( const char* dirname, const char* readpf, const int* bind, int nbind ) {
+	err(NULL);
+	return fifoOpenPart(dirname, readpf, bind, nbind);
+}
+
+/**
+ * Write a message to the partition selected by the key hash.
+ * The order of messages with equal hash is kept.
+ */
+ssize_t fifoWritePart( FifoPartitions* fpw, unsigned long hash, void* buffer, size_t size ) {
+	return fifoWrite(fpw->part[hash % (unsigned long) fpw->count], buffer, size);
+}
+
+/**
+ * Read next message from the bound partitions with waiting like fifoReadW.
+ * The partitions are visited round robin, starting behind the partition of
+ * the previous message, so no partition is starved.
+ * The previous message must have been released.
+ */
+ssize_t fifoReadPart( FifoPartitions* fpr, void* buffer, size_t size, long wtim, long maxtime ) {
+	ssize_t rres = -1;
+
+	err(NULL);
+	if ( fpr->last >= 0 ) {
+		errno = ESPIPE;
+		err("fifoReadPart: must first call release:");
+		goto RETURN;
+	}
+	rres = waitread(readparts, fpr, buffer, size, wtim, maxtime);
+	if ( rres >= 0 ) {
+		rres = fifoStripHeader(fpr->part[fpr->last], buffer, rres);
+	} else if ( errno != EAGAIN && errno != ETIME ) {
+		err("fifoReadPart:");
+	}
+RETURN:
+	return rres;
+}
+
+/**
+ * Release the previously read message in its partition.
+ * If no unreleased message exists, silently ignore this call.
+ */
+ssize_t fifoReleasePart( FifoPartitions* fpr ) {
+	ssize_t res = 0;
+	err(NULL);
+	if ( fpr->last >= 0 ) {
+		res = release(fpr->part[fpr->last]);
+		if ( res >= 0 ) fpr->last = -1;
+	}
+	return res;
+}
+
+/**
+ * Close read or write pointer of a partitioned queue.
+ */
+void fifoClosePart( FifoPartitions* fp ) {
+	err(NULL);
+	fifoFreePart(fp);
+}
+
+/**
+ * Return the error state of the last failed call in the calling thread.
+ * The code is FIFO_OK, if the last call succeeded. A missing message
+ * (errno EAGAIN or ETIME) is not recorded as an error.
+ */
+const FifoError* fifoError(void) {
+	return &lastError;
+}
+
+/**
+ * Format the error state of the last failed call in the calling thread
+ * into buffer: operation, file name, system error text and the callers.
+ * Return buffer, which is empty if there was no error.
+ */
+char* fifoStrerror(char* buffer, size_t size) {
+	const FifoError* e = &lastError;
+	char text[256];
+	size_t len = 0;
+	size_t n;
+	int i;
+
+	if ( size == 0 ) return buffer;
+	buffer[0] = '\0';
+	if ( e->code == FIFO_OK ) return buffer;
+	for ( i = 0; i < e->depth && len + 1 < size; ++i ) {
+		n = strlen(e->trace[i]);
+		while ( n > 0 && (e->trace[i][n-1] == ':' || e->trace[i][n-1] == ' ') ) --n;
+		if ( i == 0 ) {
+			len += snprintf(buffer+len, size-len, "%.*s", (int)n, e->trace[i]);
+			if ( e->path[0] && len + 1 < size ) {
+				len += snprintf(buffer+len, size-len, " %s", e->path);
+			}
+			if ( strerror_r(e->errnum, text, sizeof(text)) != 0 ) {
+				sprintf(text, "error %d", e->errnum);
+			}
+			if ( len + 1 < size ) len += snprintf(buffer+len, size-len, ": %s", text);
+		} else {
+			len += snprintf(buffer+len, size-len, "\n\tin %.*s", (int)n, e->trace[i]);
+		}
+	}
+	if ( len + 1 < size ) snprintf(buffer+len, size-len, "\n");
+	return buffer;
+}
+
+/**
+ * Copy the statistics of the descriptor and its priority lanes into stats.
+ * If queue is set, sum up all descriptors of the same queue (and lanes) in
+ * this process, including the closed ones.
+ * Fails with errno ENOSYS, if the library is built without FIFO_STATS.
+ */
+int fifoStats( FifoDescriptor* fp, FifoStats* stats, int queue ) {
+#ifdef FIFO_STATS
+	uint64_t* sum = (uint64_t*) stats;
+	FifoStatsBlock* s;
+	size_t i;
+	int k;
+
+	err(NULL);
+	memset(stats, 0, sizeof(*stats));
+	while ( atomic_flag_test_and_set(&statsRegistry) ) sched_yield();
+	for ( k = 0; k < fp->lanes; ++k ) {
+		s = k == 0 ? fp->stats : fp->lane[k-1]->stats;
+		if ( s == NULL ) continue;
+		if ( queue ) {
+			for ( i = 0; i < STATSWORDS; ++i ) sum[i] += s->queue->closed[i];
+			s = s->queue->blocks;
+		}
+		for ( ; s != NULL; s = queue ? s->next : NULL ) {
+			fifoStatsMerge(sum, s->slot->word);
+		}
+	}
+	atomic_flag_clear(&statsRegistry);
+	return 0;
+#else
+	(void) fp;
+	(void) queue;
+	err(NULL);
+	memset(stats, 0, sizeof(*stats));
+	errno = ENOSYS;
+	err("fifoStats not built with FIFO_STATS:");
+	return -1;
+#endif
+}
+
+/**
+ * Copy the statistics of the descriptors of all processes attached to the
+ * queue from the segment dir/.stats into at most max entries of list.
+ * Only processes built with FIFO_STATS publish statistics. Slots of processes,
+ * which died, are skipped. Return number of entries filled.
+ */
+int fifoStatsList( const char* dirname, FifoStatsEntry* list, int max ) {
+	int res = -1;
+	int fd = -1;
+	int i, k;
+	size_t j;
+	uint64_t owner, seq;
+	struct stat st;
+	void* p = MAP_FAILED;
+	FifoStatsSegment* seg;
+	FifoStatsSlot* s;
+	FifoStatsEntry* e;
+	uint64_t* word;
+	FifoParameters fpa;
+
+	err(NULL);
+	fpa.pathName = (char*) dirname;
+	if ( fifoOpenDirectory(&fpa, dirname) < 0 ) {
+		err("fifoStatsList:");
+		goto RETURN;
+	}
+	res = 0;
+	fd = openat(fpa.dirfd, STATSFILE, O_RDONLY);
+	if ( fd < 0 && errno == ENOENT ) goto RETURN;
+	if ( fd < 0 || fstat(fd, &st) < 0 ) {
+		errpath("fifoStatsList open:", STATSFILE);
+		res = -1;
+		goto RETURN;
+	}
+	if ( st.st_size < (off_t) sizeof(FifoStatsSegment) ) goto RETURN;
+	p = mmap(NULL, sizeof(FifoStatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+	if ( p == MAP_FAILED ) {
+		errpath("fifoStatsList mmap:", STATSFILE);
+		res = -1;
+		goto RETURN;
+	}
+	seg = (FifoStatsSegment*) p;
+	if ( atomic_load(&seg->magic) != STATSMAGIC ) goto RETURN;
+
+	for ( i = 0; i < STATSSLOTS && res < max; ++i ) {
+		s = &seg->slot[i];
+		e = &list[res];
+		word = (uint64_t*) &e->stats;
+		owner = atomic_load(&s->owner);
+		if ( owner == 0 || !fifoStatsAlive(owner) ) continue;
+		for ( k = 0; k < STATSRETRIES; ++k ) {
+			seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+			if ( seq & 1 ) {
+				sched_yield();
+				continue;
+			}
+			e->role = s->role;
+			memcpy(e->reader, s->reader, STATSNAMELEN);
+			for ( j = 0; j < STATSWORDS; ++j ) {
+				word[j] = atomic_load_explicit(&s->word[j], memory_order_relaxed);
+			}
+			atomic_thread_fence(memory_order_acquire);
+			if ( atomic_load_explicit(&s->seq, memory_order_relaxed) == seq &&
+					atomic_load(&s->owner) == owner ) {
+				break;
+			}
+		}
+		if ( k == STATSRETRIES ) continue;
+		e->reader[STATSNAMELEN - 1] = '\0';
+		e->pid = (pid_t) (owner & 0xffffffff);
+		e->slot = i;
+		res++;
+	}
+RETURN:
+	if ( p != MAP_FAILED ) munmap(p, sizeof(FifoStatsSegment));
+	if ( fd >= 0 ) close(fd);
+	fifoCloseDirectory(&fpa);
+	return res;
+}
+
+/*************** END OF PUBLIC INTERFACE *************************************/
+
+/**
+ * Return name of the queue of a partition or priority lane: dir/<prefix><n>.
+ */
+static char* fifoSubqueuePath(const char* dirname, const char* prefix, int n) {
+	char* path = (char*) malloc(strlen(dirname) + FIFONAMELEN);
+	if ( path == NULL ) {
+		err("fifoSubqueuePath malloc:");
+		return NULL;
+	}
+	sprintf(path, "%s/%s%d", dirname, prefix, n);
+	return path;
+}
+
+/**
+ * Read number of partitions or lanes from dir/.partitions or dir/.lanes.
+ * No locks, the file is not changed after creation.
+ * Return 0, if the file does not exist.
+ */
+static int fifoReadCount(const FifoParameters* fpa, const char* name) {
+	int fd;
+	int res = -1;
+	int n = 0;
+	char buffer[24];
+	ssize_t rres;
+
+	fd = openat(fpa->dirfd, name, O_RDONLY);
+	if ( fd < 0 && errno == ENOENT ) {
+		res = 0;
+		goto RETURN;
+	}
+	if ( fd < 0 ) {
+		errpath("fifoReadCount open:", name);
+		goto RETURN;
+	}
+	rres = read(fd, buffer, sizeof(buffer) - 1);
+	if ( rres < 0 ) {
+		errpath("fifoReadCount read:", name);
+		goto RETURN;
+	}
+	buffer[rres] = '\0';
+	if ( sscanf(buffer, "%d", &n) != 1 || n <= 0 ) {
+		errno = EINVAL;
+		errpath("fifoReadCount:", name);
+		goto RETURN;
+	}
+	res = n;
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	return res;
+}
+
+/**
+ * Open the priority lanes 1 .. of the queue for writing, if readpf is NULL,
+ * otherwise for reading with the same read pointer name.
+ * A queue without dir/.lanes has the single lane 0 and no extra descriptors.
+ */
+static int fifoOpenLanes(FifoDescriptor* fp, const char* readpf) {
+	int i, n;
+	int res = -1;
+	char* path;
+
+	n = fifoReadCount(fp->parameters, LANEFILE);
+	if ( n <= 1 ) {
+		res = n < 0 ? -1 : 0;
+		goto RETURN;
+	}
+	fp->lane = (FifoDescriptor**) calloc(n - 1, sizeof(*fp->lane));
+	if ( fp->lane == NULL ) {
+		err("fifoOpenLanes malloc:");
+		goto RETURN;
+	}
+	fp->lanes = n;
+	for ( i = 1; i < n; ++i ) {
+		path = fifoSubqueuePath(fp->parameters->pathName, LANEPREFIX, i);
+		if ( path == NULL ) goto RETURN;
+		fp->lane[i-1] = readpf ? fifoOpenR(path, readpf) : fifoOpenW(path);
+		free(path);
+		if ( fp->lane[i-1] == NULL ) {
+			err("fifoOpenLanes:");
+			goto RETURN;
+		}
+	}
+	res = 0;
+RETURN:
+	return res;
+}
+
+/**
+ * Open the partitions of a partitioned queue: all for writing, if readpf is NULL,
+ * otherwise the bound ones (all, if bind is NULL) for reading.
+ */
+static FifoPartitions* fifoOpenPart(const char* dirname, const char* readpf, const int* bind, int nbind) {
+	int i, k, n;
+	char* path;
+	FifoPartitions* fpp = NULL;
+	FifoPartitions* fp = NULL;
+
+	n = fifoPartitionCount(dirname);
+	if ( n <= 0 ) {
+		if ( n == 0 ) errno = EINVAL;
+		errpath("fifoOpenPart no partitioned queue:", dirname);
+		goto RETURN;
+	}
+	fpp = (FifoPartitions*) malloc(sizeof(*fpp));
+	if ( fpp == NULL ) {
+		err("fifoOpenPart malloc:");
+		goto RETURN;
+	}
+	fpp->count = n;
+	fpp->next = 0;
+	fpp->last = -1;
+	fpp->part = (FifoDescriptor**) calloc(n, sizeof(*fpp->part));
+	if ( fpp->part == NULL ) {
+		err("fifoOpenPart malloc:");
+		goto RETURN;
+	}
+	if ( bind == NULL ) nbind = n;
+	for ( i = 0; i < nbind; ++i ) {
+		k = bind ? bind[i] : i;
+		if ( k < 0 || k >= n ) {
+			errno = EINVAL;
+			err("fifoOpenPart partition out of range:");
+			goto RETURN;
+		}
+		if ( fpp->part[k] ) continue;
+		path = fifoSubqueuePath(dirname, PARTPREFIX, k);
+		if ( path == NULL ) goto RETURN;
+		fpp->part[k] = readpf ? fifoOpenR(path, readpf) : fifoOpenW(path);
+		free(path);
+		if ( fpp->part[k] == NULL ) {
+			err("fifoOpenPart:");
+			goto RETURN;
+		}
+	}
+	fp = fpp;
+RETURN:
+	if ( fp == NULL ) {
+		fifoFreePart(fpp);
+	}
+	return fp;
+}
+
+/**
+ * Watch the directory dirfd or its subdirectory sub for new and modified
+ * files. Return the watch descriptor, -1 if none.
+ */
+static int pollwatch( const FifoPoll* fpl, int dirfd, const char* sub ) {
+#ifdef __linux__
+	char path[FIFONAMELEN + 32];
+
+	sprintf(path, "/proc/self/fd/%d", dirfd);
+	if ( sub ) {
+		strcat(path, "/");
+		strcat(path, sub);
+	}
+	return inotify_add_watch(fpl->fd, path, IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+#else
+	(void) fpl;
+	(void) dirfd;
+	(void) sub;
+	return -1;
+#endif
+}
+
+/**
+ * Drop the watch in slot of the watch table. inotify returns the same watch
+ * for a directory watched twice, so it is only removed, if no other slot
+ * holds it.
+ */
+static void pollunwatch( FifoPoll* fpl, int slot ) {
+	int wd = fpl->wd[slot];
+	int i;
+
+	if ( wd < 0 ) return;
+	fpl->wd[slot] = -1;
+	for ( i = 0; i < fpl->count * POLLWATCHES; ++i ) {
+		if ( fpl->wd[i] == wd ) return;
+	}
+#ifdef __linux__
+	inotify_rm_watch(fpl->fd, wd);
+#endif
+}
+
+/**
+ * Watch the shard directory of the current generation of descriptor i in
+ * sharded layout. A shard not yet created is found by the watch of the
+ * queue directory and watched at the next check.
+ */
+static void pollshard( FifoPoll* fpl, int i ) {
+	const FifoDescriptor* frd = fpl->desc[i];
+	int slot = i * POLLWATCHES + FIFOLANES;
+	unsigned long shard;
+	char name[FIFONAMELEN];
+
+	if ( fpl->fd < 0 || frd->parameters->shardSize == 0 ) return;
+	shard = frd->filePointer->current / frd->parameters->shardSize;
+	if ( fpl->wd[slot] >= 0 && fpl->shard[i] == shard ) return;
+	pollunwatch(fpl, slot);
+	fpl->wd[slot] = pollwatch(fpl, frd->parameters->dirfd, fifoShardname(frd->parameters, frd->filePointer->current, name));
+	fpl->shard[i] = shard;
+}
+
+/**
+ * Remove descriptor i from the set and its watches; the last descriptor
+ * takes its place.
+ */
+static void pollremove( FifoPoll* fpl, int i ) {
+	int k;
+	int last = fpl->count - 1;
+
+	for ( k = 0; k < POLLWATCHES; ++k ) {
+		pollunwatch(fpl, i * POLLWATCHES + k);
+	}
+	fpl->desc[i] = fpl->desc[last];
+	fpl->shard[i] = fpl->shard[last];
+	memmove(&fpl->wd[i * POLLWATCHES], &fpl->wd[last * POLLWATCHES], POLLWATCHES * sizeof(*fpl->wd));
+	fpl->count = last;
+	if ( fpl->next >= fpl->count ) fpl->next = 0;
+}
+
+/**
+ * Close the inotify descriptor of the set and free the memory.
+ */
+static void pollfree( FifoPoll* fpl ) {
+	if ( fpl == NULL ) return;
+	if ( fpl->fd >= 0 ) close(fpl->fd);
+	free(fpl->desc);
+	free(fpl->wd);
+	free(fpl->shard);
+	free(fpl);
+}
+
+/**
+ * Close the descriptors of all partitions and free the memory.
+ */
+static void fifoFreePart(FifoPartitions* fp) {
+	int i;
+	if ( fp == NULL ) return;
+	if ( fp->part ) {
+		for ( i = 0; i < fp->count; ++i ) {
+			fifoFree(fp->part[i]);
+		}
+		free(fp->part);
+	}
+	free(fp);
+}
+
+/**
+ * Open the queue directory. All files of the queue are accessed relative
+ * to this directory descriptor, so the current directory may change
+ * while the queue is open. The directory name is kept for messages only.
+ */
+static int fifoOpenDirectory(FifoParameters* fpa, const char* dirname) {
+	fpa->locks = NULL;
+	fpa->tail = NULL;
+	fpa->writers = -1;
+	fpa->slot = -1;
+	fpa->dirfd = open(dirname, O_RDONLY | O_DIRECTORY);
+	if ( fpa->dirfd < 0 ) {
+		errpath("fifoOpenDirectory open:", dirname);
+	}
+#ifdef FIFO_PTHREAD_LOCKS
+	if ( fpa->dirfd >= 0 && fifoLocksAcquire(fpa) < 0 ) {
+		err("fifoOpenDirectory:");
+		close(fpa->dirfd);
+		fpa->dirfd = -1;
+	}
+#endif
+	return fpa->dirfd;
+}
+
+/**
+ * Use a duplicate of an open queue directory like fifoOpenDirectory.
+ */
+static int fifoDupDirectory(FifoParameters* fpa, int dirfd) {
+	fpa->locks = NULL;
+	fpa->tail = NULL;
+	fpa->writers = -1;
+	fpa->slot = -1;
+	fpa->dirfd = dup(dirfd);
+	if ( fpa->dirfd < 0 ) {
+		err("fifoDupDirectory dup:");
+	}
+#ifdef FIFO_PTHREAD_LOCKS
+	if ( fpa->dirfd >= 0 && fifoLocksAcquire(fpa) < 0 ) {
+		err("fifoDupDirectory:");
+		close(fpa->dirfd);
+		fpa->dirfd = -1;
+	}
+#endif
+	return fpa->dirfd;
+}
+
+/**
+ * Close the queue directory, unmap the shared header and drop the writer lock
+ * and the reference to the queue locks.
+ */
+static void fifoCloseDirectory(FifoParameters* fpa) {
+	fifoSlotDrop(fpa);
+	fifoWriterUnlock(fpa);
+#ifdef FIFO_PTHREAD_LOCKS
+	fifoLocksRelease(fpa);
+#endif
+	if ( fpa->tail ) munmap(fpa->tail, sizeof(FifoTail));
+	fpa->tail = NULL;
+	if ( fpa->dirfd >= 0 ) close(fpa->dirfd);
+	fpa->dirfd = -1;
+}
+
+/**
+ * Map the header dir/.tail shared by all writers and readers of the queue.
+ * Create it, if missing. A new header is initialized by the first writer.
+ */
+static int fifoMapTail(FifoParameters* fpa) {
+	int fd;
+	int res = -1;
+	struct stat st;
+	void* p;
+
+	fd = openat(fpa->dirfd, TAILFILE, O_RDWR | O_CREAT, 0666);
+	if ( fd < 0 ) {
+		errpath("fifoMapTail open:", TAILFILE);
+		goto RETURN;
+	}
+	if ( fstat(fd, &st) < 0 ) {
+		errpath("fifoMapTail fstat:", TAILFILE);
+		goto RETURN;
+	}
+	if ( st.st_size < (off_t) sizeof(FifoTail) && ftruncate(fd, sizeof(FifoTail)) < 0 ) {
+		errpath("fifoMapTail truncate:", TAILFILE);
+		goto RETURN;
+	}
+	p = mmap(NULL, sizeof(FifoTail), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( p == MAP_FAILED ) {
+		errpath("fifoMapTail mmap:", TAILFILE);
+		goto RETURN;
+	}
+	fpa->tail = (FifoTail*) p;
+	res = 0;
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	return res;
+}
+
+/**
+ * Wait until the commit word of the shared header reaches the given value,
+ * the start of the range of the caller. Yield the processor first, then sleep
+ * for a short time. If the commit word does not move for TAILSTUCK sleeps,
+ * the writer of the range at the commit word may have died: see reclaim.
+ */
+static void fifoTailWait(FifoDescriptor* fwd, uint64_t value) {
+	int spins = 0;
+	long stuck = 0;
+	uint64_t c;
+	uint64_t last = 0;
+	struct timespec ts;
+	FifoTail* t = fwd->parameters->tail;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 100000;
+	while ( (c = atomic_load(&t->commit)) != value ) {
+		if ( c != last ) {
+			last = c;
+			stuck = 0;
+		}
+		if ( ++spins < TAILSPINS ) {
+			sched_yield();
+		} else {
+			nanosleep(&ts, NULL);
+			if ( ++stuck >= TAILSTUCK ) {
+				reclaim(fwd, c, value);
+				stuck = 0;
+			}
+		}
+	}
+}
+
+/**
+ * Commit the range at commit word c, if no live writer holds it: its writer
+ * died between reservation and commit. The range ends at the next range
+ * found in the slots of the writers, at the latest at end. It is filled
+ * with a pad record before, so readers never see it. If that fails, the
+ * next caller tries again.
+ */
+static void reclaim(FifoDescriptor* fwd, uint64_t c, uint64_t end) {
+	int i;
+	int serrno = errno;
+	uint64_t s;
+	uint64_t owner;
+	FifoTail* t = fwd->parameters->tail;
+
+	for ( i = 0; i < TAILSLOTS; ++i ) {
+		s = atomic_load(&t->slot[i].start);
+		owner = atomic_load(&t->slot[i].owner);
+		if ( s == c && owner != 0 && fifoWriterAlive(owner) ) return;
+		if ( s > c && s < end && (s & ~TAILMASK) == (c & ~TAILMASK) ) end = s;
+	}
+	if ( fifoPad(fwd, TAILPOS(c), (size_t) (TAILPOS(end) - TAILPOS(c))) == 0 ) {
+		atomic_compare_exchange_strong(&t->commit, &c, end);
+	}
+	errno = serrno;
+}
+
+/**
+ * Take a free slot of the shared header for the write pointer, or one left
+ * by a dead process. Its owner is the process, identified by pid and start
+ * time, so a later process with the same pid does not keep it.
+ */
+static int fifoSlotTake(FifoParameters* fpa) {
+	int i;
+	pid_t pid = getpid();
+	uint64_t owner;
+	uint64_t me = (fifoProcessStart(pid) & 0xffffffff) << 32 | (uint32_t) pid;
+	FifoTail* t = fpa->tail;
+
+	for ( i = 0; i < TAILSLOTS; ++i ) {
+		owner = atomic_load(&t->slot[i].owner);
+		if ( owner != 0 && fifoWriterAlive(owner) ) continue;
+		if ( atomic_compare_exchange_strong(&t->slot[i].owner, &owner, me) ) {
+			atomic_store(&t->slot[i].start, 0);
+			fpa->slot = i;
+			return 0;
+		}
+	}
+	errno = EMFILE;
+	errpath("fifoSlotTake too many writers:", TAILFILE);
+	return -1;
+}
+
+/**
+ * Give the slot of the write pointer back.
+ */
+static void fifoSlotDrop(FifoParameters* fpa) {
+	if ( fpa->slot < 0 || fpa->tail == NULL ) return;
+	atomic_store(&fpa->tail->slot[fpa->slot].start, 0);
+	atomic_store(&fpa->tail->slot[fpa->slot].owner, 0);
+	fpa->slot = -1;
+}
+
+/**
+ * Check, if the process owning a writer slot is alive. If its start time is
+ * unknown, the pid decides.
+ */
+static int fifoWriterAlive(uint64_t owner) {
+	pid_t pid = (pid_t) (owner & 0xffffffff);
+	uint64_t start;
+
+	if ( kill(pid, 0) < 0 && errno != EPERM ) return 0;
+	start = fifoProcessStart(pid) & 0xffffffff;
+	return start == 0 || (owner >> 32) == 0 || start == owner >> 32;
+}
+
+/**
+ * Start time of a process in clock ticks after boot, from /proc/<pid>/stat.
+ * Return 0, if it is not available.
+ */
+static uint64_t fifoProcessStart(pid_t pid) {
+	char name[32];
+	char buffer[1024];
+	char* p;
+	int fd;
+	int i;
+	ssize_t n;
+
+	sprintf(name, "/proc/%d/stat", (int) pid);
+	fd = open(name, O_RDONLY);
+	if ( fd < 0 ) return 0;
+	n = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if ( n <= 0 ) return 0;
+	buffer[n] = '\0';
+	/* field 22, the 20th behind the command name, which may contain blanks */
+	p = strrchr(buffer, ')');
+	for ( i = 0; p != NULL && i < 20; ++i ) p = strchr(p + 1, ' ');
+	return p ? strtoull(p + 1, NULL, 10) : 0;
+}
+
+#ifdef FIFO_PTHREAD_LOCKS
+/**
+ * Find the process internal locks of the queue in the registry or create them.
+ * The queue is identified by device and inode of its directory, so different
+ * names of the same queue share the locks, while independent queues do not
+ * block each other.
+ */
+static int fifoLocksAcquire(FifoParameters* fpa) {
+	struct stat st;
+	FifoLocks* l;
+	int res;
+
+	fpa->locks = NULL;
+	if ( fstat(fpa->dirfd, &st) < 0 ) {
+		err("fifoLocksAcquire fstat:");
+		return -1;
+	}
+	res = pthread_mutex_lock(&lockRegistry);
+	if ( res != 0 ) {
+		errno = res;
+		err("fifoLocksAcquire:");
+		return -1;
+	}
+	res = -1;
+	for ( l = lockList; l != NULL; l = l->next ) {
+		if ( l->dev == st.st_dev && l->ino == st.st_ino ) break;
+	}
+	if ( l == NULL ) {
+		l = (FifoLocks*) malloc(sizeof(*l));
+		if ( l == NULL ) {
+			err("fifoLocksAcquire malloc:");
+			goto RETURN;
+		}
+		l->dev = st.st_dev;
+		l->ino = st.st_ino;
+		l->refs = 0;
+		l->writers = 0;
+		l->wfd = -1;
+		l->recovering = 0;
+		l->wpfd = -1;
+		pthread_rwlock_init(&l->data, NULL);
+		pthread_rwlock_init(&l->wadm, NULL);
+		pthread_rwlock_init(&l->radm, NULL);
+		pthread_rwlock_init(&l->mani, NULL);
+		pthread_rwlock_init(&l->dely, NULL);
+		l->next = lockList;
+		lockList = l;
+	}
+	l->refs++;
+	fpa->locks = l;
+	res = 0;
+RETURN:
+	pthread_mutex_unlock(&lockRegistry);
+	return res;
+}
+
+/**
+ * Drop reference to the queue locks. The last user removes them from the registry.
+ */
+static void fifoLocksRelease(FifoParameters* fpa) {
+	FifoLocks** pl;
+	FifoLocks* l = fpa->locks;
+
+	if ( l == NULL ) return;
+	fpa->locks = NULL;
+	pthread_mutex_lock(&lockRegistry);
+	if ( --l->refs == 0 ) {
+		for ( pl = &lockList; *pl != l; pl = &(*pl)->next ) ;
+		*pl = l->next;
+		if ( l->wpfd >= 0 ) close(l->wpfd);
+		pthread_rwlock_destroy(&l->data);
+		pthread_rwlock_destroy(&l->wadm);
+		pthread_rwlock_destroy(&l->radm);
+		pthread_rwlock_destroy(&l->mani);
+		pthread_rwlock_destroy(&l->dely);
+		free(l);
+	}
+	pthread_mutex_unlock(&lockRegistry);
+}
+#endif
+
+/**
+ * Close files of a read or write pointer and free its memory.
+ * With classic record locks the pointer file stays open: closing it would
+ * drop the locks, which other descriptors of this process hold on the same file.
+ */
+static void fifoFree(FifoDescriptor* fp) {
+	int i;
+	if ( fp == NULL ) return;
+	fifoFreeProducer(fp->producer);
+	fifoFreeTransaction(fp->transaction);
+	fifoStatsClose(fp);
+	if ( fp->lane ) {
+		for ( i = 1; i < fp->lanes; ++i ) {
+			fifoFree(fp->lane[i-1]);
+		}
+		free(fp->lane);
+	}
+	if ( fp->fd >= 0 ) close(fp->fd);
+#ifndef FIFO_PTHREAD_LOCKS
+	if ( fp->fdp >= 0 ) close(fp->fdp);
+#endif
+	if ( fp->parameters ) {
+		fifoCloseDirectory(fp->parameters);
+		if ( fp->parameters->pathName ) {
+			free(fp->parameters->pathName);
+		}
+		if ( fp->parameters->archive ) {
+			free(fp->parameters->archive);
+		}
+		free(fp->parameters);
+	}
+	if ( fp->filePointer ) {
+		if ( fp->filePointer->readPointerFile ) {
+			free(fp->filePointer->readPointerFile);
+		}
+		free(fp->filePointer);
+	}
+	free(fp);
+}
+
+/**
+ * Write parameters file.
+ */
+static int fifoWriteParams(const FifoParameters* fpa ) {
+	int fd;
+	int res = -1;
+	int lres = -1;
+	int fres = -1;
+	char buffer[80];
+	ssize_t wres;
+	long len;
+
+	fd = openat(fpa->dirfd, PARFILE, O_WRONLY | O_CREAT, 0666);
+	if ( fd < 0 ) {
+		errpath("fifoWriteParams openw:", PARFILE);
+		goto RETURN;
+	}
+
+	lres = lwlock(&fpa->locks->wadm);
+	fres = takewritelock(fd);
+	if ( lres < 0 || fres < 0 ) {
+		err("fifoWriteParams:");
+		goto RETURN;
+	}
+	sprintf(buffer, "%ld ..\n", (long)fpa->switchSize);
+	len = strlen(buffer);
+	buffer[len-3] = fpa->escape[0];
+	buffer[len-2] = fpa->separator[0];
+	if ( fpa->shardSize > 0 ) {
+		len += sprintf(buffer+len, "%lu\n", fpa->shardSize);
+	}
+	if ( fpa->recordSize > 0 || fpa->fingerprint != 0 ) {
+		sprintf(buffer+len, "%c%lu %llx\n", RECORDMARK, (unsigned long) fpa->recordSize,
+				(unsigned long long) fpa->fingerprint);
+	}
+	wres = write(fd, buffer, strlen(buffer));
+	if ( wres < 0 ) {
+		err("fifoWriteParams write:");
+		goto RETURN;
+	}
+	res = 0;
+RETURN:
+	if ( fres >= 0 ) releaselock(fd);
+	if ( lres >= 0 ) lulock(&fpa->locks->wadm);
+	if ( fd >= 0 ) {
+		close(fd);
+	}
+	return res;
+}
+
+/**
+ * Read parameters file.
+ */
+static int fifoReadParams(FifoParameters* fpa ) {
+	int fd;
+	int res = -1;
+	int lres = -1;
+	int fres = -1;
+	char buffer[80];
+	char* p;
+	ssize_t rres;
+	int n = 0;
+	unsigned long r;
+	unsigned long long f;
+
+	fpa->switchSize = 0L;
+	fpa->escape[0] = ' ';
+	fpa->separator[0] = ' ';
+	fpa->shardSize = 0;
+	fpa->recordSize = 0;
+	fpa->fingerprint = 0;
+	fpa->retain = 0;
+	fpa->maxAge = 0L;
+	fpa->maxBytes = 0L;
+	fpa->archive = NULL;
+
+	fd = openat(fpa->dirfd, PARFILE, O_RDONLY);
+	if ( fd < 0 ) {
+		errpath("fifoReadParams open:", PARFILE);
+		goto RETURN;
+	}
+
+	lres = lrlock(&fpa->locks->wadm);
+	fres = takereadlock(fd);
+	if ( lres < 0 || fres < 0 ) {
+		err("fifoReadParams:");
+		goto RETURN;
+	}
+	rres = read(fd, buffer, sizeof(buffer)-1);
+	if ( rres < 0 ) {
+		err("fifoReadParams read:");
+		goto RETURN;
+	}
+	buffer[rres] = 0;
+	sscanf(buffer, "%ld%n", &fpa->switchSize, &n);
+	if ( n == 0 || rres < n + 3 ) {
+		errno = EINVAL;
+		err("fifoReadParams invalid contents");
+		goto RETURN;
+	}
+	/* <switchSize><Blank><Escape><Separator>[<shardSize><Newline>][R<recordSize><Blank><fingerprint><Newline>] */
+	fpa->escape[0] = buffer[n+1];
+	fpa->separator[0] = buffer[n+2];
+	fpa->shardSize = strtoul(buffer+n+3, NULL, 10);
+	p = strchr(buffer+n+3, RECORDMARK);
+	if ( p != NULL && sscanf(p+1, "%lu %llx", &r, &f) == 2 ) {
+		fpa->recordSize = r;
+		fpa->fingerprint = f;
+	}
+	fpa->rollmark[0] = fpa->escape[0];
+	fpa->rollmark[1] = '@';
+	fpa->rollmark[2] = fpa->separator[0];
+	fpa->rollmark[3] = '\0';
+	res = 0;
+RETURN:
+	if ( fres >= 0 ) releaselock(fd);
+	if ( lres >= 0 ) lulock(&fpa->locks->wadm);
+	if ( fd >= 0 ) {
+		close(fd);
+	}
+	return res;
+}
+
+/**
+ * Calculate number of decimal digits of data file name given first letter
+ * of name ( A => 1, B => 2 ...
+ */
+static size_t fifoNamelen(int c) {
+	return c - 'A' + 1;
+}
+
+/**
+ * Put first character of data file name according to length of name.
+ */
+static char* fifoFilename(unsigned long current, char* name) {
+	sprintf(name+1, "%lu", current );
+	name[0] = 'A' + strlen(name+1) - 1;
+	return name;
+}
+
+/**
+ * Put name of subdirectory containing data file with given number.
+ */
+static char* fifoShardname(const FifoParameters* fpa, unsigned long current, char* name) {
+	sprintf(name, "%s%lu", SHARDPREFIX, current / fpa->shardSize);
+	return name;
+}
+
+/**
+ * Create subdirectory for data file with given number, if the layout is sharded.
+ */
+static int fifoMakeShard(const FifoParameters* fpa, unsigned long current) {
+	char name[FIFONAMELEN];
+	int res;
+
+	if ( fpa->shardSize == 0 ) return 0;
+	fifoShardname(fpa, current, name);
+	res = mkdirat(fpa->dirfd, name, 0777);
+	if ( res < 0 && errno == EEXIST ) res = 0;
+	if ( res < 0 ) {
+		errpath("fifoMakeShard mkdir:", name);
+	}
+	return res;
+}
+
+/**
+ * Put name of data file with given file number relative to the queue directory
+ * into name, which must have space for FIFONAMELEN characters.
+ * In sharded layout the name contains the subdirectory.
+ */
+static char* fifoCurrentFilename(const FifoParameters* fpa, unsigned long current, char* name) {
+	name[0] = '\0';
+	if ( fpa->shardSize > 0 ) {
+		fifoShardname(fpa, current, name);
+		strcat(name, "/");
+	}
+	fifoFilename(current, name+strlen(name));
+	return name;
+}
+
+/**
+ * Find newest (highest numerical value of name) file in file queue directory
+ * and return this maximum value as a long integer. If no files accoring to the naming
+ * scheme are contained in the directory listing, return 0L.
+ * The value is taken from the manifest, the directory is only scanned to rebuild it.
+ * The file naming scheme the file number (0 ... MAX_LONG) is converted in a decimal 
+ * string. The string size (between 1 and 20) determines the start character
+ * 1 => A, 2 => B, ... 26 => Z from the ASCII upercase letters.
+ */
+static long fifoGetCurrent(const FifoParameters* fpa) {
+	unsigned long first, last;
+
+	if ( fifoGetRange(fpa, &first, &last) < 0 ) {
+		err("fifoGetCurrent:");
+		return -1L;
+	}
+	return last;
+}
+
+/**
+ * Store number in n bytes, least significant first, independent of the host.
+ */
+static void fifoPut(char* p, uint64_t value, int n) {
+	int i;
+	for ( i = 0; i < n; ++i ) {
+		p[i] = (char) (value >> (8 * i));
+	}
+}
+
+/**
+ * Load number stored by fifoPut.
+ */
+static uint64_t fifoGet(const char* p, int n) {
+	uint64_t value = 0;
+	int i;
+	for ( i = n - 1; i >= 0; --i ) {
+		value = (value << 8) | (unsigned char) p[i];
+	}
+	return value;
+}
+
+/**
+ * If the escape char is blank, return the address of the input buffer.
+ * Otherwise count the number of characters to be escaped and allocate a new
+ * output buffer. Prepend each occurence of escape and separator character by an
+ * additional escape character. Add a separator character and a NUL character
+ * to the end of the new buffer. Store the actual size in the size variable and
+ * return the address of the new buffer.
+ * Warning: new buffer addres has to be released by the consumer.
+ */
+static char* fifoFormatWriteBuffer(FifoParameters *fp, const char* buffer, size_t *size) {
+
+	int res = 0;
+	char* newbuffer;
+	char ch;
+	size_t siz = *size;
+	size_t i;
+	size_t j;
+
+	if ( fp->escape[0] == ' ' ) return (char*) buffer;
+	for ( i = 0; i < siz; ++i ) {
+		ch = buffer[i];
+		if ( ch == fp->escape[0] || ch == fp->separator[0] ) {
+			res += 1;
+		}
+	}
+	newbuffer = (char*) malloc(siz + res + 2);
+	if ( newbuffer == NULL ) return NULL;
+
+	for ( i = 0, j = 0; i < siz; ++i ) {
+		ch = buffer[i];
+		if ( ch == fp->escape[0] || ch == fp->separator[0] ) {
+			newbuffer[j++] = fp->escape[0];
+		}
+		newbuffer[j++] = ch;
+	}
+	newbuffer[j++] = fp->separator[0];
+	newbuffer[j] = '\0';
+	*size = j; 
+	return newbuffer;
+}
+
+/**
+ * Re-open write descriptor to continue writing into the given generation.
+ */
+static int fifoReOpenWrite(FifoDescriptor* fwd, unsigned long current) {
+
+	char name[FIFONAMELEN];
+	int res = -1;
+	int fd2;
+
+	fifoCurrentFilename(fwd->parameters, current, name);
+	fd2 = openat(fwd->parameters->dirfd, name, O_WRONLY|O_CREAT, 0666);
+	if ( fd2 < 0 && errno == ENOENT && fifoMakeShard(fwd->parameters, current) == 0 ) {
+		/* subdirectory was not prepared in advance */
+		fd2 = openat(fwd->parameters->dirfd, name, O_WRONLY|O_CREAT, 0666);
+	}
+	if ( fd2 < 0 ) {
+		errpath("fifoReOpenWrite open:", name);
+		goto RETURN;
+	}
+	res = dup2(fd2, fwd->fd);
+	if ( res != fwd->fd ) {
+		err("fifoReOpenWrite dup:");
+		res = -1;
+		goto RETURN;
+	}
+	fwd->current = current;
+	res = 0;
+RETURN:
+	if ( fd2 >= 0 ) close(fd2);
+	return res;
+}
+
+/**
+ * Start a new data file to continue writing into this file.
+ * The caller found the data file full at tail word w.
+ * Take write lock for write administration. If the tail has moved meanwhile,
+ * return 0 without rollover: the caller tries again.
+ * Freeze the tail, so no more ranges are reserved in the current data file,
+ * and wait until all reserved ranges are written.
+ * Write roll-mark to the end of the current data file.
+ * Create new data file generation.
+ * Change Write control file and register new generation in manifest.
+ * Publish the new generation in the shared header and release lock.
+ * Return 1 after rollover.
+ */
+static int rolloverfile(FifoDescriptor* fwd, uint64_t w) {
+	STATSSTART(t0);
+	unsigned long newcurrent;
+	unsigned long oldcurrent;
+	int lres = -1;
+	int fres = -1;
+	int frozen = 0;
+	int res = -1;
+	FifoTail* t = fwd->parameters->tail;
+	const off_t pos = TAILPOS(w);
+	const char* rollmark = fwd->parameters->rollmark;
+	/* records have no roll-mark, the generation ends at the end of its last record */
+	const size_t len = fwd->parameters->recordSize > 0 ? 0 : strlen(rollmark);
+
+	PROBE3(rollover__start, fwd->parameters->pathName, fwd->current, pos);
+	lres = lwlock(&fwd->parameters->locks->wadm);
+	fres = takewritelock(fwd->fdp);
+	if ( lres < 0 || fres < 0 ) {
+		err("rolloverfile:");
+		goto RETURN;
+	}
+	STATSTIME(fwd, FIFO_TLOCK, t0);
+
+	if ( pos == TAILFROZEN ||
+			!atomic_compare_exchange_strong(&t->tail, &w, (w & ~TAILMASK) | TAILMASK) ) {
+		/* other writer did the rollover */
+		res = 0;
+		goto RETURN;
+	}
+	frozen = 1;
+	oldcurrent = atomic_load(&t->gen);
+	if ( oldcurrent != fwd->current && fifoReOpenWrite(fwd, oldcurrent) < 0 ) {
+		err("rolloverfile:");
+		goto RETURN;
+	}
+	fifoTailWait(fwd, w);
+
+	if ( len > 0 && pwrite(fwd->fd, rollmark, len, pos) < 0 ) {
+		err("rolloverfile write rollmark:");
+		goto RETURN;
+	}
+
+	res = fifoReadFilePointer(fwd);
+	if ( res < 0 ) {
+		err("rolloverfile:");
+		goto RETURN;
+	}
+	newcurrent = oldcurrent + 1;
+	fwd->filePointer->base += pos + len;
+	fwd->filePointer->messages = atomic_load(&t->messages);
+	res = fifoReOpenWrite(fwd, newcurrent);
+	if ( res < 0 ) {
+		err("rolloverfile create and open new file:");
+		goto RETURN;
+	}
+	fwd->filePointer->current = newcurrent;
+	res = fifoWriteFilePointer(fwd);
+	if ( res < 0 ) {
+		err("rolloverfile:");
+		goto RETURN;
+	}
+	fifoManifestRoll(fwd->parameters, oldcurrent, pos + (off_t) len, newcurrent);
+
+	/* commit before tail: the first range of the new file finds its predecessor written */
+	atomic_store(&t->gen, newcurrent);
+	atomic_store(&t->commit, TAILWORD(newcurrent, 0));
+	atomic_store(&t->tail, TAILWORD(newcurrent, 0));
+	frozen = 0;
+	res = 1;
+RETURN:
+	if ( frozen ) {
+		/* continue in the current data file, the roll-mark is overwritten */
+		atomic_store(&t->tail, w);
+	}
+	if ( fres >= 0) releaselock(fwd->fdp);
+	if ( lres >= 0) lulock(&fwd->parameters->locks->wadm);
+	if ( res > 0 ) {
+		STATSADD(fwd, rollovers, 1);
+		STATSTIME(fwd, FIFO_TROLLOVER, t0);
+	}
+	PROBE3(rollover__done, fwd->parameters->pathName, fwd->current, res);
+	return res;
+}
+
+/**
+ * Write size bytes at pos, continuing after a short write.
+ * Return size or -1.
+ */
+static ssize_t fifoWriteAll(int fd, const char* buffer, size_t size, off_t pos) {
+	size_t done = 0;
+	ssize_t n;
+
+	while ( done < size ) {
+		n = pwrite(fd, buffer + done, size - done, pos + (off_t) done);
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n <= 0 ) {
+			if ( n == 0 ) errno = EIO;
+			return -1;
+		}
+		done += n;
+	}
+	return (ssize_t) done;
+}
+
+/**
+ * Fill the range of size bytes at pos of the current data file with a pad
+ * record: escape PADMARK, the number of filler bytes and the separator,
+ * followed by separators as filler. Readers skip it like a transaction marker.
+ * A range below 3 bytes or in a queue without escape character for markers
+ * is filled with separators, a range of records with zero bytes: there is no
+ * room for a mark, readers see empty messages or records.
+ * Return 0 or -1.
+ */
+static int fifoPad(FifoDescriptor* fwd, off_t pos, size_t size) {
+	char buffer[4096];
+	size_t n = 0;
+	size_t k;
+	int digits = 0;
+	const FifoParameters* fpa = fwd->parameters;
+
+	if ( fpa->recordSize == 0 && fifoMarks(fpa) && size >= 3 ) {
+		/* as many digits as size has, leading zeros fill the rest */
+		for ( k = size; size > 3 && k > 0; k /= 10 ) ++digits;
+		if ( digits > 0 ) {
+			n = sprintf(buffer, "%c%c%0*lu%c", fpa->escape[0], PADMARK, digits,
+					(unsigned long) (size - 3 - digits), fpa->separator[0]);
+		} else {
+			n = sprintf(buffer, "%c%c%c", fpa->escape[0], PADMARK, fpa->separator[0]);
+		}
+		if ( fifoWriteAll(fwd->fd, buffer, n, pos) < 0 ) return -1;
+	}
+	memset(buffer, fpa->recordSize > 0 ? 0 : fpa->separator[0], sizeof(buffer));
+	for ( ; n < size; n += k ) {
+		k = size - n < sizeof(buffer) ? size - n : sizeof(buffer);
+		if ( fifoWriteAll(fwd->fd, buffer, k, pos + (off_t) n) < 0 ) return -1;
+	}
+	return 0;
+}
+
+/**
+ * Write data to data file.
+ * Reserve the range of the message by advancing the tail in the shared header.
+ * This takes no lock, so concurrent writers copy their messages in parallel.
+ * If data file would become oversized, roll file to new data file.
+ * Write complete buffer into the reserved range or at the beginning of new file.
+ * If that fails, fill the range with a pad record, which readers skip.
+ * Advance the commit watermark in order of the reservations, so readers see
+ * a message only after all preceding messages are written.
+ * Count the count messages contained in buffer in the shared header.
+ * If sync is set, the data is on disk before the watermark passes it.
+ * After a rollover, apply the retention policy of the queue, if any, and
+ * create the next subdirectory in sharded layout.
+ */
+static ssize_t writelocked(FifoDescriptor* fwd, const char* buffer, size_t size, int count, int sync) {
+
+	STATSSTART(t0);
+	ssize_t wres = -1;
+	uint64_t w;
+	off_t pos;
+	unsigned long gen;
+	int res;
+	int rolled = 0;
+	int serrno;
+	FifoTail* t = fwd->parameters->tail;
+	FifoSlot* slot = &t->slot[fwd->parameters->slot];
+	const off_t max = fwd->parameters->switchSize;
+
+	PROBE3(write__start, fwd->parameters->pathName, fwd->current, size);
+	for ( ;; ) {
+		gen = atomic_load(&t->gen);
+		w = atomic_load(&t->tail);
+		pos = TAILPOS(w);
+		if ( !TAILSAME(w, gen) ) {
+			/* rollover is being published */
+			continue;
+		}
+		if ( pos > 0 && pos + (off_t) size > max ) {
+			res = rolloverfile(fwd, w);
+			if ( res < 0 ) {
+				err("writelocked:");
+				goto RETURN;
+			}
+			rolled |= res;
+			continue;
+		}
+		if ( gen != fwd->current ) {
+			/* other writer did the rollover */
+			res = fifoReOpenWrite(fwd, gen);
+			if ( res < 0 ) {
+				err("writelocked:");
+				goto RETURN;
+			}
+			continue;
+		}
+		/* announce the range in the slot, before it is reserved */
+		atomic_store(&slot->start, w);
+		if ( atomic_compare_exchange_weak(&t->tail, &w, w + size) ) {
+			break;
+		}
+		atomic_store(&slot->start, 0);
+	}
+
+	wres = fifoWriteAll(fwd->fd, buffer, size, pos);
+	if ( wres < 0 ) {
+		err("writelocked write:");
+	} else if ( sync && fdatasync(fwd->fd) < 0 ) {
+		err("writelocked sync:");
+		wres = -1;
+	}
+	if ( wres < 0 && fifoPad(fwd, pos, size) < 0 ) {
+		/* the other writers commit the range, once it can be padded */
+		atomic_store(&slot->start, 0);
+		goto RETURN;
+	}
+	fifoTailWait(fwd, w);
+	if ( wres >= 0 ) atomic_fetch_add(&t->messages, count);
+	atomic_store(&t->commit, w + size);
+	atomic_store(&slot->start, 0);
+RETURN:
+	if ( rolled ) {
+		/* failures do not affect the write */
+		serrno = errno;
+		if ( fwd->parameters->shardSize > 0 && fwd->current % fwd->parameters->shardSize == 0 ) {
+			/* prepare next subdirectory, before it is needed */
+			fifoMakeShard(fwd->parameters, fwd->current + fwd->parameters->shardSize);
+		}
+		if ( fwd->parameters->retain ) {
+			collect(fwd->parameters, 0);
+		}
+		errno = serrno;
+	}
+	if ( wres >= 0 ) {
+		STATSADD(fwd, messages, 1);
+		STATSADD(fwd, bytes, wres);
+	}
+	STATSTIME(fwd, FIFO_TWRITE, t0);
+	PROBE3(write__done, fwd->parameters->pathName, fwd->current, wres);
+	return wres;
+}
+
+/*************************************** DELAY ********************************/
+/**
+ * Delayed messages are kept in time buckets dir/.delay/<seconds>, each
+ * containing the formatted messages not readable before that time.
+ * The earliest bucket is registered in the shared header, so writers and
+ * readers look at the buckets only when one is due.
+ */
+
+/**
+ * Register bucket in the shared header, if it is earlier than the registered one.
+ */
+static void fifoDueMin(struct FifoTail* t, uint64_t bucket) {
+	uint64_t d = atomic_load(&t->due);
+	while ( (d == 0 || bucket < d) && !atomic_compare_exchange_weak(&t->due, &d, bucket) ) ;
+}
+
+/**
+ * Check, whether a bucket of delayed messages is due. No system call, if none exists.
+ */
+static int fifoDue(const FifoParameters* fpa) {
+	uint64_t d = atomic_load(&fpa->tail->due);
+	return d != 0 && d <= (uint64_t) time(NULL);
+}
+
+/**
+ * Append formatted message to the bucket of its time.
+ * The bucket is locked against promotion; a bucket removed by promotion
+ * after open is created again.
+ */
+static ssize_t delaylocked(FifoDescriptor* fwd, uint64_t bucket, const char* buffer, size_t size) {
+	char name[FIFONAMELEN];
+	ssize_t wres = -1;
+	int fd = -1;
+	int lres = -1;
+	int fres;
+	struct stat st;
+	FifoParameters* fpa = fwd->parameters;
+
+	sprintf(name, "%s/%llu", DELAYDIR, (unsigned long long) bucket);
+	lres = lwlock(&fpa->locks->dely);
+	if ( lres < 0 ) {
+		err("delaylocked:");
+		goto RETURN;
+	}
+	for ( ;; ) {
+		fd = openat(fpa->dirfd, name, O_WRONLY | O_APPEND | O_CREAT, 0666);
+		if ( fd < 0 && errno == ENOENT && (mkdirat(fpa->dirfd, DELAYDIR, 0777) == 0 || errno == EEXIST) ) {
+			continue;
+		}
+		if ( fd < 0 ) {
+			errpath("delaylocked open:", name);
+			goto RETURN;
+		}
+		fres = takewritelock(fd);
+		if ( fres < 0 || fstat(fd, &st) < 0 ) {
+			errpath("delaylocked lock:", name);
+			goto RETURN;
+		}
+		if ( st.st_nlink > 0 ) break;
+		/* promoted meanwhile */
+		close(fd);
+	}
+	wres = write(fd, buffer, size);
+	if ( wres < 0 ) {
+		errpath("delaylocked write:", name);
+		goto RETURN;
+	}
+	fifoDueMin(fpa->tail, bucket);
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	if ( lres >= 0 ) lulock(&fpa->locks->dely);
+	return wres;
+}
+
+static int cmpbucket(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Write the messages of one bucket into the queue and remove the bucket.
+ */
+static int promotebucket(FifoDescriptor* fwd, int dfd, uint64_t bucket) {
+	char name[FIFONAMELEN];
+	char* buffer = NULL;
+	int res = -1;
+	int fd;
+	struct stat st;
+	ssize_t rres;
+	off_t i, start;
+	FifoParameters* fpa = fwd->parameters;
+	const int esc = fpa->escape[0] != ' ';
+
+	sprintf(name, "%llu", (unsigned long long) bucket);
+	fd = openat(dfd, name, O_RDWR);
+	if ( fd < 0 ) {
+		errpath("promotebucket open:", name);
+		goto RETURN;
+	}
+	if ( takewritelock(fd) < 0 || fstat(fd, &st) < 0 ) {
+		errpath("promotebucket lock:", name);
+		goto RETURN;
+	}
+	buffer = (char*) malloc(st.st_size + 1);
+	if ( buffer == NULL ) {
+		err("promotebucket malloc:");
+		goto RETURN;
+	}
+	rres = pread(fd, buffer, st.st_size, 0);
+	if ( rres < 0 ) {
+		errpath("promotebucket read:", name);
+		goto RETURN;
+	}
+	for ( i = 0, start = 0; i < rres; ++i ) {
+		if ( esc && buffer[i] == fpa->escape[0] ) {
+			++i;
+		} else if ( buffer[i] == fpa->separator[0] ) {
+			if ( writelocked(fwd, buffer + start, i + 1 - start, 1, 0) < 0 ) {
+				err("promotebucket:");
+				goto RETURN;
+			}
+			start = i + 1;
+		}
+	}
+	if ( unlinkat(dfd, name, 0) < 0 ) {
+		errpath("promotebucket unlink:", name);
+		goto RETURN;
+	}
+	res = 0;
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	if ( buffer ) free(buffer);
+	return res;
+}
+
+/**
+ * Promote the due buckets of delayed messages into the queue, oldest first.
+ * Only one writer promotes at a time. The registered due time is claimed
+ * and buckets not yet due are registered again.
+ * Return number of promoted buckets.
+ */
+static long promote(FifoDescriptor* fwd) {
+	FifoParameters* fpa = fwd->parameters;
+	FifoTail* t = fpa->tail;
+	DIR* dir = NULL;
+	struct dirent* dirent;
+	uint64_t* due = NULL;
+	uint64_t* more;
+	uint64_t bucket;
+	uint64_t now = (uint64_t) time(NULL);
+	size_t n = 0;
+	size_t size = 0;
+	size_t i;
+	long count = -1;
+	int fd = -1;
+	int dfd = -1;
+	int lres = -1;
+	int fres = -1;
+
+	lres = lwlock(&fpa->locks->dely);
+	fd = openat(fpa->dirfd, DELAYLOCK, O_RDWR | O_CREAT, 0666);
+	if ( fd < 0 ) {
+		errpath("promote open:", DELAYLOCK);
+		goto RETURN;
+	}
+	fres = takewritelock(fd);
+	if ( lres < 0 || fres < 0 ) {
+		err("promote:");
+		goto RETURN;
+	}
+	count = 0;
+	if ( !fifoDue(fpa) ) {
+		/* promoted by other writer */
+		goto RETURN;
+	}
+	atomic_store(&t->due, 0);
+
+	dfd = openat(fpa->dirfd, DELAYDIR, O_RDONLY | O_DIRECTORY);
+	dir = dfd < 0 ? NULL : fdopendir(dfd);
+	if ( dir == NULL ) {
+		errpath("promote opendir:", DELAYDIR);
+		count = -1;
+		goto RETURN;
+	}
+	while ( (dirent = readdir(dir)) ) {
+		if ( dirent->d_name[0] < '0' || dirent->d_name[0] > '9' ) continue;
+		bucket = strtoull(dirent->d_name, NULL, 10);
+		if ( bucket > now ) {
+			fifoDueMin(t, bucket);
+			continue;
+		}
+		if ( n == size ) {
+			size = size ? 2 * size : 16;
+			more = (uint64_t*) realloc(due, size * sizeof(*due));
+			if ( more == NULL ) {
+				err("promote malloc:");
+				fifoDueMin(t, bucket);
+				break;
+			}
+			due = more;
+		}
+		due[n++] = bucket;
+	}
+	if ( n > 0 ) qsort(due, n, sizeof(*due), cmpbucket);
+	for ( i = 0; i < n; ++i ) {
+		if ( promotebucket(fwd, dirfd(dir), due[i]) < 0 ) {
+			err("promote:");
+			for ( ; i < n; ++i ) fifoDueMin(t, due[i]);
+			count = -1;
+			goto RETURN;
+		}
+		count++;
+	}
+RETURN:
+	if ( dir ) {
+		closedir(dir);
+	} else if ( dfd >= 0 ) {
+		close(dfd);
+	}
+	if ( due ) free(due);
+	if ( fres >= 0 ) releaselock(fd);
+	if ( fd >= 0 ) close(fd);
+	if ( lres >= 0 ) lulock(&fpa->locks->dely);
+	return count;
+}
+
+/**
+ * Promote due delayed messages for a reader, which found no message.
+ * The reader never recovers the queue: it joins the writers by fifoWriterJoin,
+ * so none recovers the queue under it either, borrows a slot of the shared
+ * header and takes the locks of the delay buckets and, at rollover, of the
+ * write pointer. While a writer recovers the queue, the promotion is skipped.
+ * Without a header initialized by a writer the promotion is left to the
+ * writers. Failures are not reported, the promotion is tried again later.
+ */
+static long promotereader(FifoDescriptor* frd) {
+	char name[FIFONAMELEN];
+	long res = -1;
+	FifoDescriptor fwd;
+	FifoFilePointer fp;
+	FifoParameters* fpa = frd->parameters;
+
+	memset(&fwd, 0, sizeof(fwd));
+	memset(&fp, 0, sizeof(fp));
+	fwd.parameters = fpa;
+	fwd.filePointer = &fp;
+	fwd.fd = -1;
+	fwd.fdp = -1;
+	fwd.lanes = 1;
+	if ( fifoWriterJoin(fpa) < 0 || atomic_load(&fpa->tail->magic) != TAILMAGIC ||
+			fifoSlotTake(fpa) < 0 ) {
+		goto RETURN;
+	}
+	fwd.current = atomic_load(&fpa->tail->gen);
+	fifoCurrentFilename(fpa, fwd.current, name);
+	fwd.fd = openat(fpa->dirfd, name, O_WRONLY);
+	if ( fwd.fd < 0 ) {
+		errpath("promotereader open:", name);
+		goto RETURN;
+	}
+	fwd.fdp = fifoWpOpen(fpa);
+	if ( fwd.fdp < 0 ) {
+		errpath("promotereader open:", WPFILE);
+		goto RETURN;
+	}
+	res = promote(&fwd);
+RETURN:
+	fifoSlotDrop(fpa);
+	fifoWriterUnlock(fpa);
+	if ( fwd.fd >= 0 ) close(fwd.fd);
+	fifoWpRelease(fwd.fdp);
+	if ( res <= 0 ) {
+		/* nothing became readable, the read fails as before */
+		err(NULL);
+		errno = EAGAIN;
+	}
+	return res;
+}
+
+/**
+ * Open dir/.wp outside of a write pointer, to read or to lock it. With classic
+ * record locks closing a descriptor drops the locks of the whole process on
+ * the file, held by other threads meanwhile: it is opened once, kept with the
+ * queue locks and not closed by fifoWpRelease. Return it or -1.
+ */
+static int fifoWpOpen(const FifoParameters* fpa) {
+	int fd;
+#ifdef FIFO_PTHREAD_LOCKS
+	pthread_mutex_lock(&lockRegistry);
+	if ( fpa->locks->wpfd < 0 ) {
+		fpa->locks->wpfd = openat(fpa->dirfd, WPFILE, O_RDWR);
+		if ( fpa->locks->wpfd < 0 && errno == EACCES ) {
+			/* a reader without write permission only reads it */
+			fpa->locks->wpfd = openat(fpa->dirfd, WPFILE, O_RDONLY);
+		}
+	}
+	fd = fpa->locks->wpfd;
+	pthread_mutex_unlock(&lockRegistry);
+#else
+	fd = openat(fpa->dirfd, WPFILE, O_RDWR);
+	if ( fd < 0 && errno == EACCES ) fd = openat(fpa->dirfd, WPFILE, O_RDONLY);
+#endif
+	return fd;
+}
+
+static void fifoWpRelease(int fd) {
+#ifdef FIFO_PTHREAD_LOCKS
+	(void) fd;
+#else
+	if ( fd >= 0 ) close(fd);
+#endif
+}
+
+/*************************************** PRODUCER *****************************/
+/**
+ * Find the last header of the producer in a data file behind position stop,
+ * which starts a record. The file is read backwards in chunks of SCANCHUNK
+ * bytes and only headers are decoded. The sequence numbers of a producer
+ * grow in the order of its messages, so its last header has the highest.
+ * Return 1 after raising hwm to it, 0 if there is none.
+ */
+static int fifoScanProducer(const FifoParameters* fpa, unsigned long gen, uint32_t producer, off_t stop, uint64_t* hwm) {
+	char name[FIFONAMELEN];
+	char head[HEADLEN];
+	char* buffer = NULL;
+	int fd;
+	int res = -1;
+	int e, k;
+	struct stat st;
+	off_t start, end, next, r;
+	ssize_t size, i, j;
+	const char esc = fpa->escape[0];
+
+	fifoCurrentFilename(fpa, gen, name);
+	fd = openat(fpa->dirfd, name, O_RDONLY);
+	if ( fd < 0 && errno == ENOENT ) {
+		res = 0;
+		goto RETURN;
+	}
+	if ( fd < 0 || fstat(fd, &st) < 0 ) {
+		errpath("fifoScanProducer open:", name);
+		goto RETURN;
+	}
+	buffer = (char*) malloc(SCANCHUNK + HEADSPAN);
+	if ( buffer == NULL ) {
+		err("fifoScanProducer malloc:");
+		goto RETURN;
+	}
+	for ( end = st.st_size; end > stop; end = next ) {
+		start = end - SCANCHUNK > stop ? end - SCANCHUNK : stop;
+		/* with the headers of records starting before end */
+		size = pread(fd, buffer, end - start + HEADSPAN, start);
+		if ( size < 0 ) {
+			errpath("fifoScanProducer read:", name);
+			goto RETURN;
+		}
+		/* a record at start is decided by the next chunk, unless start is stop */
+		next = start == stop ? stop : start + 1;
+		for ( r = end - 1; r >= next; --r ) {
+			i = r - start;
+			if ( r > stop ) {
+				e = recordend(fpa, buffer, i - 1, start == stop);
+				if ( e < 0 && r + 1 < end ) {
+					/* escape characters up to start: decided by the next chunk */
+					next = r + 1;
+					break;
+				}
+				if ( e <= 0 ) continue;
+			}
+			if ( i + 1 >= size || buffer[i] != esc || buffer[i+1] != HEADMARK ) continue;
+			for ( j = i + 2, k = 0; j < size && k < HEADLEN; ++j ) {
+				if ( buffer[j] == esc && ++j >= size ) break;
+				head[k++] = buffer[j];
+			}
+			if ( k == HEADLEN && fifoGet(head + 16, 4) == producer ) {
+				if ( fifoGet(head + 8, 8) > *hwm ) *hwm = fifoGet(head + 8, 8);
+				res = 1;
+				goto RETURN;
+			}
+		}
+	}
+	res = 0;
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	if ( buffer ) free(buffer);
+	return res;
+}
+
+/**
+ * Set the high-water mark of the producer to sequence, after its message
+ * was committed, and keep the end of the committed data with it: later
+ * messages of the producer are written behind.
+ */
+static void fifoProducerMark(const FifoParameters* fpa, FifoProducer* pd, uint64_t sequence) {
+	uint64_t gen;
+	uint64_t w;
+
+	do {
+		gen = atomic_load(&fpa->tail->gen);
+		w = atomic_load(&fpa->tail->commit);
+	} while ( !TAILSAME(w, gen) );
+	pd->hwm[0] = sequence;
+	pd->hwm[1] = gen;
+	pd->hwm[2] = (uint64_t) TAILPOS(w);
+}
+
+/**
+ * Unmap the high-water mark and unlock the producer file.
+ */
+static void fifoFreeProducer(FifoProducer* pd) {
+	if ( pd == NULL ) return;
+	munmap(pd->hwm, PRODWORDS * sizeof(uint64_t));
+	close(pd->fd);
+	free(pd);
+}
+
+/*************************************** TRANSACTION **************************/
+/**
+ * Append a formatted message to the transaction of the write pointer.
+ */
+static ssize_t stage(FifoDescriptor* fwd, const char* buffer, size_t size) {
+	char* p;
+	size_t n;
+	FifoTransaction* tx = fwd->transaction;
+
+	if ( tx->size + size > tx->allocated ) {
+		n = tx->allocated > 0 ? tx->allocated : 4096;
+		while ( n < tx->size + size ) n *= 2;
+		p = (char*) realloc(tx->buffer, n);
+		if ( p == NULL ) {
+			err("stage realloc:");
+			return -1;
+		}
+		tx->buffer = p;
+		tx->allocated = n;
+	}
+	memcpy(tx->buffer + tx->size, buffer, size);
+	tx->size += size;
+	tx->count += 1;
+	return size;
+}
+
+/**
+ * Drop the staged messages of a transaction.
+ */
+static void fifoFreeTransaction(FifoTransaction* tx) {
+	if ( tx == NULL ) return;
+	if ( tx->buffer ) free(tx->buffer);
+	free(tx);
+}
+
+/*************************************** READ *********************************/
+/**
+ * Format message to remove escape sequences.
+ * NOP if escape is blank.
+ */
+static ssize_t fifoFormatReadBuffer(FifoParameters *fp, char* buffer, ssize_t* s) {
 
 	ssize_t i, j;
 	char ch;
 	ssize_t size = *s;
+	int esc = fp->escape[0] != ' ';	
+	*s = -1;
+
+	for ( i = 0, j = 0; i < size; ++i ) {
+		ch = buffer[i];
+		if ( esc && ch == fp->escape[0] ) {
+			if ( ++i >= size ) {
+				errno = EILSEQ;
+				err("fifoFormatReadBuffer: incomplete escape");
+				return -1;
+			}
+			ch = buffer[i];
+		} else if ( ch == fp->separator[0] ) {
+			*s = i + 1;
+			break;
+		}
+		buffer[j++] = ch;
+	}
+	if ( *s <= 0 ) {
+		errno = E2BIG;
+		err("fifoFormatReadBuffer: message longer than receive buffer");
+		return -2;
+	}
+	buffer[j] = '\0';
+	return j;	
+}
+
+/**
+ * Format output for read- or write pointer files.
+ */
+static int poffset( char* rbuffer, unsigned long curr, off_t o1, off_t o2, uint64_t base, uint64_t messages ) {
+	return sprintf(rbuffer, "%lu %ld %ld %d %llu %llu\n", (long)curr, (long)o1, (long)o2, (int)getpid(),
+			(unsigned long long)base, (unsigned long long)messages);
+}
+
+/**
+ * Read form read- or write pointer file.
+ */
+static int readoffset(int fdadm, unsigned long* curr, off_t* o1, off_t* o2, uint64_t* base, uint64_t* messages ) {
+	char rbuffer[128];
+	ssize_t rres;
+	int res = -1;
+	unsigned long long b = 0;
+	unsigned long long m = 0;
+
+	*curr = 0;
+	*o1 = 0;
+	*o2 = 0;
+	*base = 0;
+	*messages = 0;
+	/* without the file offset, which threads sharing fdadm would move */
+	rres = pread(fdadm, rbuffer, sizeof(rbuffer) - 1, 0);
+	if ( rres < 0 ) goto RETURN;
+	rbuffer[rres] = '\0';
+	res = rres;
+	/* logical offset and messages are missing in files of older versions */
+	sscanf( rbuffer, "%lu%ld%ld%*d%llu%llu", curr, o1, o2, &b, &m);
+	*base = b;
+	*messages = m;
+RETURN:
+	return res;
+}
+
+/**
+ * Write to read- or write pointer file.
+ */
+static int printoffset(int fdadm, unsigned long curr, off_t o1, off_t o2,
+						uint64_t base, uint64_t messages, size_t lastsize) {
+	ssize_t wres;
+	off_t sres;
+	char rbuffer[128];
+	int res = -1;
+	size_t size;
+
+	poffset(rbuffer, curr, o1, o2, base, messages);
+	size = strlen(rbuffer);
+
+	if ( size < lastsize ) {
+		if ( ftruncate(fdadm, 0 ) < 0 ) {
+			goto RETURN;
+		}
+	}
+	sres = lseek(fdadm, 0, SEEK_SET);
+	if ( sres < 0 ) goto RETURN;
+	wres = write(fdadm, rbuffer, strlen(rbuffer));
+	if ( wres < 0 ) goto RETURN;
+	res = 0;
+RETURN:
+	return res;
+}
+
+/**
+ * Read next message from read stream. If no message is available, return error EAGAIN.
+ * Messages beyond the commit watermark of the writers are not yet available.
+ * If previous message has not been released return error.
+ * If current message is longer than read buffer return error.
+ * Take and release write lock for read admin and read lock for data.
+ */
+static ssize_t readlocked(FifoDescriptor* frd, char* buffer, size_t size) {
+
+	STATSSTART(t0);
+	ssize_t wres = -1;
+	ssize_t osize = 0;
+	int fares = -1;
+	int lares = lwlock(&frd->parameters->locks->radm);
+	int lres = -1;
+	int fres = -1;
+	off_t sres;
+	int res;
+	int fd = frd->fd;
+	int fdadm = frd->fdp;
+	FifoParameters *fp = frd->parameters;
+	FifoFilePointer *frp = frd->filePointer;
+	FifoTail* t = fp->tail;
+	uint64_t w;
+	off_t avail;
+	size_t n;
+	int skipped = 0;
+	int roll = 0;
+	const size_t rec = fp->recordSize;
+	PROBE3(read__start, fp->pathName, frd->current, size);
+	fares = takewritelock(fdadm);
+	if ( fares < 0 || lares < 0 ) {
+		err("readlocked: readadminlock:");
+		goto RETURN;
+	}
+	lres = lrlock(&frd->parameters->locks->data);
+	fres = takereadlock(fd);
+	if ( lres < 0 || fres < 0 ) {
+		err("readlocked: datalock:");
+		goto RETURN;
+	}
+	STATSTIME(frd, FIFO_TLOCK, t0);
+	res = fifoReadFilePointer(frd);
+	if ( res < 0 ) goto RETURN;
+	if ( frp->current != frd->current ) {
+		/* re-open fd with other file */
+		res = fifoReOpenRead(frd);
+		if ( res < 0 && errno == ENOENT ) {
+			err(NULL);
+			errno = EAGAIN;
+			goto RETURN;
+		}
+		if ( res < 0 ) {
+			err("fifoRead:");
+			goto RETURN;
+		}
+	}
+	if ( frp->readPos > frp->releasePos ) {
+		errno = ESPIPE;
+		err("fifoRead: must first call release:");
+		wres = -1; 
+		goto RETURN;	/* must first call release */
+	}
+
+	if ( rec > 0 && size < rec ) {
+		errno = E2BIG;
+		err("fifoRead: record longer than receive buffer");
+		goto RETURN;
+	}
+	for ( ;; ) {
+		/* as many whole records as fit into buffer */
+		n = rec > 0 ? size - size % rec : size;
+		if ( atomic_load(&t->magic) == TAILMAGIC ) {
+			/* the current data file of the writers is readable up to the commit watermark */
+			w = atomic_load(&t->commit);
+			if ( frd->current >= atomic_load(&t->gen) ) {
+				avail = TAILSAME(w, frd->current) ? TAILPOS(w) - frp->readPos : 0;
+				if ( avail <= 0 ) {
+					wres = -1;
+					errno = EAGAIN;
+					goto RETURN;
+				}
+				if ( (size_t) avail < n ) n = avail;
+			}
+		}
+
+		sres = lseek(fd, frp->readPos, SEEK_SET);
+		if ( sres < 0 ) {
+			err("fifoRead lseek:");
+			wres = -1;
+			goto RETURN;
+		}
+		wres = read(fd, buffer, n);
+		if ( wres < 0 ) {
+			err("fifoRead read:");
+			goto RETURN;
+		}
+		if ( wres == 0 && rec > 0 && atomic_load(&t->magic) == TAILMAGIC &&
+				frd->current < atomic_load(&t->gen) ) {
+			/* the end of a completed generation of records acts as roll-mark */
+			frd->filePointer->roll = 1;
+			roll = 1;
+			break;
+		}
+		if ( wres == 0 ) {
+			wres = -1;
+			errno = EAGAIN;
+			goto RETURN;
+		}
+		if ( !fifoMarks(fp) || wres < 2 || buffer[0] != fp->escape[0] ||
+				(buffer[1] != TXBEGIN && buffer[1] != TXCOMMIT && buffer[1] != PADMARK) ) {
+			break;
+		}
+		/* transaction marker or pad, no message */
+		if ( txskip(frd, buffer, wres) < 0 ) {
+			wres = -1;
+			goto RETURN;
+		}
+		skipped = 1;
+	}
+
+	if ( rec > 0 ) {
+		/* records are stored as they are */
+		osize = wres - wres % rec;
+		wres = osize;
+		frp->header = 0;
+		if ( osize == 0 && !roll ) {
+			wres = -1;
+			errno = EAGAIN;
+			goto RETURN;
+		}
+		frp->readPos += osize;
+		goto RETURN;
+	}
+	if (memcmp(buffer, fp->rollmark, strlen(fp->rollmark)) == 0) {
+		frd->filePointer->roll = 1;
+		roll = 1;
+	}	
+	frp->header = fp->escape[0] != ' ' && wres >= 2 &&
+			buffer[0] == fp->escape[0] && buffer[1] == HEADMARK;
+
+	osize = wres;
+	wres = fifoFormatReadBuffer(fp, buffer, &osize);
+	if ( wres < 0 ) {
+		goto RETURN;
+	}
+
+	frp->readPos += osize;
+RETURN:
+	if ( fres >= 0 ) releaselock(fd);
+	if ( lres >= 0 ) lulock(&frd->parameters->locks->data);
+
+	if ( wres >= 0 || skipped ) {
+		fifoWriteFilePointer(frd);
+	}
+	if ( fares >= 0 ) releaselock(fdadm);
+	if ( lares >= 0 ) lulock(&frd->parameters->locks->radm);
+	if ( wres >= 0 && !roll ) {
+		STATSADD(frd, messages, 1);
+		STATSADD(frd, bytes, osize);
+	} else if ( errno == EAGAIN ) {
+		STATSADD(frd, polls, 1);
+	}
+	STATSTIME(frd, FIFO_TREAD, t0);
+	PROBE3(read__done, fp->pathName, frd->current, wres);
+	return wres;
+}
+
+/**
+ * Skip the transaction marker or pad record at the read position, as if it
+ * was read and released. If the commit marker is missing behind the group announced by
+ * a begin marker, the group is incomplete and skipped as a whole with a
+ * single read.
+ */
+static int txskip(FifoDescriptor* frd, char* buffer, ssize_t size) {
+	char mark[3];
+	ssize_t osize = size;
+	ssize_t res;
+	off_t end;
+	FifoParameters* fp = frd->parameters;
+	FifoFilePointer* frp = frd->filePointer;
+
+	res = fifoFormatReadBuffer(fp, buffer, &osize);
+	if ( res < 0 ) {
+		err("txskip:");
+		return -1;
+	}
+	frp->readPos += osize;
+	if ( buffer[0] == PADMARK ) {
+		/* filler behind the pad record */
+		frp->readPos += strtol(buffer + 1, NULL, 10);
+	}
+	if ( buffer[0] == TXBEGIN ) {
+		end = frp->readPos + strtol(buffer + 1, NULL, 10);
+		res = pread(frd->fd, mark, sizeof(mark), end);
+		if ( res < 0 ) {
+			err("txskip read:");
+			return -1;
+		}
+		if ( res < (ssize_t) sizeof(mark) || mark[0] != fp->escape[0] ||
+				mark[1] != TXCOMMIT || mark[2] != fp->separator[0] ) {
+			/* incomplete group */
+			frp->readPos = end;
+		}
+	}
+	frp->releasePos = frp->readPos;
+	return 0;
+}
+
+/**
+ * Read next message from the priority lanes, the highest non-empty lane first.
+ * Roll-marks of lanes 1 .. are released here, those of lane 0 by the caller.
+ * A single lane queue reads its own data files only.
+ */
+static ssize_t readlanes(FifoDescriptor* frd, char* buffer, size_t size) {
+
+	ssize_t rres = -1;
+	int k;
+	FifoDescriptor* fld;
+
+	if ( frd->lane == NULL ) {
+		return readlocked(frd, buffer, size);
+	}
+	if ( frd->readLane > 0 || frd->filePointer->readPos > frd->filePointer->releasePos ) {
+		errno = ESPIPE;
+		err("readlanes: must first call release:");
+		goto RETURN;
+	}
+	for ( k = frd->lanes - 1; k > 0; --k ) {
+		fld = frd->lane[k-1];
+		while ( (rres = readlocked(fld, buffer, size)) >= 0 && fld->filePointer->roll == 1 ) {
+			release(fld);
+		}
+		if ( rres >= 0 ) {
+			frd->readLane = k;
+			goto RETURN;
+		}
+		if ( errno != EAGAIN ) {
+			err("readlanes:");
+			goto RETURN;
+		}
+	}
+	rres = readlocked(frd, buffer, size);
+RETURN:
+	return rres;
+}
+
+/**
+ * Release the last message read in the lane it was read from.
+ */
+static ssize_t releaselane(FifoDescriptor* frd) {
+	ssize_t res;
+	if ( frd->readLane == 0 ) {
+		return release(frd);
+	}
+	res = release(frd->lane[frd->readLane-1]);
+	if ( res >= 0 ) frd->readLane = 0;
+	return res;
+}
+
+/**
+ * Release a message from given read stream.
+ * Take write locks on read administration.
+ * If values of read position and release position in the read pointer
+ * are not identical to what was found in the read pointer file, return
+ * with error code ESPIPE.
+ * Write new values into read pointer file.
+ */
+static ssize_t release(FifoDescriptor* frd) {
+
+	STATSSTART(t0);
+	ssize_t wres = -1;
+	int res;
+	int lres = lwlock(&frd->parameters->locks->radm);
+	int fdadm = frd->fdp;
+	int fres = takewritelock(fdadm);
+	FifoFilePointer* frp = frd->filePointer;
+	off_t releasepos = frd->filePointer->releasePos;
+	off_t readpos = frd->filePointer->readPos;
+	int roll = frd->filePointer->roll;
+	PROBE3(release__start, frd->parameters->pathName, frd->current, readpos);
+	if ( lres < 0 || fres < 0 ) {
+		err("release: ");
+		goto RETURN;
+	}
+	STATSTIME(frd, FIFO_TLOCK, t0);
+	res = fifoReadFilePointer(frd);
+	if ( res < 0 ) goto RETURN;
+	if ( releasepos != frp->releasePos || readpos != frp->readPos ) {
+		err(NULL);
+		errno = ESPIPE;
+		err("release concurrent use of read pointer");
+		goto RETURN;
+	}
+	frp->current = frd->current;
+	if ( roll ) {
+		/* the roll-mark ends the generation */
+		frp->base += frp->readPos;
+	} else if ( frp->readPos > frp->releasePos && frd->parameters->recordSize > 0 ) {
+		frp->messages += (frp->readPos - frp->releasePos) / frd->parameters->recordSize;
+	} else if ( frp->readPos > frp->releasePos ) {
+		frp->messages += 1;
+	}
+	frp->releasePos = frp->readPos;
+	if ( roll ) {
+		frp->current += 1;
+		frp->releasePos = 0;
+		frp->readPos = 0;
+	}
+	wres = fifoWriteFilePointer(frd);
+RETURN:
+	if (fres >= 0) releaselock(fdadm);
+	if (lres >= 0) lulock(&frd->parameters->locks->radm);
+	STATSTIME(frd, FIFO_TRELEASE, t0);
+	PROBE3(release__done, frd->parameters->pathName, frp->current, wres);
+	return wres;
+}
+
+/**
+ * Read with waiting.
+ * If no unread message available, sleep for a while (wtim msec) and try again until
+ * maximal wait time (maxtime msec) is exceeded.
+ * The time expired while waiting for locks is not taken into account.
+ * If maxtime < 0, no attempt is made to read; if wtim <= 0, exactly one.
+ * Rewturn the number of bytes read or -1 in case of error.
+ */
+ssize_t fifoReadW(FifoDescriptor *frd, void* buffer, size_t size, long wtim, long maxtime) {
+	ssize_t rres;
+	rres = readwait(frd, buffer, size, wtim, maxtime);
+	if ( rres >= 0 ) {
+		rres = fifoStripHeader(frd, buffer, rres);
+	}
+	return rres;
+}
+
+/**
+ * Read with waiting, leave binary header of the message in buffer.
+ */
+static ssize_t readwait(FifoDescriptor *frd, char* buffer, size_t size, long wtim, long maxtime) {
+	return waitread(readonce, frd, buffer, size, wtim, maxtime);
+}
+
+/**
+ * Call attempt until it finds a message or fails with other error than EAGAIN,
+ * sleeping wtim ms between the attempts up to maxtime ms. With wtim <= 0 try
+ * once. The read pointers and the partitions are read this way.
+ * Return the size of the message, or -1 with ETIME after the waiting.
+ */
+static ssize_t waitread(ssize_t (*attempt)(void*, char*, size_t), void* arg, char* buffer, size_t size, long wtim, long maxtime) {
+	ssize_t rres = -1;
+	struct timespec interval;
+	long cumtime = 0;
+
+	interval.tv_sec = wtim / 1000;
+	interval.tv_nsec = (wtim * 1000000) % 1000000000;
+	
+	while ( cumtime <= maxtime ) {
+		rres = (*attempt)(arg, buffer, size);
+		if ( rres >= 0 || errno != EAGAIN || wtim <= 0 ) {
+			break;
+		}
+		nanosleep(&interval, NULL);
+		errno = ETIME;
+		cumtime += wtim;
+		rres = -1;
+	}
+	return rres;
+}
+
+/**
+ * Read the next message of the read pointer, after due delayed messages were
+ * promoted. Roll-marks are released on the way.
+ */
+static ssize_t readonce(void* arg, char* buffer, size_t size) {
+	ssize_t rres;
+	FifoDescriptor* frd = (FifoDescriptor*) arg;
+
+	for ( ;; ) {
+		rres = readlanes(frd, buffer, size);
+		if ( rres < 0 && errno == EAGAIN && fifoDue(frd->parameters) && promotereader(frd) > 0 ) {
+			/* delayed messages became readable */
+			continue;
+		}
+		if ( rres < 0 || frd->filePointer->roll != 1 ) {
+			return rres;
+		}
+		release(frd);
+	}
+}
+
+/**
+ * Read the next message from the bound partitions, starting behind the
+ * partition read last. Roll-marks are released on the way.
+ */
+static ssize_t readparts(void* arg, char* buffer, size_t size) {
+	ssize_t rres;
+	int i, k;
+	FifoDescriptor* frd;
+	FifoPartitions* fpr = (FifoPartitions*) arg;
+
+	for ( i = 0; i < fpr->count; ++i ) {
+		k = (fpr->next + i) % fpr->count;
+		frd = fpr->part[k];
+		if ( frd == NULL ) continue;
+		while ( (rres = readlocked(frd, buffer, size)) >= 0 && frd->filePointer->roll == 1 ) {
+			release(frd);
+		}
+		if ( rres >= 0 ) {
+			fpr->last = k;
+			fpr->next = (k + 1) % fpr->count;
+			return rres;
+		}
+		if ( errno != EAGAIN ) {
+			return -1;
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/**
+ * Decode the binary header of the last message read into header and
+ * let payload point behind it. The header is 0 for a message without header.
+ * Return the size of the payload.
+ */
+static ssize_t fifoParseHeader(const FifoDescriptor* frd, char* buffer, ssize_t size, FifoHeader* header, char** payload) {
+	const FifoDescriptor* from = frd->readLane > 0 ? frd->lane[frd->readLane-1] : frd;
+
+	memset(header, 0, sizeof(*header));
+	*payload = buffer;
+	if ( !from->filePointer->header ) {
+		return size;
+	}
+	if ( size < 1 + HEADLEN ) {
+		errno = EILSEQ;
+		err("fifoParseHeader: incomplete header");
+		return -1;
+	}
+	header->time = fifoGet(buffer + 1, 8);
+	header->sequence = fifoGet(buffer + 9, 8);
+	header->producer = (uint32_t) fifoGet(buffer + 17, 4);
+	header->attrSize = (uint16_t) fifoGet(buffer + 21, 2);
+	if ( size < 1 + HEADLEN + header->attrSize ) {
+		errno = EILSEQ;
+		err("fifoParseHeader: incomplete attributes");
+		return -1;
+	}
+	header->attributes = buffer + 1 + HEADLEN;
+	*payload = buffer + 1 + HEADLEN + header->attrSize;
+	return size - 1 - HEADLEN - header->attrSize;
+}
+
+/**
+ * Remove the binary header of the last message read from buffer.
+ */
+static ssize_t fifoStripHeader(const FifoDescriptor* frd, char* buffer, ssize_t size) {
+	FifoHeader header;
+	char* payload;
+	ssize_t res;
+
+	res = fifoParseHeader(frd, buffer, size, &header, &payload);
+	if ( res >= 0 && payload != buffer ) {
+		memmove(buffer, payload, res);
+		buffer[res] = '\0';
+	}
+	return res;
+}
+
+/**
+ * Re-open read descriptor to switch reading to current file.
+ */
+static int fifoReOpenRead(FifoDescriptor* frd) {
+
+	char name[FIFONAMELEN];
+	int res = -1;
+	int fd2;
+	int fres = -1;
+
+	PROBE2(reopen__start, frd->parameters->pathName, frd->filePointer->current);
+	fifoCurrentFilename(frd->parameters, frd->filePointer->current, name);
+	fd2 = openat(frd->parameters->dirfd, name, O_RDONLY);
+	if ( fd2 < 0 ) {
+		errpath("fifoReOpenRead open:", name);
+		goto RETURN;
+	}
+	/* transport held read lock to new file descriptor */
+	fres = takereadlock(fd2);
+	if ( fres < 0 ) {
+		err("fifoReOpenRead: transport lock");
+		goto RETURN;
+	}
+	close(frd->fd);
+	res = dup2(fd2, frd->fd);
+	close(fd2);
+	if ( res != frd->fd ) {
+		err("fifoReOpenRead dup:");
+		goto RETURN;
+	}
+	frd->current = frd->filePointer->current;
+RETURN:
+	PROBE3(reopen__done, frd->parameters->pathName, frd->filePointer->current, res);
+	return res;
+}
+
+/**
+ * Read write - or read pointer from file. No locks.
+ */
+static int fifoOpenFilePointer(FifoDescriptor* frd, const char* readpf) {
+	int namelen;
+	char* name;
+	FifoFilePointer* frp;
+
+	if ( frd == NULL ) {
+		errno = EFAULT;
+		err("fifoOpenFilePointer frd == NULL");
+		goto RETURN;
+	}
+
+	frp = frd->filePointer;
+	if ( frp == NULL ) {
+		errno = EFAULT;
+		err("fifoOpenFilePointer frd->filePointer == NULL");
+		goto RETURN;
+	}
+
+	frp->current = 0;
+	frp->readPos = 0;
+	frp->releasePos = 0;
+	frp->pid = 0;
+	frp->base = 0;
+	frp->messages = 0;
+
+	frd->fdp = -2;
+	namelen = 1;
+	if ( readpf ) {
+		namelen += strlen(RPPREFIX) + strlen(readpf);
+	} else {
+		namelen += strlen(WPFILE);
+	}
+	name = (char*) malloc(namelen);
+	if ( name == NULL ) {
+		err("fifoOpenFilePointer malloc:");
+		goto RETURN;
+	}
+	name[0] = '\0';
+	if ( readpf ) {
+		strcat(name, RPPREFIX);
+		strcat(name, readpf);
+	} else {
+		strcat(name, WPFILE);
+	}
+	frp->readPointerFile = name;
+
+	frd->fdp = openat(frd->parameters->dirfd, name, O_RDWR | O_CREAT, 0666);
+	if ( frd->fdp < 0 ) {
+		errpath("fifoOpenFilePointer open:", name);
+		goto RETURN;
+	}
+
+RETURN:
+	if ( frd && frd->fdp < 0 ) {
+		if ( name ) {
+			free(name);
+			frp->readPointerFile = NULL;
+		}
+	}
+	return frd->fdp;
+}
+
+/**
+ * Write read pointer into file. No locks.
+ */
+static int fifoReadFilePointer(FifoDescriptor* frd) {
+	int res;
+	FifoFilePointer* fr = frd->filePointer;
+	res = readoffset(frd->fdp, &fr->current, &fr->readPos, &fr->releasePos, &fr->base, &fr->messages);
+	fr->fileSize = res;
+	fr->roll = 0;
+	return res;
+}
+
+/**
+ * Write write pointer into file. No locks.
+ */
+static int fifoWriteFilePointer(FifoDescriptor* frd) {
+	int res;
+	FifoFilePointer* fr = frd->filePointer;
+	res = printoffset(frd->fdp, fr->current, fr->readPos, fr->releasePos, fr->base, fr->messages, fr->fileSize);
+	return res;
+}
+
+/*************************************** MANIFEST *****************************/
+/**
+ * The manifest file dir/.manifest keeps the range of live data file generations
+ * and per generation metadata, so that no directory scan is needed.
+ * It consists of lines of fixed length MANRECLEN:
+ * - header: <first> <last> <base> <total>
+ *   oldest and newest live generation, generation of the first record and
+ *   total size of the closed generations first .. last-1
+ * - one record for each generation base, base+1, .. last:
+ *   <generation> <size> <creation time> <close time>
+ * The manifest is updated at rollover and at collection time and rebuilt
+ * from a directory scan, if it is missing or invalid.
+ */
+static off_t manifestPos(const FifoManifest* m, unsigned long gen) {
+	return (off_t) (gen - m->base + 1) * MANRECLEN;
+}
+
+/**
+ * Read one fixed length line of the manifest and scan four numbers.
+ */
+static int manifestReadLine(int fd, off_t pos, const char* format, void* a, void* b, void* c, void* d) {
+	char buffer[MANRECLEN+1];
+	ssize_t rres;
+
+	if ( lseek(fd, pos, SEEK_SET) < 0 ) return -1;
+	rres = read(fd, buffer, MANRECLEN);
+	if ( rres != MANRECLEN || buffer[MANRECLEN-1] != '\n' ) return -1;
+	buffer[MANRECLEN] = '\0';
+	if ( sscanf(buffer, format, a, b, c, d) != 4 ) return -1;
+	return 0;
+}
+
+/**
+ * Write one fixed length line of the manifest.
+ */
+static int manifestWriteLine(int fd, off_t pos, unsigned long a, long b, long c, long d) {
+	char buffer[MANRECLEN+1];
+
+	sprintf(buffer, "%20lu %20ld %20ld %20ld\n", a, b, c, d);
+	if ( lseek(fd, pos, SEEK_SET) < 0 ) return -1;
+	if ( write(fd, buffer, MANRECLEN) != MANRECLEN ) return -1;
+	return 0;
+}
+
+static int manifestWriteHeader(int fd, const FifoManifest* m) {
+	return manifestWriteLine(fd, 0, m->first, (long)m->last, (long)m->base, (long)m->total);
+}
+
+/**
+ * Read record of generation gen. Return -1, if the record is not valid.
+ */
+static int manifestReadRecord(int fd, const FifoManifest* m, unsigned long gen,
+								off_t* size, time_t* created, time_t* closed) {
+	unsigned long rgen;
+	long rsize, rcreated, rclosed;
+
+	if ( gen < m->base ) return -1;
+	if ( manifestReadLine(fd, manifestPos(m, gen), "%lu %ld %ld %ld",
+			&rgen, &rsize, &rcreated, &rclosed) < 0 || rgen != gen ) {
+		return -1;
+	}
+	*size = rsize;
+	*created = rcreated;
+	*closed = rclosed;
+	return 0;
+}
+
+static int manifestWriteRecord(int fd, const FifoManifest* m, unsigned long gen,
+								off_t size, time_t created, time_t closed) {
+	return manifestWriteLine(fd, manifestPos(m, gen), gen, (long)size, (long)created, (long)closed);
+}
+
+/**
+ * Read and validate manifest header. The record of the last generation must exist.
+ */
+static int manifestReadHeader(int fd, FifoManifest* m) {
+	off_t size;
+	time_t created, closed;
+
+	if ( manifestReadLine(fd, 0, "%lu %lu %lu %ld", &m->first, &m->last, &m->base, &m->total) < 0 ) {
+		return -1;
+	}
+	if ( m->first < m->base || m->last < m->first ) return -1;
+	return manifestReadRecord(fd, m, m->last, &size, &created, &closed);
+}
+
+/**
+ * Rebuild the manifest from a scan of the queue directory.
+ * Generations before the last one are considered closed at their modification time.
+ */
+static int manifestRebuild(int fd, const FifoParameters* fpa, FifoManifest* m) {
+	int res = -1;
+	unsigned long gen;
+	char name[FIFONAMELEN];
+	struct stat st;
+
+	if ( fifoScanGenerations(fpa, &m->first, &m->last) < 0 ) {
+		err("manifestRebuild:");
+		goto RETURN;
+	}
+	m->base = m->first;
+	m->total = 0;
+	if ( ftruncate(fd, 0) < 0 ) {
+		err("manifestRebuild truncate:");
+		goto RETURN;
+	}
+	for ( gen = m->first; gen <= m->last; ++gen ) {
+		fifoCurrentFilename(fpa, gen, name);
+		if ( fstatat(fpa->dirfd, name, &st, 0) < 0 ) {
+			st.st_size = 0;
+			st.st_mtime = 0;
+		}
+		if ( gen < m->last ) m->total += st.st_size;
+		res = manifestWriteRecord(fd, m, gen, st.st_size, st.st_mtime,
+			gen < m->last ? st.st_mtime : 0);
+		if ( res < 0 ) {
+			err("manifestRebuild write:");
+			goto RETURN;
+		}
+	}
+	res = manifestWriteHeader(fd, m);
+	if ( res < 0 ) {
+		err("manifestRebuild write:");
+	}
+RETURN:
+	return res;
+}
+
+/**
+ * Open manifest file and take lock of given type (F_RDLCK or F_WRLCK).
+ * If the manifest is missing or invalid, rebuild it; in this case a
+ * write lock is held on return.
+ * Return file descriptor of manifest, which has to be released by manifestUnlock.
+ */
+static int manifestLock(const FifoParameters* fpa, int type, FifoManifest* m) {
+	int fd = -1;
+	int res = -1;
+
+	fd = openat(fpa->dirfd, MANIFEST, O_RDWR | O_CREAT, 0666);
+	if ( fd < 0 ) {
+		errpath("manifestLock open:", MANIFEST);
+		goto RETURN;
+	}
+	res = type == F_WRLCK ? lwlock(&fpa->locks->mani) : lrlock(&fpa->locks->mani);
+	if ( res < 0 ) {
+		err("manifestLock:");
+		goto RETURN;
+	}
+	res = dolock(fd, type);
+	if ( res < 0 ) {
+		lulock(&fpa->locks->mani);
+		err("manifestLock:");
+		goto RETURN;
+	}
+	res = manifestReadHeader(fd, m);
+	if ( res < 0 ) {
+		/* upgrade to write lock and check again, before rebuilding */
+		releaselock(fd);
+		lulock(&fpa->locks->mani);
+		res = lwlock(&fpa->locks->mani);
+		if ( res < 0 ) {
+			err("manifestLock:");
+			goto RETURN;
+		}
+		res = takewritelock(fd);
+		if ( res < 0 ) {
+			lulock(&fpa->locks->mani);
+			err("manifestLock:");
+			goto RETURN;
+		}
+		res = manifestReadHeader(fd, m);
+		if ( res < 0 ) {
+			res = manifestRebuild(fd, fpa, m);
+		}
+		if ( res < 0 ) {
+			releaselock(fd);
+			lulock(&fpa->locks->mani);
+		}
+	}
+RETURN:
+	if ( res < 0 && fd >= 0 ) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+static void manifestUnlock(const FifoParameters* fpa, int fd) {
+	(void) fpa;	/* only used with process internal locks */
+	releaselock(fd);
+	lulock(&fpa->locks->mani);
+	close(fd);
+}
+
+/**
+ * Get the oldest and the newest live generation of the queue from the manifest.
+ * If the manifest is not accessible, scan the directory.
+ */
+static int fifoGetRange(const FifoParameters* fpa, unsigned long* first, unsigned long* last) {
+	int fd;
+	FifoManifest m;
+
+	fd = manifestLock(fpa, F_RDLCK, &m);
+	if ( fd < 0 ) {
+		return fifoScanGenerations(fpa, first, last) < 0 ? -1 : 0;
+	}
+	manifestUnlock(fpa, fd);
+	*first = m.first;
+	*last = m.last;
+	return 0;
+}
+
+/**
+ * Register rollover from generation oldgen with final size to generation newgen.
+ */
+static int fifoManifestRoll(const FifoParameters* fpa, unsigned long oldgen, off_t size, unsigned long newgen) {
+	int fd;
+	int res = -1;
+	unsigned long gen;
+	off_t osize;
+	time_t created, closed;
+	time_t now = time(NULL);
+	FifoManifest m;
+
+	fd = manifestLock(fpa, F_WRLCK, &m);
+	if ( fd < 0 ) {
+		err("fifoManifestRoll:");
+		goto RETURN;
+	}
+	if ( oldgen >= m.first && oldgen <= m.last ) {
+		if ( manifestReadRecord(fd, &m, oldgen, &osize, &created, &closed) < 0 ) {
+			osize = 0;
+			created = 0;
+		}
+		if ( oldgen < m.last && osize > 0 ) m.total -= osize;
+		m.total += size;
+		res = manifestWriteRecord(fd, &m, oldgen, size, created, now);
+		if ( res < 0 ) goto RETURN;
+	}
+	for ( gen = m.last + 1; gen <= newgen; ++gen ) {
+		res = manifestWriteRecord(fd, &m, gen, 0, gen == newgen ? now : 0, gen == newgen ? 0 : now);
+		if ( res < 0 ) goto RETURN;
+	}
+	if ( newgen > m.last ) m.last = newgen;
+	res = manifestWriteHeader(fd, &m);
+RETURN:
+	if ( res < 0 ) err("fifoManifestRoll write:");
+	if ( fd >= 0 ) manifestUnlock(fpa, fd);
+	return res;
+}
 
-	if ( fp->escape[0] == ' ' ) return size;	
+/**
+ * Register removal of all generations before newfirst in the manifest fd,
+ * which the caller has locked by manifestLock for writing.
+ * Compact the records, if too many records of removed generations accumulated.
+ */
+static int fifoManifestCollect(int fd, FifoManifest* pm, unsigned long newfirst) {
+	int res = 0;
+	unsigned long gen;
+	off_t size;
+	time_t created, closed;
+	FifoManifest m = *pm;
+	FifoManifest n;
 
-	for ( i = 0, j = 0; i < size; ++i ) {
-		ch = buffer[i];
-		if ( ch == fp->escape[0] ) {
-			if ( ++i >= size ) {
-				return -1;
+	if ( newfirst > m.last ) newfirst = m.last;
+	for ( gen = m.first; gen < newfirst; ++gen ) {
+		if ( manifestReadRecord(fd, &m, gen, &size, &created, &closed) == 0 ) {
+			m.total -= size;
+		}
+	}
+	if ( newfirst > m.first ) m.first = newfirst;
+	if ( m.first - m.base >= MANCOMPACT ) {
+		n = m;
+		n.base = m.first;
+		for ( gen = m.first; res == 0 && gen <= m.last; ++gen ) {
+			if ( manifestReadRecord(fd, &m, gen, &size, &created, &closed) < 0 ) {
+				size = 0;
+				created = 0;
+				closed = 0;
 			}
-			ch = buffer[i];
-		} else if ( ch == fp->separator[0] ) {
-			*s = i + 1;
-			break;
+			res = manifestWriteRecord(fd, &n, gen, size, created, closed);
 		}
-		buffer[j++] = ch;
+		if ( res == 0 ) res = ftruncate(fd, manifestPos(&n, n.last + 1));
+		m = n;
 	}
-	if ( *s <= 0 ) {
-		return -2;
+	if ( res == 0 ) res = manifestWriteHeader(fd, &m);
+	if ( res < 0 ) err("fifoManifestCollect write:");
+	*pm = m;
+	return res;
+}
+
+/*************************************** RETENTION ****************************/
+/**
+ * Scan a directory for data files and store the lowest and the highest
+ * file number found. If no data file exists, both values are 0.
+ * Return the number of data files found or -1 in case of error.
+ */
+static long fifoScanDirectory(int dirfd, const char* dirname, unsigned long* first, unsigned long* last) {
+
+	DIR* dir = NULL;
+	int fd;
+	unsigned long res;
+	long count = -1;
+	struct dirent* dirent;
+	char *cp;
+
+	*first = 0;
+	*last = 0;
+	fd = openat(dirfd, dirname, O_RDONLY | O_DIRECTORY);
+	if ( fd < 0 ) {
+		goto RETURN;
 	}
-	buffer[j] = '\0';
-	return j;	
+	dir = fdopendir(fd);
+	if ( dir == NULL ) {
+		close(fd);
+		goto RETURN;
+	}
+
+	count = 0;
+	while ( (dirent = readdir(dir)) ) {
+		if ( fifoNamelen(dirent->d_name[0])+1 == strlen(dirent->d_name)) {
+			res = strtoul(dirent->d_name+1, &cp, 10);
+			if ( res == ULONG_MAX ) continue;
+			if ( *cp ) continue;
+			if ( count == 0 || res < *first ) *first = res;
+			if ( count == 0 || res > *last ) *last = res;
+			count++;
+		}
+	}
+
+RETURN:
+	if ( dir ) closedir(dir);
+	return count;
 }
 
-static int poffset( char* rbuffer, unsigned long curr, off_t o1, off_t o2 ) {
-	return sprintf(rbuffer, "%lu %ld %ld %d\n", (long)curr, (long)o1, (long)o2, (int)getpid());
+/**
+ * Scan the queue directory for data files and store the lowest and the highest
+ * file number found. If no data file exists, both values are 0.
+ * In sharded layout only the subdirectories containing the lowest and the
+ * highest file numbers are scanned.
+ * Return the number of data files found in the scanned directories or -1.
+ */
+static long fifoScanGenerations(const FifoParameters* fpa, unsigned long* first, unsigned long* last) {
+
+	DIR* dir = NULL;
+	int fd;
+	long count = -1;
+	long c;
+	unsigned long res;
+	unsigned long smin = 0;
+	unsigned long smax = 0;
+	unsigned long shard;
+	unsigned long f, l;
+	int nshards = 0;
+	struct dirent* dirent;
+	char* cp;
+	char name[FIFONAMELEN];
+	const size_t plen = strlen(SHARDPREFIX);
+
+	*first = 0;
+	*last = 0;
+	if ( fpa->shardSize == 0 ) {
+		count = fifoScanDirectory(fpa->dirfd, ".", first, last);
+		if ( count < 0 ) {
+			errpath("fifoScanGenerations opendir:", fpa->pathName);
+		}
+		return count;
+	}
+
+	fd = openat(fpa->dirfd, ".", O_RDONLY | O_DIRECTORY);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if ( dir == NULL ) {
+		errpath("fifoScanGenerations opendir:", fpa->pathName);
+		if ( fd >= 0 ) close(fd);
+		goto RETURN;
+	}
+	while ( (dirent = readdir(dir)) ) {
+		if ( strncmp(dirent->d_name, SHARDPREFIX, plen) != 0 ) continue;
+		res = strtoul(dirent->d_name+plen, &cp, 10);
+		if ( cp == dirent->d_name+plen || *cp ) continue;
+		if ( nshards == 0 || res < smin ) smin = res;
+		if ( nshards == 0 || res > smax ) smax = res;
+		nshards++;
+	}
+
+	count = 0;
+	for ( shard = smin; nshards > 0 && shard <= smax; ++shard ) {
+		sprintf(name, "%s%lu", SHARDPREFIX, shard);
+		c = fifoScanDirectory(fpa->dirfd, name, &f, &l);
+		if ( c > 0 ) {
+			*first = f;
+			*last = l;
+			count = c;
+			break;
+		}
+	}
+	for ( shard = smax; count > 0 && shard > smin; --shard ) {
+		sprintf(name, "%s%lu", SHARDPREFIX, shard);
+		c = fifoScanDirectory(fpa->dirfd, name, &f, &l);
+		if ( c > 0 ) {
+			*last = l;
+			count += c;
+			break;
+		}
+	}
+RETURN:
+	if ( dir ) closedir(dir);
+	return count;
 }
 
-static int readoffset(int fdadm, unsigned long* curr, off_t* o1, off_t* o2 ) {
-	char rbuffer[50];
-	ssize_t rres;
+/**
+ * Write retention policy file.
+ * Format: <maxAge><Blank><maxBytes><Blank><archive directory or '-'>
+ */
+static int fifoWriteRetention(const FifoParameters* fpa) {
+	int fd = -1;
 	int res = -1;
-	off_t sres;
+	int lres = -1;
+	int fres = -1;
+	char buffer[_POSIX_PATH_MAX+50];
+	ssize_t wres;
 
-	*curr = 0;
-	*o1 = 0;
-	*o2 = 0;
-	sres = lseek(fdadm, 0, SEEK_SET);
-	if ( sres < 0 ) goto RETURN;
-	rres = read(fdadm, rbuffer, sizeof(rbuffer));
-	if ( rres < 0 ) goto RETURN;
-	rbuffer[rres] = '\0';
-	res = rres;
-	sscanf( rbuffer, "%lu%ld%ld", curr, o1, o2);
+	if ( fpa->archive && strlen(fpa->archive) > _POSIX_PATH_MAX ) {
+		errno = ENAMETOOLONG;
+		err("fifoWriteRetention archive name:");
+		goto RETURN;
+	}
+
+	fd = openat(fpa->dirfd, RETAINFILE, O_WRONLY | O_CREAT, 0666);
+	if ( fd < 0 ) {
+		errpath("fifoWriteRetention openw:", RETAINFILE);
+		goto RETURN;
+	}
+
+	lres = lwlock(&fpa->locks->wadm);
+	fres = takewritelock(fd);
+	if ( lres < 0 || fres < 0 ) {
+		err("fifoWriteRetention:");
+		goto RETURN;
+	}
+	sprintf(buffer, "%ld %ld %s\n", fpa->maxAge, (long)fpa->maxBytes,
+		fpa->archive ? fpa->archive : "-");
+	if ( ftruncate(fd, 0) < 0 ) {
+		err("fifoWriteRetention truncate:");
+		goto RETURN;
+	}
+	wres = write(fd, buffer, strlen(buffer));
+	if ( wres < 0 ) {
+		err("fifoWriteRetention write:");
+		goto RETURN;
+	}
+	res = 0;
 RETURN:
+	if ( fres >= 0 ) releaselock(fd);
+	if ( lres >= 0 ) lulock(&fpa->locks->wadm);
+	if ( fd >= 0 ) close(fd);
 	return res;
 }
 
-static int printoffset(int fdadm, unsigned long curr, off_t o1, off_t o2, size_t lastsize) {
-	ssize_t wres;
-	off_t sres;
-	char rbuffer[90];
+/**
+ * Read retention policy file, if it exists.
+ * Set retain flag in parameters if a policy was found.
+ */
+static int fifoReadRetention(FifoParameters* fpa) {
+	int fd = -1;
 	int res = -1;
-	size_t size;
+	int lres = -1;
+	int fres = -1;
+	int n = 0;
+	long maxage = 0;
+	long maxbytes = 0;
+	char buffer[_POSIX_PATH_MAX+50];
+	ssize_t rres;
 
-	poffset(rbuffer, curr, o1, o2);
-	size = strlen(rbuffer);
+	fd = openat(fpa->dirfd, RETAINFILE, O_RDONLY);
+	if ( fd < 0 && errno == ENOENT ) {
+		/* no retention policy */
+		res = 0;
+		goto RETURN;
+	}
+	if ( fd < 0 ) {
+		errpath("fifoReadRetention open:", RETAINFILE);
+		goto RETURN;
+	}
 
-	if ( size < lastsize ) {
-		if ( ftruncate(fdadm, 0 ) < 0 ) {
+	lres = lrlock(&fpa->locks->wadm);
+	fres = takereadlock(fd);
+	if ( lres < 0 || fres < 0 ) {
+		err("fifoReadRetention:");
+		goto RETURN;
+	}
+	rres = read(fd, buffer, sizeof(buffer)-1);
+	if ( rres < 0 ) {
+		err("fifoReadRetention read:");
+		goto RETURN;
+	}
+	buffer[rres] = '\0';
+	if ( sscanf(buffer, "%ld %ld %n", &maxage, &maxbytes, &n) < 2 || n == 0 ) {
+		errno = EINVAL;
+		err("fifoReadRetention invalid contents");
+		goto RETURN;
+	}
+	buffer[strcspn(buffer, "\n")] = '\0';
+	if ( strcmp(buffer+n, "-") != 0 && buffer[n] != '\0' ) {
+		fpa->archive = (char*) malloc(strlen(buffer+n) + 1);
+		if ( fpa->archive == NULL ) {
+			err("fifoReadRetention malloc:");
 			goto RETURN;
 		}
+		strcpy(fpa->archive, buffer+n);
 	}
-	sres = lseek(fdadm, 0, SEEK_SET);
-	if ( sres < 0 ) goto RETURN;
-	wres = write(fdadm, rbuffer, strlen(rbuffer));
-	if ( wres < 0 ) goto RETURN;
+	fpa->maxAge = maxage;
+	fpa->maxBytes = maxbytes;
+	fpa->retain = 1;
 	res = 0;
 RETURN:
+	if ( fres >= 0 ) releaselock(fd);
+	if ( lres >= 0 ) lulock(&fpa->locks->wadm);
+	if ( fd >= 0 ) close(fd);
 	return res;
 }
 
-static ssize_t readlocked(FifoDescriptor* frd, char* buffer, size_t size) {
+/**
+ * Read the file number from a read- or write pointer file.
+ * If wait is 0, do not wait for locks held by others (errno EAGAIN).
+ * If advance is greater than the file number found, store advance as new
+ * file number with positions 0 and logical offset base, if not NULL.
+ * Return 0 if o.k., 1 if the pointer file does not exist, -1 in case of error.
+ */
+static int fifoPeekPointer(int dirfd, const char* pname, unsigned long* current,
+							unsigned long advance, const uint64_t* base, int wait) {
+	int fd = -1;
+	int res = -1;
+	int fres = -1;
+	int type = advance > 0 ? F_WRLCK : F_RDLCK;
+	off_t o1, o2;
+	uint64_t b, m;
 
-	ssize_t wres = -1;
-	ssize_t fres = -1;
-	off_t sres;
+	fd = openat(dirfd, pname, advance > 0 ? O_RDWR : O_RDONLY);
+	if ( fd < 0 && errno == ENOENT ) {
+		res = 1;
+		goto RETURN;
+	}
+	if ( fd < 0 ) {
+		errpath("fifoPeekPointer open:", pname);
+		goto RETURN;
+	}
+	fres = wait ? dolock(fd, type) : trylock(fd, type);
+	if ( fres < 0 ) {
+		errpath("fifoPeekPointer lock:", pname);
+		goto RETURN;
+	}
+	res = readoffset(fd, current, &o1, &o2, &b, &m);
+	if ( res < 0 ) {
+		err("fifoPeekPointer read:");
+		goto RETURN;
+	}
+	if ( *current < advance ) {
+		res = printoffset(fd, advance, 0, 0, base ? *base : b, m, res);
+		if ( res < 0 ) {
+			err("fifoPeekPointer write:");
+			goto RETURN;
+		}
+		*current = advance;
+	}
+	res = 0;
+RETURN:
+	if ( fres >= 0 ) releaselock(fd);
+	if ( fd >= 0 ) close(fd);
+	return res;
+}
+
+/**
+ * Scan all read pointer files of the queue and find the minimum file number.
+ * Read pointers lagging behind advance are moved to the start of generation advance.
+ * Return number of read pointers or -1 in case of error.
+ */
+static long fifoScanReadPointers(const FifoParameters* fpa, unsigned long* rmin,
+									unsigned long advance, int wait) {
+	DIR* dir;
+	int fd;
+	long count = -1;
 	int res;
-	int fd = frd->fd;
-	int fdadm = frd->fdp;
-	FifoParameters *fp = frd->parameters;
-	FifoFilePointer *frp = frd->filePointer;
+	int lres = -1;
+	unsigned long current;
+	uint64_t base;
+	int known = 0;
+	struct dirent* dirent;
 
-	res = takewritelock(fdadm);
-	if ( res < 0 ) goto RETURN;
-	res = takereadlock(fd);
-	if ( res < 0 ) goto RETURN;
-	res = fifoReadFilePointer(frd);
-	if ( res < 0 ) goto RETURN;
-	if ( frp->current != frd->current ) {
-		/* re-open fd with other file */
-		res = fifoReOpenRead(frd);
-		if ( res < 0 && errno == ENOENT ) {
-			err(NULL);
-			errno = EAGAIN;
+	*rmin = 0;
+	if ( advance > 0 ) {
+		known = fifoGenerationBase(fpa, advance, &base) == 0;
+	}
+	fd = openat(fpa->dirfd, ".", O_RDONLY | O_DIRECTORY);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if ( dir == NULL ) {
+		errpath("fifoScanReadPointers opendir:", fpa->pathName);
+		if ( fd >= 0 ) close(fd);
+		goto RETURN;
+	}
+
+	lres = advance > 0 ? lwlock(&fpa->locks->radm) : lrlock(&fpa->locks->radm);
+	if ( lres < 0 ) {
+		err("fifoScanReadPointers:");
+		goto RETURN;
+	}
+	count = 0;
+	while ( (dirent = readdir(dir)) ) {
+		if ( strncmp(dirent->d_name, RPPREFIX, strlen(RPPREFIX)) != 0 ) continue;
+		res = fifoPeekPointer(fpa->dirfd, dirent->d_name, &current, advance, known ? &base : NULL, wait);
+		if ( res > 0 ) continue;
+		if ( res < 0 ) {
+			count = -1;
+			goto RETURN;
+		}
+		if ( count == 0 || current < *rmin ) *rmin = current;
+		count++;
+	}
+
+RETURN:
+	if ( lres >= 0 ) lulock(&fpa->locks->radm);
+	if ( dir ) closedir(dir);
+	return count;
+}
+
+/**
+ * Remove data file generation or move it into the archive directory.
+ * Return 1 if the file was removed, 0 if it did not exist, -1 on error.
+ */
+static int fifoRemoveGeneration(const FifoParameters* fpa, unsigned long gen, int archfd) {
+	int res = -1;
+	char name[FIFONAMELEN];
+	char aname[FIFONAMELEN];
+
+	fifoCurrentFilename(fpa, gen, name);
+	if ( archfd >= 0 ) {
+		/* archive directory has flat layout */
+		fifoFilename(gen, aname);
+		res = renameat(fpa->dirfd, name, archfd, aname);
+	} else {
+		res = unlinkat(fpa->dirfd, name, 0);
+	}
+	if ( res < 0 && errno == ENOENT ) {
+		res = 0;
+		goto RETURN;
+	}
+	if ( res < 0 ) {
+		errpath("fifoRemoveGeneration:", name);
+		goto RETURN;
+	}
+	if ( fpa->shardSize > 0 && (gen + 1) % fpa->shardSize == 0 ) {
+		/* last generation of subdirectory */
+		*strrchr(name, '/') = '\0';
+		unlinkat(fpa->dirfd, name, AT_REMOVEDIR);
+	}
+	res = 1;
+RETURN:
+	return res;
+}
+
+/**
+ * Remove data files, which are no longer needed.
+ * All generations older than the current generation of every read pointer
+ * are released and are removed (or moved to the archive directory).
+ * If no read pointer exists, no generation is considered released.
+ * Additionally, generations older than maxAge seconds (modification time) or
+ * exceeding the total size maxBytes are removed, even if not yet released.
+ * Read pointers referring to those generations are advanced to the oldest
+ * remaining generation. The current generation of the writer is never removed.
+ * Data file locks are not taken, so writers are not blocked.
+ * If wait is 0, give up (errno EAGAIN) instead of waiting for pointer locks.
+ * Return the number of removed generations or -1 in case of error.
+ */
+static long collect(const FifoParameters* fpa, int wait) {
+
+	long count = -1;
+	long nrp;
+	int res;
+	int lres = -1;
+	int fdm = -1;
+	int archfd = -1;
+	unsigned long gen;
+	unsigned long wcur = 0;
+	unsigned long rmin = 0;
+	unsigned long amin;
+	unsigned long newfirst;
+	off_t total;
+	off_t size;
+	time_t now;
+	time_t created, closed;
+	struct stat st;
+	char name[FIFONAMELEN];
+	FifoManifest m;
+
+	lres = lrlock(&fpa->locks->wadm);
+	if ( lres < 0 ) {
+		err("collect:");
+		goto RETURN;
+	}
+	res = fifoPeekPointer(fpa->dirfd, WPFILE, &wcur, 0, NULL, wait);
+	lulock(&fpa->locks->wadm);
+	if ( res != 0 ) {
+		/* nothing written yet or error */
+		count = res > 0 ? 0 : -1;
+		goto RETURN;
+	}
+
+	nrp = fifoScanReadPointers(fpa, &rmin, 0, wait);
+	if ( nrp < 0 ) {
+		err("collect:");
+		goto RETURN;
+	}
+
+	fdm = manifestLock(fpa, F_RDLCK, &m);
+	if ( fdm < 0 ) {
+		err("collect:");
+		goto RETURN;
+	}
+	if ( nrp == 0 || rmin < m.first ) rmin = m.first;
+	if ( rmin > wcur ) rmin = wcur;
+	newfirst = rmin;
+
+	if ( fpa->maxAge > 0 || fpa->maxBytes > 0 ) {
+		total = m.total;
+		fifoCurrentFilename(fpa, m.last, name);
+		if ( fstatat(fpa->dirfd, name, &st, 0) == 0 ) total += st.st_size;
+		now = time(NULL);
+		for ( gen = m.first; gen < wcur; ++gen ) {
+			res = manifestReadRecord(fdm, &m, gen, &size, &created, &closed);
+			if ( res < 0 || closed == 0 ) {
+				fifoCurrentFilename(fpa, gen, name);
+				res = fstatat(fpa->dirfd, name, &st, 0);
+				if ( res < 0 ) continue;
+				size = st.st_size;
+				closed = st.st_mtime;
+			}
+			if ( gen >= newfirst ) {
+				if ( !( fpa->maxAge > 0 && closed + fpa->maxAge < now ) &&
+					!( fpa->maxBytes > 0 && total > fpa->maxBytes ) ) {
+					break;
+				}
+				newfirst = gen + 1;
+			}
+			total -= size;
+		}
+	}
+	manifestUnlock(fpa, fdm);
+	fdm = -1;
+
+	if ( newfirst > rmin && nrp > 0 ) {
+		/* retention limits exceeded: move lagging readers forward */
+		if ( fifoScanReadPointers(fpa, &amin, newfirst, wait) < 0 ) {
+			err("collect advance read pointers:");
+			newfirst = rmin;
+		}
+	}
+
+	if ( fpa->archive && newfirst > m.first ) {
+		archfd = open(fpa->archive, O_RDONLY | O_DIRECTORY);
+		if ( archfd < 0 ) {
+			errpath("collect open archive:", fpa->archive);
+			goto RETURN;
+		}
+	}
+	count = 0;
+	if ( newfirst > m.first ) {
+		/* readers opening meanwhile wait, so none opens a generation removed */
+		fdm = manifestLock(fpa, F_WRLCK, &m);
+		if ( fdm < 0 ) {
+			err("collect:");
+			count = -1;
 			goto RETURN;
 		}
+		for ( gen = m.first; gen < newfirst; ++gen ) {
+			res = fifoRemoveGeneration(fpa, gen, archfd);
+			if ( res < 0 ) {
+				err("collect:");
+				newfirst = gen;
+				break;
+			}
+			count += res;
+		}
+		if ( newfirst > m.first ) {
+			fifoManifestCollect(fdm, &m, newfirst);
+		}
+	}
+RETURN:
+	if ( fdm >= 0 ) manifestUnlock(fpa, fdm);
+	if ( archfd >= 0 ) close(archfd);
+	return count;
+}
+
+/*************************************** LAG **********************************/
+/**
+ * Consumer lag is the difference of two logical offsets, counted in bytes from
+ * the creation of the queue, and of two message counts. The write pointer
+ * dir/.wp holds the offset of the start of the current generation and the
+ * messages written before it, the shared header the commit position and the
+ * messages written since. Each read pointer holds the offset of the start of
+ * its generation and the messages released. Readers moved forward by retention
+ * keep their message count, so the messages removed unread stay in the lag.
+ */
+
+/**
+ * Find the logical offset of the start of generation gen from the write pointer
+ * and the sizes of the later generations in the manifest.
+ * The write pointer is read without lock. Return -1, if the offset is not known.
+ */
+static int fifoGenerationBase(const FifoParameters* fpa, unsigned long gen, uint64_t* base) {
+	int fd;
+	int res = -1;
+	unsigned long current;
+	unsigned long g;
+	off_t o1, o2;
+	off_t size;
+	time_t created, closed;
+	uint64_t wbase, messages;
+	uint64_t sum = 0;
+	FifoManifest m;
+
+	fd = fifoWpOpen(fpa);
+	if ( fd < 0 ) goto RETURN;
+	res = readoffset(fd, &current, &o1, &o2, &wbase, &messages);
+	fifoWpRelease(fd);
+	if ( res <= 0 || current < gen ) {
+		res = -1;
+		goto RETURN;
+	}
+	fd = manifestLock(fpa, F_RDLCK, &m);
+	if ( fd < 0 ) {
+		res = -1;
+		goto RETURN;
+	}
+	for ( g = gen; g < current && res >= 0; ++g ) {
+		res = manifestReadRecord(fd, &m, g, &size, &created, &closed);
+		sum += size;
+	}
+	manifestUnlock(fpa, fd);
+	if ( res < 0 || sum > wbase ) {
+		res = -1;
+		goto RETURN;
+	}
+	*base = wbase - sum;
+	res = 0;
+RETURN:
+	err(NULL);
+	return res;
+}
+
+/**
+ * Add the lag of the read pointer file fd, or pname if fd < 0, to lag.
+ * The write pointer is read first under its lock, so it matches the commit word
+ * of the header, then the read pointer under its lock; a lag below 0 is taken as 0.
+ * Return 1, if the read pointer pname does not exist.
+ */
+static int lagof(const FifoParameters* fpa, int fd, const char* pname, FifoLag* lag) {
+	int res = -1;
+	int lres = -1;
+	int fres = -1;
+	int fdw = -1;
+	int fdr = -1;
+	unsigned long current;
+	off_t o1, o2;
+	off_t pos = 0;
+	uint64_t base, messages;
+	uint64_t w;
+	uint64_t written = 0;
+	uint64_t wmessages = 0;
+	FifoTail* t = fpa->tail;
+	char name[FIFONAMELEN];
+	struct stat st;
+
+	fdw = openat(fpa->dirfd, WPFILE, O_RDONLY);
+	if ( fdw < 0 && errno != ENOENT ) {
+		errpath("lagof open:", WPFILE);
+		goto RETURN;
+	}
+	if ( fdw >= 0 ) {
+		lres = lrlock(&fpa->locks->wadm);
+		fres = dolock(fdw, F_RDLCK);
+		res = lres < 0 || fres < 0 ? -1 : readoffset(fdw, &current, &o1, &o2, &written, &wmessages);
+		w = t ? atomic_load(&t->commit) : 0;
+		if ( fres >= 0 ) releaselock(fdw);
+		close(fdw);
+		if ( lres >= 0 ) lulock(&fpa->locks->wadm);
 		if ( res < 0 ) {
-			err("fifoRead:");
+			errpath("lagof:", WPFILE);
 			goto RETURN;
 		}
+		if ( t && atomic_load(&t->magic) == TAILMAGIC && TAILSAME(w, current) ) {
+			pos = TAILPOS(w);
+			wmessages = atomic_load(&t->messages);
+		} else {
+			/* no writer since the header was lost */
+			fifoCurrentFilename(fpa, current, name);
+			if ( fstatat(fpa->dirfd, name, &st, 0) == 0 ) pos = st.st_size;
+		}
+		written += pos;
 	}
-	if ( frp->readPos > frp->releasePos ) {
-		err("fifoRead: must first call release:");
-		wres = -1; 
-		goto RETURN;	/* must first call release */
+
+	lres = lrlock(&fpa->locks->radm);
+	if ( pname && lres >= 0 ) {
+		/* closing drops the classic record locks of the process: close under radm */
+		fdr = openat(fpa->dirfd, pname, O_RDONLY);
+		if ( fdr < 0 && errno == ENOENT ) {
+			lulock(&fpa->locks->radm);
+			res = 1;
+			goto RETURN;
+		}
+		fd = fdr;
+	}
+	fres = fd < 0 ? -1 : takereadlock(fd);
+	res = lres < 0 || fres < 0 ? -1 : readoffset(fd, &current, &o1, &o2, &base, &messages);
+	if ( fres >= 0 ) releaselock(fd);
+	if ( fdr >= 0 ) close(fdr);
+	if ( lres >= 0 ) lulock(&fpa->locks->radm);
+	if ( res < 0 ) {
+		if ( pname ) {
+			errpath("lagof:", pname);
+		} else {
+			err("lagof:");
+		}
+		goto RETURN;
 	}
+	base += o2;
+	lag->written += written;
+	lag->writtenMessages += wmessages;
+	lag->released += base;
+	lag->releasedMessages += messages;
+	lag->bytes += written > base ? written - base : 0;
+	lag->messages += wmessages > messages ? wmessages - messages : 0;
+	res = 0;
+RETURN:
+	return res;
+}
 
-	sres = lseek(fd, frp->readPos, SEEK_SET);
-	if ( sres < 0 ) {
-		err("fifoRead lseek:");
-		wres = -1;
+/**
+ * Add the lag of the read pointers of the queue or of its partitions and
+ * lanes to the entries of lags with the same name, the first count of which
+ * are filled. Return the number of entries filled or -1 in case of error.
+ */
+static long laglist(const char* dirname, FifoLag* lags, long max, long count) {
+	DIR* dir = NULL;
+	int fd = -1;
+	int res;
+	int i, n;
+	long k;
+	char* path;
+	const char* reader;
+	struct dirent* dirent;
+	FifoParameters fpa;
+
+	fpa.pathName = (char*) dirname;
+	if ( fifoOpenDirectory(&fpa, dirname) < 0 ) {
+		err("fifoLagList:");
+		count = -1;
 		goto RETURN;
 	}
-	fres = read(fd, buffer, size);
-	if ( fres < 0 ) {
-		err("fifoRead read:");
+	n = fifoReadCount(&fpa, PARTFILE);
+	for ( i = 0; i < n && count >= 0; ++i ) {
+		/* partitioned queue: add up the partitions */
+		path = fifoSubqueuePath(dirname, PARTPREFIX, i);
+		count = path ? laglist(path, lags, max, count) : -1;
+		free(path);
+	}
+	if ( n != 0 ) {
+		if ( n < 0 ) count = -1;
 		goto RETURN;
 	}
-	if ( fres == 0 ) {
-		errno = EAGAIN;
+	if ( fifoMapTail(&fpa) < 0 ) {
+		err("fifoLagList:");
+		count = -1;
 		goto RETURN;
 	}
 
-	if (memcmp(buffer, fp->rollmark, strlen(fp->rollmark)) == 0) {
-		frd->filePointer->roll = 1;
-	}	
-
-	wres = fifoFormatReadBuffer(fp, buffer, &fres);
-	if ( wres < 0 ) {
+	fd = openat(fpa.dirfd, ".", O_RDONLY | O_DIRECTORY);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if ( dir == NULL ) {
+		errpath("fifoLagList opendir:", dirname);
+		if ( fd >= 0 ) close(fd);
+		count = -1;
 		goto RETURN;
 	}
+	while ( (dirent = readdir(dir)) ) {
+		if ( strncmp(dirent->d_name, RPPREFIX, strlen(RPPREFIX)) != 0 ) continue;
+		reader = dirent->d_name + strlen(RPPREFIX);
+		for ( k = 0; k < count && strcmp(lags[k].reader, reader) != 0; ++k ) ;
+		if ( k == count ) {
+			if ( count >= max ) continue;
+			memset(&lags[k], 0, sizeof(lags[k]));
+			snprintf(lags[k].reader, sizeof(lags[k].reader), "%s", reader);
+			count++;
+		}
+		res = lagof(&fpa, -1, dirent->d_name, &lags[k]);
+		if ( res < 0 ) {
+			errpath("fifoLagList:", dirent->d_name);
+			count = -1;
+			goto RETURN;
+		}
+	}
 
-	frp->readPos += fres;
+	n = fifoReadCount(&fpa, LANEFILE);
+	for ( i = 1; i < n && count >= 0; ++i ) {
+		/* priority lanes have read pointers of the same names */
+		path = fifoSubqueuePath(dirname, LANEPREFIX, i);
+		count = path ? laglist(path, lags, max, count) : -1;
+		free(path);
+	}
 RETURN:
-	releaselock(fd);
+	if ( dir ) closedir(dir);
+	fifoCloseDirectory(&fpa);
+	return count;
+}
 
-	if ( wres >= 0 ) {
-		fifoWriteFilePointer(frd);
-	} else {
-		releaselock(fdadm);
+/*************************************** STATISTICS ***************************/
+#ifdef FIFO_STATS
+static uint64_t fifoStatsNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Make the slot odd before changing it, so readers of the segment retry.
+ */
+static void fifoStatsBegin(FifoStatsSlot* s) {
+	atomic_store_explicit(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1,
+			memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void fifoStatsEnd(FifoStatsSlot* s) {
+	atomic_store_explicit(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1,
+			memory_order_release);
+}
+
+/**
+ * Add to a word of the statistics. Only the thread using the descriptor
+ * writes, so no atomic read-modify-write is needed.
+ */
+static void fifoStatsAdd(FifoStatsBlock* s, size_t word, uint64_t v) {
+	_Atomic uint64_t* w;
+
+	if ( s == NULL ) return;
+	w = &s->slot->word[word];
+	fifoStatsBegin(s->slot);
+	atomic_store_explicit(w, atomic_load_explicit(w, memory_order_relaxed) + v, memory_order_relaxed);
+	fifoStatsEnd(s->slot);
+}
+
+/**
+ * Record the time since t0 in the histogram of the timer.
+ */
+static void fifoStatsTime(FifoStatsBlock* s, FifoTimer timer, uint64_t t0) {
+	uint64_t t;
+	_Atomic uint64_t* h;
+	int i;
+
+	if ( s == NULL ) return;
+	t = fifoStatsNow() - t0;
+	h = &s->slot->word[STATSWORD(time) + timer * STATSHIST];
+	for ( i = 0; i < FIFOBUCKETS - 1 && (t >> i) != 0; ++i ) ;
+	fifoStatsBegin(s->slot);
+	atomic_store_explicit(&h[0], atomic_load_explicit(&h[0], memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_store_explicit(&h[1], atomic_load_explicit(&h[1], memory_order_relaxed) + t, memory_order_relaxed);
+	if ( t > atomic_load_explicit(&h[2], memory_order_relaxed) ) {
+		atomic_store_explicit(&h[2], t, memory_order_relaxed);
 	}
-	return wres;
+	atomic_store_explicit(&h[3+i], atomic_load_explicit(&h[3+i], memory_order_relaxed) + 1, memory_order_relaxed);
+	fifoStatsEnd(s->slot);
 }
 
-static ssize_t release(FifoDescriptor* frd) {
+/**
+ * Add the words of statistics to sum, taking the maximum of the max words.
+ */
+static void fifoStatsMerge(uint64_t* sum, const _Atomic uint64_t* word) {
+	size_t i;
+	uint64_t v;
 
-	ssize_t wres = -1;
-	int res;
-	int fdadm = frd->fdp;
-	FifoFilePointer* frp = frd->filePointer;
-	off_t releasepos = frd->filePointer->releasePos;
-	off_t readpos = frd->filePointer->readPos;
-	int roll = frd->filePointer->roll;
+	for ( i = 0; i < STATSWORDS; ++i ) {
+		v = atomic_load_explicit(&word[i], memory_order_relaxed);
+		if ( i >= STATSWORD(time) && (i - STATSWORD(time)) % STATSHIST == 2 ) {
+			if ( v > sum[i] ) sum[i] = v;
+		} else {
+			sum[i] += v;
+		}
+	}
+}
 
-	res = fifoReadFilePointer(frd);
-	if ( res < 0 ) goto RETURN;
-	if ( releasepos != frp->releasePos || readpos != frp->readPos ) {
-		wres = -1;
+/**
+ * Map the statistics segment dir/.stats. Create it, if missing.
+ * Return NULL, if it is not available or of another layout.
+ */
+static FifoStatsSegment* fifoStatsMap(const FifoParameters* fpa) {
+	int fd;
+	struct stat st;
+	uint64_t magic = 0;
+	void* p = MAP_FAILED;
+
+	fd = openat(fpa->dirfd, STATSFILE, O_RDWR | O_CREAT, 0666);
+	if ( fd < 0 ) goto RETURN;
+	if ( fstat(fd, &st) < 0 ) goto RETURN;
+	if ( st.st_size < (off_t) sizeof(FifoStatsSegment) && ftruncate(fd, sizeof(FifoStatsSegment)) < 0 ) {
 		goto RETURN;
 	}
-	frp->current = frd->current;
-	frp->releasePos = frp->readPos;
-	if ( roll || frp->readPos > frd->parameters->switchSize ) {
-		frp->current += 1;
-		frp->releasePos = 0;
-		frp->readPos = 0;
+	p = mmap(NULL, sizeof(FifoStatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( p == MAP_FAILED ) goto RETURN;
+	if ( !atomic_compare_exchange_strong(&((FifoStatsSegment*) p)->magic, &magic, STATSMAGIC) &&
+			magic != STATSMAGIC ) {
+		munmap(p, sizeof(FifoStatsSegment));
+		p = MAP_FAILED;
 	}
-	fifoWriteFilePointer(frd);
 RETURN:
-	releaselock(fdadm);
-	return wres;
+	if ( fd >= 0 ) close(fd);
+	return p == MAP_FAILED ? NULL : (FifoStatsSegment*) p;
 }
+#endif
 
-ssize_t fifoReadW(FifoDescriptor *frd, void* buffer, size_t size, long wtim, long maxtime) {
-	ssize_t rres = -1;
-	struct timespec interval;
-	long cumtime = 0;
+/**
+ * Check, if the process owning a slot is alive.
+ */
+static int fifoStatsAlive(uint64_t owner) {
+	return kill((pid_t) (owner & 0xffffffff), 0) == 0 || errno == EPERM;
+}
 
-	interval.tv_sec = wtim / 1000;
-	interval.tv_nsec = (wtim * 1000000) % 1000000000;
-	
-	while ( cumtime <= maxtime ) {
-		rres = readlocked(frd, buffer, size);
-		if ( rres < 0 && errno == EAGAIN ) {
-			nanosleep(&interval, NULL);
-		} else if ( frd->filePointer->roll == 1 ) {
-			release(frd);
-		} else {		
+/**
+ * Create the statistics of a descriptor, register them with its queue and
+ * take a free slot of the statistics segment of the queue, or one left by
+ * a dead process. If no slot is free, the statistics are kept locally.
+ * Without memory, the descriptor runs without statistics.
+ */
+static void fifoStatsOpen(FifoDescriptor* fp, char role, const char* readpf) {
+#ifdef FIFO_STATS
+	int serrno = errno;
+	int i;
+	struct stat st;
+	uint64_t me, owner;
+	FifoStatsSegment* seg;
+	FifoStatsQueue* q;
+	FifoStatsBlock* s;
+
+	if ( fstat(fp->parameters->dirfd, &st) < 0 ) return;
+	s = (FifoStatsBlock*) calloc(1, sizeof(*s));
+	if ( s == NULL ) return;
+	seg = fifoStatsMap(fp->parameters);
+	while ( atomic_flag_test_and_set(&statsRegistry) ) sched_yield();
+	for ( q = statsList; q != NULL; q = q->next ) {
+		if ( q->dev == st.st_dev && q->ino == st.st_ino ) break;
+	}
+	if ( q == NULL && (q = (FifoStatsQueue*) calloc(1, sizeof(*q))) != NULL ) {
+		q->dev = st.st_dev;
+		q->ino = st.st_ino;
+		q->next = statsList;
+		statsList = q;
+	}
+	if ( q != NULL && q->segment == NULL ) {
+		q->segment = seg;
+		seg = NULL;
+	}
+	if ( q != NULL ) {
+		q->refs++;
+		s->queue = q;
+		s->next = q->blocks;
+		q->blocks = s;
+		fp->stats = s;
+	}
+	atomic_flag_clear(&statsRegistry);
+	if ( seg ) munmap(seg, sizeof(*seg));
+	if ( q == NULL ) {
+		free(s);
+		return;
+	}
+
+	s->slot = &s->local;
+	me = (uint64_t) atomic_fetch_add(&statsOpened, 1) << 32 | (uint32_t) getpid();
+	for ( i = 0; q->segment && i < STATSSLOTS; ++i ) {
+		owner = atomic_load(&q->segment->slot[i].owner);
+		if ( owner != 0 && fifoStatsAlive(owner) ) continue;
+		if ( atomic_compare_exchange_strong(&q->segment->slot[i].owner, &owner, me) ) {
+			s->slot = &q->segment->slot[i];
 			break;
 		}
-		cumtime += wtim;
-		rres = -1;
 	}
-	return rres;
+	fifoStatsBegin(s->slot);
+	s->slot->role = role;
+	memset(s->slot->reader, 0, STATSNAMELEN);
+	if ( readpf ) strncpy(s->slot->reader, readpf, STATSNAMELEN - 1);
+	for ( i = 0; i < (int) STATSWORDS; ++i ) {
+		atomic_store_explicit(&s->slot->word[i], 0, memory_order_relaxed);
+	}
+	fifoStatsEnd(s->slot);
+	errno = serrno;
+#else
+	(void) role;
+	(void) readpf;
+	fp->stats = NULL;
+#endif
 }
 
-static int fifoReOpenRead(FifoDescriptor* frd) {
+/**
+ * Add the statistics of a closed descriptor to its queue and free its slot.
+ * The statistics of a queue are kept, while the process runs.
+ */
+static void fifoStatsClose(FifoDescriptor* fp) {
+#ifdef FIFO_STATS
+	FifoStatsBlock** ps;
+	FifoStatsBlock* s = fp->stats;
+	FifoStatsQueue* q;
+	FifoStatsSegment* seg = NULL;
 
-	char* name;
+	if ( s == NULL ) return;
+	q = s->queue;
+	while ( atomic_flag_test_and_set(&statsRegistry) ) sched_yield();
+	for ( ps = &q->blocks; *ps != s; ps = &(*ps)->next ) ;
+	*ps = s->next;
+	fifoStatsMerge(q->closed, s->slot->word);
+	if ( s->slot != &s->local ) atomic_store(&s->slot->owner, 0);
+	if ( --q->refs == 0 ) {
+		seg = q->segment;
+		q->segment = NULL;
+	}
+	atomic_flag_clear(&statsRegistry);
+	if ( seg ) munmap(seg, sizeof(*seg));
+	free(s);
+	fp->stats = NULL;
+#else
+	(void) fp;
+#endif
+}
+
+/*************************************** RECOVERY *****************************/
+/**
+ * Register an open writer by a shared lock on dir/.writers. An exclusive
+ * lock is granted only, if no other writer is open; then the tail of the queue
+ * may be recovered and the lock is kept exclusive until fifoWriterShare.
+ * The caller holds the write pointer lock, so writers register one at a time.
+ * With classic record locks, the lock belongs to the process, so it is taken
+ * once for all writers of the process and the file is kept open meanwhile.
+ * Return 1, if no other writer is open, 0 otherwise.
+ */
+static int fifoWriterLock(FifoParameters* fpa) {
+	int fd = -1;
 	int res = -1;
-	int fd2;
+#ifdef FIFO_PTHREAD_LOCKS
+	FifoLocks* l = fpa->locks;
 
-	name = fifoCurrentAbsfilename(frd->parameters->pathName, frd->filePointer->current);
-	if ( name == NULL ) {
-		err("fifoOpenR fifoCurrentAbsfilename:");
+	res = pthread_mutex_lock(&lockRegistry);
+	if ( res != 0 ) {
+		errno = res;
+		err("fifoWriterLock:");
+		return -1;
+	}
+	res = -1;
+	if ( l->writers > 0 ) {
+		l->writers++;
+		fpa->writers = l->wfd;
+		res = 0;
 		goto RETURN;
 	}
-	
-	fd2 = open(name, O_RDONLY);
-	free(name);
-	if ( fd2 < 0 ) {
-		err("fifoReOpenRead open ");
-		err(name);
-		err(":");
+#endif
+	fd = openat(fpa->dirfd, WRITERFILE, O_RDWR | O_CREAT, 0666);
+	if ( fd < 0 ) {
+		errpath("fifoWriterLock open:", WRITERFILE);
 		goto RETURN;
 	}
-	takereadlock(fd2);
-	close(frd->fd);
-	res = dup2(fd2, frd->fd);
-	close(fd2);
-	if ( res != frd->fd ) {
-		err("fifoReOpenRead dup:");
+	res = trylock(fd, F_WRLCK) == 0;
+	if ( !res && errno != EAGAIN ) {
+		errpath("fifoWriterLock lock:", WRITERFILE);
+		res = -1;
 		goto RETURN;
 	}
-	frd->current = frd->filePointer->current;
+	if ( !res && dolock(fd, F_RDLCK) < 0 ) {
+		errpath("fifoWriterLock lock:", WRITERFILE);
+		res = -1;
+		goto RETURN;
+	}
+	fpa->writers = fd;
+	fd = -1;
+#ifdef FIFO_PTHREAD_LOCKS
+	l->writers = 1;
+	l->wfd = fpa->writers;
+	l->recovering = res;
+#endif
 RETURN:
+	if ( fd >= 0 ) close(fd);
+#ifdef FIFO_PTHREAD_LOCKS
+	pthread_mutex_unlock(&lockRegistry);
+#endif
 	return res;
 }
 
-static int fifoOpenFilePointer(FifoDescriptor* frd, const char* readpf) {
-	int namelen;
-	char* name;
-	const char RPPREFIX[] = ".rp_";
-	const char WPPREFIX[] = ".wp";
-	FifoFilePointer* frp;
+/**
+ * Turn the exclusive writer lock taken for the recovery into a shared one.
+ */
+static int fifoWriterShare(FifoParameters* fpa) {
+	int res = dolock(fpa->writers, F_RDLCK);
 
-	if ( frd == NULL ) {
-		err("fifoOpenFilePointer frd == NULL");
-		goto RETURN;
+	if ( res < 0 ) {
+		errpath("fifoWriterShare lock:", WRITERFILE);
 	}
+#ifdef FIFO_PTHREAD_LOCKS
+	pthread_mutex_lock(&lockRegistry);
+	fpa->locks->recovering = 0;
+	pthread_mutex_unlock(&lockRegistry);
+#endif
+	return res;
+}
 
-	frp = frd->filePointer;
-	if ( frp == NULL ) {
-		err("fifoOpenFilePointer frd->filePointer == NULL");
+/**
+ * Join the open writers for a promotion by a reader, without waiting and
+ * without recovering: a shared lock on dir/.writers keeps writers opening
+ * meanwhile from recovering the queue under the promotion.
+ * Return 0, or -1 if a writer recovers the queue or there is none yet.
+ */
+static int fifoWriterJoin(FifoParameters* fpa) {
+	int fd = -1;
+	int res = -1;
+#ifdef FIFO_PTHREAD_LOCKS
+	FifoLocks* l = fpa->locks;
+
+	if ( pthread_mutex_lock(&lockRegistry) != 0 ) return -1;
+	if ( l->recovering ) goto RETURN;
+	if ( l->writers > 0 ) {
+		l->writers++;
+		fpa->writers = l->wfd;
+		res = 0;
 		goto RETURN;
 	}
+#endif
+	fd = openat(fpa->dirfd, WRITERFILE, O_RDONLY);
+	if ( fd < 0 || trylock(fd, F_RDLCK) < 0 ) goto RETURN;
+	fpa->writers = fd;
+	fd = -1;
+	res = 0;
+#ifdef FIFO_PTHREAD_LOCKS
+	l->writers = 1;
+	l->wfd = fpa->writers;
+#endif
+RETURN:
+	if ( fd >= 0 ) close(fd);
+#ifdef FIFO_PTHREAD_LOCKS
+	pthread_mutex_unlock(&lockRegistry);
+#endif
+	return res;
+}
 
-	frp->current = 0;
-	frp->readPos = 0;
-	frp->releasePos = 0;
-	frp->pid = 0;
+/**
+ * Drop the writer lock of a write pointer.
+ */
+static void fifoWriterUnlock(FifoParameters* fpa) {
+	if ( fpa->writers < 0 ) return;
+#ifdef FIFO_PTHREAD_LOCKS
+	pthread_mutex_lock(&lockRegistry);
+	if ( --fpa->locks->writers == 0 ) {
+		close(fpa->locks->wfd);
+		fpa->locks->wfd = -1;
+		fpa->locks->recovering = 0;
+	}
+	pthread_mutex_unlock(&lockRegistry);
+#else
+	close(fpa->writers);
+#endif
+	fpa->writers = -1;
+}
 
-	frd->fdp = -2;
-	namelen = strlen(frd->parameters->pathName) + 2;
-	if ( readpf ) {
-		namelen += strlen(RPPREFIX) + strlen(readpf);
-	} else {
-		namelen += strlen(WPPREFIX);
+/**
+ * Check whether the separator at buffer[i] ends a record: the escape
+ * characters before it, if any, are escaped themselves.
+ * Return -1, if this is unknown, because the escape characters reach the
+ * start of the buffer, which is not the start of the data file.
+ */
+static int recordend(const FifoParameters* fpa, const char* buffer, ssize_t i, int first) {
+	ssize_t k;
+
+	if ( buffer[i] != fpa->separator[0] ) return 0;
+	if ( fpa->escape[0] == ' ' ) return 1;
+	for ( k = i; k > 0 && buffer[k-1] == fpa->escape[0]; --k ) ;
+	if ( k == 0 && !first ) return -1;
+	return (i - k) % 2 == 0;
+}
+
+/**
+ * Recover the current data file after a crash of a writer. Called by the only
+ * open writer, so nothing is reserved, but perhaps not written.
+ * Data beyond the commit watermark of the shared header was never readable,
+ * it is cut off. Without a valid header, only the last RECOVERLEN bytes are
+ * checked: the file is cut behind the last separator, which ends a record,
+ * and before a transaction group, whose commit marker is missing. A data file
+ * of records is cut behind its last complete record. A data file
+ * ending with the roll mark is completed by advancing the write pointer,
+ * read pointers beyond the end are set back to it.
+ * Finally the header is set to the end of the data file.
+ * Return number of bytes cut off.
+ */
+static off_t recover(FifoDescriptor* fwd) {
+	char name[FIFONAMELEN];
+	char* buffer = NULL;
+	int fd = -1;
+	int valid;
+	int first;
+	off_t res = -1;
+	off_t size, end, start, group;
+	ssize_t n, i, j;
+	struct stat st;
+	uint64_t w;
+	FifoParameters* fpa = fwd->parameters;
+	FifoTail* t = fpa->tail;
+	const char esc = fpa->escape[0];
+	const size_t len = strlen(fpa->rollmark);
+
+	fifoCurrentFilename(fpa, fwd->current, name);
+	fd = openat(fpa->dirfd, name, O_RDWR);
+	if ( fd < 0 || fstat(fd, &st) < 0 ) {
+		errpath("recover open:", name);
+		goto RETURN;
 	}
-	name = (char*) malloc(namelen);
-	if ( name == NULL ) {
-		err("fifoOpenFilePointer malloc:");
+	size = st.st_size;
+	end = size;
+	w = atomic_load(&t->commit);
+	valid = atomic_load(&t->magic) == TAILMAGIC && atomic_load(&t->gen) == fwd->current &&
+			TAILSAME(w, fwd->current);
+	if ( valid && TAILPOS(w) < end ) {
+		/* the rest was never readable */
+		end = TAILPOS(w);
+	}
+
+	buffer = (char*) malloc(RECOVERLEN);
+	if ( buffer == NULL ) {
+		err("recover malloc:");
 		goto RETURN;
 	}
-	strcpy(name, frd->parameters->pathName);
-	strcat(name, "/");
-	if ( readpf ) {
-		strcat(name, RPPREFIX);
-		strcat(name, readpf);
+	start = end > RECOVERLEN ? end - RECOVERLEN : 0;
+	first = start == 0;
+	n = pread(fd, buffer, end - start, start);
+	if ( n < 0 ) {
+		errpath("recover read:", name);
+		goto RETURN;
+	}
+	if ( fpa->recordSize > 0 ) {
+		/* last complete record of fixed size */
+		n -= end % fpa->recordSize;
 	} else {
-		strcat(name, WPPREFIX);
+		/* last separator ending a record; a longer record is taken as it is */
+		for ( i = n; i > 0 && recordend(fpa, buffer, i - 1, first) <= 0; --i ) ;
+		if ( i > 0 || first ) n = i;
 	}
-	frp->readPointerFile = name;
+	/* transaction group begun, but not committed */
+	for ( j = n - 2; fifoMarks(fpa) && j >= 0; --j ) {
+		if ( buffer[j] != esc || buffer[j+1] != TXBEGIN ) continue;
+		if ( j == 0 ? !first : recordend(fpa, buffer, j - 1, first) <= 0 ) continue;
+		group = strtol(buffer + j + 2, NULL, 10);
+		for ( i = j + 2; i < n && buffer[i] != fpa->separator[0]; ++i ) ;
+		group += i + 1;
+		if ( group + 3 > n || buffer[group] != esc || buffer[group+1] != TXCOMMIT ) {
+			n = j;
+		}
+		break;
+	}
+	end = start + n;
 
-	frd->fdp = open(name, O_RDWR | O_CREAT, 0666);
-	if ( frd->fdp < 0 ) {
-		err("fifoOpenFilePointer open ");
-		err(name);
-		err(":");
+	if ( end < size && ftruncate(fd, end) < 0 ) {
+		errpath("recover truncate:", name);
+		goto RETURN;
+	}
+	res = size - end;
+	if ( (res > 0 || !valid) && fifoRepairPointers(fpa, fwd->current, end) < 0 ) {
+		res = -1;
 		goto RETURN;
 	}
 
-RETURN:
-	if ( frd && frd->fdp < 0 ) {
-		if ( name ) {
-			free(name);
-			frp->readPointerFile = NULL;
+	if ( fpa->recordSize == 0 && n >= (ssize_t) len && memcmp(buffer + n - len, fpa->rollmark, len) == 0 &&
+			(n == (ssize_t) len ? first : recordend(fpa, buffer, n - len - 1, first) > 0) ) {
+		/* the rollover was not completed */
+		if ( fifoReOpenWrite(fwd, fwd->current + 1) < 0 ) {
+			err("recover:");
+			res = -1;
+			goto RETURN;
 		}
+		fwd->filePointer->current = fwd->current;
+		fwd->filePointer->base += end;
+		if ( valid ) fwd->filePointer->messages = atomic_load(&t->messages);
+		fifoManifestRoll(fpa, fwd->current - 1, end, fwd->current);
+		atomic_store(&t->magic, 0);
+		end = recover(fwd);
+		res = end < 0 ? -1 : res + end;
+		goto RETURN;
 	}
-	return frd->fdp;
+
+	atomic_store(&t->gen, fwd->current);
+	if ( !valid ) {
+		/* messages of the current generation are not counted */
+		atomic_store(&t->messages, fwd->filePointer->messages);
+	}
+	atomic_store(&t->commit, TAILWORD(fwd->current, end));
+	atomic_store(&t->tail, TAILWORD(fwd->current, end));
+	atomic_store(&t->magic, TAILMAGIC);
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	if ( buffer ) free(buffer);
+	return res;
 }
 
-static int fifoReadFilePointer(FifoDescriptor* frd) {
-	int res;
-	FifoFilePointer* fr = frd->filePointer;
-	res = readoffset(frd->fdp, &fr->current, &fr->readPos, &fr->releasePos);
-	fr->fileSize = res;
-	fr->roll = 0;
+/**
+ * Set read pointers of the generation, which are beyond its end, back to the end.
+ */
+static int fifoRepairPointers(const FifoParameters* fpa, unsigned long gen, off_t end) {
+	DIR* dir;
+	int fd;
+	int res = -1;
+	int lres = -1;
+	int fres;
+	int size;
+	unsigned long current;
+	off_t o1, o2;
+	uint64_t base, messages;
+	struct dirent* dirent;
+
+	fd = openat(fpa->dirfd, ".", O_RDONLY | O_DIRECTORY);
+	dir = fd < 0 ? NULL : fdopendir(fd);
+	if ( dir == NULL ) {
+		errpath("fifoRepairPointers opendir:", fpa->pathName);
+		if ( fd >= 0 ) close(fd);
+		goto RETURN;
+	}
+	lres = lwlock(&fpa->locks->radm);
+	if ( lres < 0 ) {
+		err("fifoRepairPointers:");
+		goto RETURN;
+	}
+	while ( (dirent = readdir(dir)) ) {
+		if ( strncmp(dirent->d_name, RPPREFIX, strlen(RPPREFIX)) != 0 ) continue;
+		fd = openat(fpa->dirfd, dirent->d_name, O_RDWR);
+		if ( fd < 0 ) continue;
+		fres = takewritelock(fd);
+		size = fres < 0 ? -1 : readoffset(fd, &current, &o1, &o2, &base, &messages);
+		if ( size >= 0 && current == gen && (o1 > end || o2 > end) ) {
+			size = printoffset(fd, gen, o1 > end ? end : o1, o2 > end ? end : o2, base, messages, size);
+		}
+		if ( fres >= 0 ) releaselock(fd);
+		close(fd);
+		if ( size < 0 ) {
+			errpath("fifoRepairPointers:", dirent->d_name);
+			goto RETURN;
+		}
+	}
+	res = 0;
+RETURN:
+	if ( lres >= 0 ) lulock(&fpa->locks->radm);
+	if ( dir ) closedir(dir);
 	return res;
 }
 
-static int fifoWriteFilePointer(FifoDescriptor* frd) {
-	int res;
-	FifoFilePointer* fr = frd->filePointer;
-	res = printoffset(frd->fdp, fr->current, fr->readPos, fr->releasePos, fr->fileSize);
+#ifdef FIFO_PTHREAD_LOCKS
+/**
+ * Call the pthread interface for read-write locks.
+ * Provide the function pointer and a lock pointer.
+ * Set the errno variable from the return value.
+ */
+static int doplock(int (*pcall)(pthread_rwlock_t* lock), pthread_rwlock_t* lock) {
+	int res = (*pcall)(lock);
+	if ( res != 0 ) {
+		errno = res; res = -1;
+	}
 	return res;
 }
+
+static int lwlock(pthread_rwlock_t* lock) {
+	return doplock(&pthread_rwlock_wrlock, lock);
+}
+
+static int lrlock(pthread_rwlock_t* lock) {
+	return doplock(&pthread_rwlock_rdlock, lock);
+}
+
+static int lulock(pthread_rwlock_t* lock) {
+	return doplock(&pthread_rwlock_unlock, lock);
+}
+#endif
+
+/**
+ * Call the advisory file lock interface on the whole file
+ * deternined by the open file descriptor.
+ * Supported lock types are UNLOCK, RDLOCK, and WRLOCK
+ */
+static int dolock(int fd, int type) {
+
+	int fres;
+	struct flock flock;
+
+	flock.l_whence = SEEK_SET;
+	flock.l_start = 0;
+	flock.l_len = 0;
+	flock.l_pid = 0;
+
+	flock.l_type = type;
+	PROBE2(lock__start, fd, type);
+	fres = fcntl(fd, FIFO_SETLKW, &flock);
+	PROBE3(lock__done, fd, type, fres);
+	return fres;
+}
+
+/**
+ * Like dolock, but do not wait, if the lock is held by another descriptor.
+ * In this case return -1 and set errno to EAGAIN.
+ */
+static int trylock(int fd, int type) {
+
+	int fres;
+	struct flock flock;
+
+	flock.l_whence = SEEK_SET;
+	flock.l_start = 0;
+	flock.l_len = 0;
+	flock.l_pid = 0;
+
+	flock.l_type = type;
+	fres = fcntl(fd, FIFO_SETLK, &flock);
+	if ( fres < 0 && errno == EACCES ) errno = EAGAIN;
+	return fres;
+}
+
+static int takewritelock(int fd ) {
+	return dolock(fd, F_WRLCK);
+}
+
+static int takereadlock(int fd ) {
+	return dolock(fd, F_RDLCK);
+}
+
+static int releaselock(int fd ) {
+	return dolock(fd, F_UNLCK);
+}
+
+/**
+ * Reset error state (if text argument is NULL) or record a failing operation.
+ * The first call after the reset takes the errno value and the operation,
+ * further calls add the callers to the trace. Only pointers to constant
+ * strings are stored, so this is cheap enough for frequent failures.
+ */
+static void err( const char* text ) {
+	FifoError* e = &lastError;
+
+	if ( text == NULL ) {
+		e->code = FIFO_OK;
+		return;
+	}
+
+	if ( e->code == FIFO_OK ) {
+		e->errnum = errno;
+		switch ( errno ) {
+		case ENOMEM:	e->code = FIFO_ENOMEM; break;
+		case EAGAIN:
+		case EACCES:	e->code = FIFO_EBUSY; break;
+		case EINVAL:
+		case EILSEQ:	e->code = FIFO_EFORMAT; break;
+		case E2BIG:	e->code = FIFO_ETOOBIG; break;
+		case ESPIPE:	e->code = FIFO_ESEQUENCE; break;
+		default:	e->code = FIFO_ESYSTEM; break;
+		}
+		e->depth = 0;
+		e->path[0] = '\0';
+	}
+	if ( e->depth < FIFOTRACE ) e->trace[e->depth++] = text;
+}
+
+/**
+ * Record a failing operation on a file; the name is copied.
+ */
+static void errpath( const char* text, const char* path ) {
+	int fresh = lastError.code == FIFO_OK;
+
+	err(text);
+	if ( fresh ) {
+		strncpy(lastError.path, path, sizeof(lastError.path)-1);
+		lastError.path[sizeof(lastError.path)-1] = '\0';
+	}
+}
+
+/* END OF SOURCE FILE */
@@ -0,0 +1,660 @@
+
+/*
+ * C++ interface of the file queue: RAII handles for write and read pointers
+ * and the queue directory. The handles are movable, not copyable, and close
+ * their descriptor on destruction.
+ * Messages are passed as std::span of bytes; reads return views into the
+ * buffer of the caller, so no allocation is added to the C interface.
+ * Errors are thrown as fifo::Error, which carries the FifoError of the
+ * failing call. A read finding no message is not an error.
+ * Header only, requires C++20.
+ */
+
+#ifndef	FIFO_HPP
+#define	FIFO_HPP
+
+#if	__cplusplus < 202002L
+#error	"fifo.hpp requires C++20"
+#endif
+
+#include	<bit>
+#include	<chrono>
+#include	<cerrno>
+#include	<cstddef>
+#include	<cstdint>
+#include	<cstring>
+#include	<optional>
+#include	<ranges>
+#include	<source_location>
+#include	<span>
+#include	<string>
+#include	<string_view>
+#include	<stdexcept>
+#include	<type_traits>
+#include	<utility>
+#include	<vector>
+
+#include	"fifo.h"
+
+namespace fifo {
+
+/**
+ * Failed call of the C interface: what() is the text of fifoStrerror,
+ * code() the errno and error() the error trace.
+ */
+class	Error : public std::runtime_error {
+public:
+	explicit Error(const char* what)
+		: std::runtime_error(text(what)), detail(*fifoError()), errnum(errno) {
+		if ( detail.code != FIFO_OK ) errnum = detail.errnum;
+	}
+
+	/** Failure of a system call outside of the C interface. */
+	Error(const char* what, int errnum)
+		: std::runtime_error(std::string(what) + ": " + std::strerror(errnum)), detail(), errnum(errnum) {}
+
+	int code() const noexcept { return errnum; }
+	const FifoError& error() const noexcept { return detail; }
+
+private:
+	static std::string text(const char* what) {
+		char message[1024];
+		size_t n;
+		if ( fifoError()->code == FIFO_OK ) {
+			return std::string(what) + ": " + std::strerror(errno);
+		}
+		fifoStrerror(message, sizeof(message));
+		n = std::strlen(message);
+		if ( n > 0 && message[n-1] == '\n' ) message[n-1] = '\0';
+		return message;
+	}
+
+	FifoError	detail;
+	int	errnum;
+};
+
+/**
+ * Message read: payload and attributes point into the buffer given to read,
+ * so they are valid until the buffer is reused.
+ */
+struct	Message {
+	FifoHeader	header;		/* 0 for a message without header */
+	std::span<const std::byte>	payload;
+
+	std::string_view text() const noexcept {
+		return std::string_view(reinterpret_cast<const char*>(payload.data()), payload.size());
+	}
+
+	std::span<const std::byte> attributes() const noexcept {
+		return std::span<const std::byte>(static_cast<const std::byte*>(header.attributes), header.attrSize);
+	}
+};
+
+namespace detail {
+
+	/* the C interface takes void*, but never writes to a message written */
+	inline void* mutableData(std::span<const std::byte> message) noexcept {
+		return const_cast<std::byte*>(message.data());
+	}
+
+	inline std::span<const std::byte> bytes(std::string_view message) noexcept {
+		return std::as_bytes(std::span<const char>(message.data(), message.size()));
+	}
+
+	inline std::span<const std::byte> bytes(std::span<const std::byte> message) noexcept {
+		return message;
+	}
+
+	template <class T>
+	concept Bytes = requires(const T& m) { { bytes(m) } -> std::same_as<std::span<const std::byte>>; };
+
+	template <class R>
+	concept Batch = std::ranges::input_range<R> && Bytes<std::ranges::range_value_t<R>>;
+
+	inline std::size_t check(ssize_t res, const char* what) {
+		if ( res < 0 ) throw Error(what);
+		return static_cast<std::size_t>(res);
+	}
+}
+
+class	Writer;
+
+/**
+ * Transaction on a write pointer: messages written until commit are staged
+ * and become visible together. Aborted on destruction unless committed.
+ */
+class	Transaction {
+public:
+	Transaction(Transaction&& o) noexcept : fd(std::exchange(o.fd, nullptr)) {}
+	Transaction& operator=(Transaction&&) = delete;
+	~Transaction() { if ( fd ) fifoAbort(fd); }
+
+	/** Write the staged messages, return their number. */
+	std::size_t commit() {
+		return detail::check(fifoCommit(std::exchange(fd, nullptr)), "fifoCommit");
+	}
+
+	/** Drop the staged messages, return their number. */
+	std::size_t abort() {
+		return detail::check(fifoAbort(std::exchange(fd, nullptr)), "fifoAbort");
+	}
+
+private:
+	friend class Writer;
+	explicit Transaction(FifoDescriptor* fd) : fd(fd) {
+		if ( fifoBegin(fd) < 0 ) throw Error("fifoBegin");
+	}
+
+	FifoDescriptor*	fd;
+};
+
+/**
+ * Write pointer of a queue.
+ */
+class	Writer {
+public:
+	Writer() noexcept = default;
+	explicit Writer(const char* dirname) : fd(fifoOpenW(dirname)) {
+		if ( fd == nullptr ) throw Error("fifoOpenW");
+	}
+	explicit Writer(const std::string& dirname) : Writer(dirname.c_str()) {}
+	/** Take ownership of a descriptor opened by fifoOpenW. */
+	explicit Writer(FifoDescriptor* fd) noexcept : fd(fd) {}
+
+	Writer(Writer&& o) noexcept : fd(std::exchange(o.fd, nullptr)) {}
+	Writer& operator=(Writer&& o) noexcept {
+		if ( this != &o ) {
+			close();
+			fd = std::exchange(o.fd, nullptr);
+		}
+		return *this;
+	}
+	~Writer() { close(); }
+
+	void close() noexcept { if ( fd ) fifoCloseW(std::exchange(fd, nullptr)); }
+	FifoDescriptor* get() const noexcept { return fd; }
+	FifoDescriptor* detach() noexcept { return std::exchange(fd, nullptr); }
+	explicit operator bool() const noexcept { return fd != nullptr; }
+
+	/** Write a message, return the number of bytes stored. */
+	std::size_t write(std::span<const std::byte> message) {
+		return detail::check(fifoWrite(fd, detail::mutableData(message), message.size()), "fifoWrite");
+	}
+
+	std::size_t write(std::string_view message) { return write(detail::bytes(message)); }
+
+	/**
+	 * Write a batch of messages, given as range of byte spans or strings.
+	 * On a queue with escape character the batch is a transaction, which
+	 * takes the lock and reserves the space once; otherwise the messages
+	 * are written one by one. Return the number of messages written.
+	 */
+	template <detail::Batch R>
+	std::size_t write(R&& batch) {
+		std::size_t n = 0;
+		if ( fd->parameters->escape[0] == ' ' ) {
+			for ( auto&& message : batch ) {
+				write(detail::bytes(message));
+				++n;
+			}
+			return n;
+		}
+		Transaction tx = begin();
+		for ( auto&& message : batch ) {
+			write(detail::bytes(message));
+		}
+		return tx.commit();
+	}
+
+	/** Write a message with binary header, see fifoWriteH. */
+	std::size_t write(FifoHeader& header, std::span<const std::byte> message) {
+		return detail::check(fifoWriteH(fd, &header, detail::mutableData(message), message.size()), "fifoWriteH");
+	}
+
+	/** Write a message readable not before the given time, see fifoWriteAt. */
+	std::size_t writeAt(std::chrono::system_clock::time_point notBefore, std::span<const std::byte> message) {
+		return detail::check(fifoWriteAt(fd, std::chrono::system_clock::to_time_t(notBefore),
+				detail::mutableData(message), message.size()), "fifoWriteAt");
+	}
+
+	/** Write a message to a priority lane, see fifoWriteLane. */
+	std::size_t writeLane(int lane, std::span<const std::byte> message) {
+		return detail::check(fifoWriteLane(fd, lane, detail::mutableData(message), message.size()), "fifoWriteLane");
+	}
+
+	/**
+	 * Act as idempotent producer, return the highest sequence number written,
+	 * see fifoProducer.
+	 */
+	std::uint64_t producer(std::uint32_t id) {
+		std::uint64_t sequence = 0;
+		if ( fifoProducer(fd, id, &sequence) < 0 ) throw Error("fifoProducer");
+		return sequence;
+	}
+
+	/** Write a message of the producer, return 0 for a duplicate, see fifoWriteSeq. */
+	std::size_t writeSeq(std::uint64_t sequence, std::span<const std::byte> message) {
+		return detail::check(fifoWriteSeq(fd, sequence, detail::mutableData(message), message.size()), "fifoWriteSeq");
+	}
+
+	/** Begin a transaction, needs a queue with escape character. */
+	Transaction begin() { return Transaction(fd); }
+
+private:
+	FifoDescriptor*	fd = nullptr;
+};
+
+/**
+ * Read pointer of a queue.
+ * Read messages are returned as views into the buffer of the caller;
+ * std::nullopt means no message available.
+ */
+class	Reader {
+public:
+	Reader() noexcept = default;
+	Reader(const char* dirname, const char* readpointer) : fd(fifoOpenR(dirname, readpointer)) {
+		if ( fd == nullptr ) throw Error("fifoOpenR");
+	}
+	Reader(const std::string& dirname, const std::string& readpointer)
+		: Reader(dirname.c_str(), readpointer.c_str()) {}
+	/** Take ownership of a descriptor opened by fifoOpenR. */
+	explicit Reader(FifoDescriptor* fd) noexcept : fd(fd) {}
+
+	Reader(Reader&& o) noexcept : fd(std::exchange(o.fd, nullptr)) {}
+	Reader& operator=(Reader&& o) noexcept {
+		if ( this != &o ) {
+			close();
+			fd = std::exchange(o.fd, nullptr);
+		}
+		return *this;
+	}
+	~Reader() { close(); }
+
+	void close() noexcept { if ( fd ) fifoCloseR(std::exchange(fd, nullptr)); }
+	FifoDescriptor* get() const noexcept { return fd; }
+	FifoDescriptor* detach() noexcept { return std::exchange(fd, nullptr); }
+	explicit operator bool() const noexcept { return fd != nullptr; }
+
+	/** Read the next message without waiting. */
+	std::optional<Message> read(std::span<std::byte> buffer) {
+		return readh(buffer, 0, 0);
+	}
+
+	/**
+	 * Read the next message, waiting up to maxWait and polling every
+	 * interval, see fifoReadW.
+	 */
+	template <class Rep, class Period>
+	std::optional<Message> read(std::span<std::byte> buffer, std::chrono::duration<Rep, Period> maxWait,
+				std::chrono::milliseconds interval = std::chrono::milliseconds(10)) {
+		return readh(buffer, interval.count() > 0 ? interval.count() : 1,
+				std::chrono::duration_cast<std::chrono::milliseconds>(maxWait).count());
+	}
+
+	/** Release the message read last. */
+	void release() {
+		if ( fifoRelease(fd) < 0 ) throw Error("fifoRelease");
+	}
+
+	/**
+	 * Read and release the available messages, at most max, and pass each
+	 * to f before its release. Return the number of messages consumed.
+	 */
+	template <class F>
+	std::size_t consume(std::span<std::byte> buffer, F&& f, std::size_t max = SIZE_MAX) {
+		std::size_t n = 0;
+		std::optional<Message> m;
+		while ( n < max && (m = read(buffer)) ) {
+			f(*m);
+			release();
+			++n;
+		}
+		return n;
+	}
+
+	/** Lag of the read pointer behind the writers, see fifoLag. */
+	FifoLag lag() const {
+		FifoLag l;
+		if ( fifoLag(fd, &l) < 0 ) throw Error("fifoLag");
+		return l;
+	}
+
+private:
+	std::optional<Message> readh(std::span<std::byte> buffer, long wtim, long maxtime) {
+		Message m;
+		void* payload;
+		ssize_t res = fifoReadH(fd, buffer.data(), buffer.size(), wtim, maxtime, &m.header, &payload);
+		if ( res < 0 && (errno == EAGAIN || errno == ETIME) ) return std::nullopt;
+		m.payload = std::span<const std::byte>(static_cast<const std::byte*>(payload), detail::check(res, "fifoReadH"));
+		return m;
+	}
+
+	FifoDescriptor*	fd = nullptr;
+};
+
+/**
+ * Queue directory: creation, administration and the factory of its
+ * write and read pointers.
+ */
+class	Queue {
+public:
+	explicit Queue(std::string dirname) : dirname(std::move(dirname)) {}
+
+	/** Create the queue, see fifoCreate. */
+	static Queue create(std::string dirname, off_t switchSize, char esc, char sep) {
+		if ( fifoCreate(dirname.c_str(), switchSize, esc, sep) < 0 ) throw Error("fifoCreate");
+		return Queue(std::move(dirname));
+	}
+
+	/** Create the queue with shard subdirectories, see fifoCreateShards. */
+	static Queue createShards(std::string dirname, off_t switchSize, char esc, char sep, unsigned long shardSize) {
+		if ( fifoCreateShards(dirname.c_str(), switchSize, esc, sep, shardSize) < 0 ) throw Error("fifoCreateShards");
+		return Queue(std::move(dirname));
+	}
+
+	/** Create the queue with priority lanes, see fifoCreateLanes. */
+	static Queue createLanes(std::string dirname, off_t switchSize, char esc, char sep, int lanes) {
+		if ( fifoCreateLanes(dirname.c_str(), switchSize, esc, sep, lanes) < 0 ) throw Error("fifoCreateLanes");
+		return Queue(std::move(dirname));
+	}
+
+	const std::string& name() const noexcept { return dirname; }
+
+	Writer writer() const { return Writer(dirname); }
+	Reader reader(const char* readpointer) const { return Reader(dirname.c_str(), readpointer); }
+
+	/** Set the retention policy, see fifoRetention. */
+	void retention(long maxAge, off_t maxBytes, const char* archive = nullptr) const {
+		if ( fifoRetention(dirname.c_str(), maxAge, maxBytes, archive) < 0 ) throw Error("fifoRetention");
+	}
+
+	/** Remove or archive data files, return their number, see fifoCollect. */
+	std::size_t collect(long maxAge = 0, off_t maxBytes = 0, const char* archive = nullptr) const {
+		return detail::check(fifoCollect(dirname.c_str(), maxAge, maxBytes, archive), "fifoCollect");
+	}
+
+	/** Repair the queue after a crash, return the bytes dropped, see fifoRecover. */
+	std::size_t recover() const {
+		return detail::check(fifoRecover(dirname.c_str()), "fifoRecover");
+	}
+
+	/** Fill lags with the lag of the read pointers, return the number found. */
+	std::span<FifoLag> lags(std::span<FifoLag> lags) const {
+		return lags.first(detail::check(fifoLagList(dirname.c_str(), lags.data(), static_cast<long>(lags.size())), "fifoLagList"));
+	}
+
+	/** Fill list with the published statistics, return the entries found. */
+	std::span<FifoStatsEntry> stats(std::span<FifoStatsEntry> list) const {
+		return list.first(detail::check(fifoStatsList(dirname.c_str(), list.data(), static_cast<int>(list.size())), "fifoStatsList"));
+	}
+
+private:
+	std::string	dirname;
+};
+
+/*
+ * Typed queues: TypedQueue<T> carries records of type T.
+ * A trivially copyable T is stored as fixed size record without framing:
+ * no escapes, separators or roll-marks, and a range of records is written
+ * and read with a single call. Other types are encoded by the serializer
+ * Serial<T>, which the user specializes, and framed like messages.
+ * The fingerprint of the record type is stored in dir/.param and checked,
+ * when a pointer is opened.
+ */
+
+/**
+ * Serializer of records of type T, to be specialized for types, which are
+ * not trivially copyable:
+ * size(value) is the maximal size of the encoded value, encode(value, out)
+ * encodes into out and returns the size used, decode(in) returns the value.
+ * A member fingerprint overrides the fingerprint derived from the type name,
+ * which depends on the compiler; this applies to trivially copyable types, too.
+ */
+template <class T>
+struct	Serial {};
+
+template <class S, class T>
+concept Serializer = requires(const T& value, std::span<std::byte> out, std::span<const std::byte> in) {
+	{ S::size(value) } -> std::convertible_to<std::size_t>;
+	{ S::encode(value, out) } -> std::convertible_to<std::size_t>;
+	{ S::decode(in) } -> std::convertible_to<T>;
+};
+
+/** Strings are stored as they are. */
+template <>
+struct	Serial<std::string> {
+	static std::size_t size(const std::string& value) noexcept { return value.size(); }
+	static std::size_t encode(const std::string& value, std::span<std::byte> out) noexcept {
+		std::memcpy(out.data(), value.data(), value.size());
+		return value.size();
+	}
+	static std::string decode(std::span<const std::byte> in) {
+		return std::string(reinterpret_cast<const char*>(in.data()), in.size());
+	}
+};
+
+namespace detail {
+
+	/* FNV-1a like fifoHash */
+	constexpr std::uint64_t fnv(std::string_view s, std::uint64_t h = UINT64_C(14695981039346656037)) {
+		for ( char c : s ) {
+			h ^= static_cast<unsigned char>(c);
+			h *= UINT64_C(1099511628211);
+		}
+		return h;
+	}
+
+	template <class T>
+	constexpr std::string_view typeName() {
+		return std::source_location::current().function_name();
+	}
+
+	template <class T, class S>
+	constexpr std::uint64_t fingerprint() {
+		std::uint64_t h;
+		if constexpr ( requires { { S::fingerprint } -> std::convertible_to<std::uint64_t>; } ) {
+			h = S::fingerprint;
+		} else {
+			h = fnv(typeName<T>());
+			h = (h ^ sizeof(T)) * UINT64_C(1099511628211);
+			h = (h ^ alignof(T)) * UINT64_C(1099511628211);
+		}
+		return h != 0 ? h : 1;
+	}
+}
+
+template <class T, class S>
+class	TypedWriter;
+template <class T, class S>
+class	TypedReader;
+
+/**
+ * Queue directory of records of type T.
+ */
+template <class T, class S = Serial<T>>
+class	TypedQueue {
+	static_assert(std::is_trivially_copyable_v<T> || Serializer<S, T>,
+			"record type must be trivially copyable or have a serializer fifo::Serial<T>");
+public:
+	/* framing selected at compile time: fixed size records without escapes */
+	static constexpr bool fixed = std::is_trivially_copyable_v<T>;
+	static constexpr std::size_t recordSize = fixed ? sizeof(T) : 0;
+	static constexpr std::uint64_t fingerprint = detail::fingerprint<T, S>();
+
+	explicit TypedQueue(std::string dirname) : base(std::move(dirname)) {}
+
+	/**
+	 * Create the queue for records of type T, see fifoCreateRecords.
+	 * esc and sep frame serialized records only.
+	 */
+	static TypedQueue create(std::string dirname, off_t switchSize, char esc = '\\', char sep = '\n') {
+		if ( fifoCreateRecords(dirname.c_str(), switchSize, esc, sep, recordSize, fingerprint) < 0 ) {
+			throw Error("fifoCreateRecords");
+		}
+		return TypedQueue(std::move(dirname));
+	}
+
+	/** Untyped queue for administration. */
+	const Queue& queue() const noexcept { return base; }
+
+	TypedWriter<T, S> writer() const { return TypedWriter<T, S>(base.writer()); }
+	TypedReader<T, S> reader(const char* readpointer, std::size_t bufferSize = 65536) const {
+		return TypedReader<T, S>(base.reader(readpointer), bufferSize);
+	}
+
+	/** Check that the queue of the descriptor carries records of type T. */
+	static void check(const FifoDescriptor* fd) {
+		if ( fd->parameters->recordSize != recordSize || fd->parameters->fingerprint != fingerprint ) {
+			errno = EINVAL;
+			throw Error("fifo::TypedQueue record type differs from queue");
+		}
+	}
+
+private:
+	Queue	base;
+};
+
+/**
+ * Write pointer of a queue of records of type T.
+ */
+template <class T, class S = Serial<T>>
+class	TypedWriter {
+public:
+	explicit TypedWriter(Writer&& writer) : w(std::move(writer)) {
+		TypedQueue<T, S>::check(w.get());
+	}
+
+	/** Write a record. */
+	void write(const T& value) {
+		if constexpr ( TypedQueue<T, S>::fixed ) {
+			w.write(std::as_bytes(std::span<const T>(&value, 1)));
+		} else {
+			w.write(encode(value));
+		}
+	}
+
+	/**
+	 * Write a range of records. Fixed size records in contiguous memory
+	 * are written with a single call, others as one transaction, if the
+	 * queue has an escape character. Return the number of records.
+	 */
+	template <std::ranges::input_range R>
+		requires std::same_as<std::ranges::range_value_t<R>, T>
+	std::size_t write(R&& records) {
+		std::size_t n = 0;
+		if constexpr ( TypedQueue<T, S>::fixed && std::ranges::contiguous_range<R> ) {
+			std::span<const T> s(std::ranges::data(records), std::ranges::size(records));
+			if ( !s.empty() ) w.write(std::as_bytes(s));
+			return s.size();
+		} else if constexpr ( TypedQueue<T, S>::fixed ) {
+			for ( const T& value : records ) {
+				write(value);
+				++n;
+			}
+			return n;
+		} else {
+			if ( w.get()->parameters->escape[0] == ' ' ) {
+				for ( const T& value : records ) {
+					write(value);
+					++n;
+				}
+				return n;
+			}
+			Transaction tx = w.begin();
+			for ( const T& value : records ) {
+				write(value);
+			}
+			return tx.commit();
+		}
+	}
+
+	Writer& untyped() noexcept { return w; }
+
+private:
+	std::span<const std::byte> encode(const T& value) {
+		buffer.resize(S::size(value));
+		return std::span<const std::byte>(buffer.data(), S::encode(value, buffer));
+	}
+
+	Writer	w;
+	std::vector<std::byte>	buffer;		/* encoded record, serializer only */
+};
+
+/**
+ * Read pointer of a queue of records of type T.
+ * Fixed size records are read directly into the memory of the caller.
+ */
+template <class T, class S = Serial<T>>
+class	TypedReader {
+public:
+	/** bufferSize bounds the size of encoded records, serializer only */
+	explicit TypedReader(Reader&& reader, std::size_t bufferSize = 65536) : r(std::move(reader)) {
+		TypedQueue<T, S>::check(r.get());
+		if constexpr ( !TypedQueue<T, S>::fixed ) buffer.resize(bufferSize);
+	}
+
+	/** Read the next record without waiting. */
+	std::optional<T> read() {
+		return readone(std::chrono::milliseconds(0), std::chrono::milliseconds(0));
+	}
+
+	/** Read the next record, waiting up to maxWait and polling every interval. */
+	template <class Rep, class Period>
+	std::optional<T> read(std::chrono::duration<Rep, Period> maxWait,
+				std::chrono::milliseconds interval = std::chrono::milliseconds(10)) {
+		return readone(maxWait, interval);
+	}
+
+	/**
+	 * Read as many available fixed size records as fit into out without
+	 * waiting, all released by a single release. Return the records read.
+	 */
+	std::span<T> read(std::span<T> out) requires TypedQueue<T, S>::fixed {
+		std::optional<Message> m = r.read(std::as_writable_bytes(out));
+		return out.first(m ? m->payload.size() / sizeof(T) : 0);
+	}
+
+	/** Release the records read last. */
+	void release() { r.release(); }
+
+	/**
+	 * Read and release the available records, at most max, and pass each
+	 * to f before its release. Return the number of records consumed.
+	 */
+	template <class F>
+	std::size_t consume(F&& f, std::size_t max = SIZE_MAX) {
+		std::size_t n = 0;
+		std::optional<T> value;
+		while ( n < max && (value = read()) ) {
+			f(*value);
+			release();
+			++n;
+		}
+		return n;
+	}
+
+	Reader& untyped() noexcept { return r; }
+
+private:
+	template <class Rep, class Period>
+	std::optional<T> readone(std::chrono::duration<Rep, Period> maxWait, std::chrono::milliseconds interval) {
+		std::optional<Message> m;
+		if constexpr ( TypedQueue<T, S>::fixed ) {
+			alignas(T) std::byte raw[sizeof(T)];
+			m = maxWait.count() > 0 ? r.read(std::span<std::byte>(raw), maxWait, interval) : r.read(std::span<std::byte>(raw));
+			if ( !m ) return std::nullopt;
+			return std::bit_cast<T>(raw);
+		} else {
+			m = maxWait.count() > 0 ? r.read(std::span<std::byte>(buffer), maxWait, interval) : r.read(std::span<std::byte>(buffer));
+			if ( !m ) return std::nullopt;
+			return S::decode(m->payload);
+		}
+	}
+
+	Reader	r;
+	std::vector<std::byte>	buffer;		/* encoded record, serializer only */
+};
+
+}
+
+#endif
@@ -0,0 +1,488 @@
+
+/*
+ * Asynchronous C++ interface of the file queue for C++20 coroutines.
+ * A fifo::Loop multiplexes suspended readers of many queues over a few
+ * threads: it waits with epoll on an inotify descriptor, which watches the
+ * directories of the queues, and on an eventfd for wakeups from other
+ * threads. A read finding no message suspends the coroutine until a writer
+ * changes a data file of the queue, the timeout expires or the stop token
+ * is triggered, instead of polling with wtim and maxtim.
+ * Writes and releases run synchronously on the calling thread: a write may
+ * wait for the rollover lock and the commits of other writers, blocking the
+ * loop thread meanwhile. Their awaitables complete at once.
+ * Header only, requires C++20 and Linux.
+ */
+
+#ifndef	FIFOASYNC_HPP
+#define	FIFOASYNC_HPP
+
+#include	<algorithm>
+#include	<atomic>
+#include	<climits>
+#include	<coroutine>
+#include	<cstdio>
+#include	<ctime>
+#include	<exception>
+#include	<map>
+#include	<mutex>
+#include	<stop_token>
+#include	<unordered_map>
+#include	<vector>
+
+#include	<sys/epoll.h>
+#include	<sys/eventfd.h>
+#include	<sys/inotify.h>
+#include	<unistd.h>
+
+#include	"fifo.hpp"
+
+namespace fifo {
+
+/**
+ * Awaitable of an operation, which completed when it was started.
+ */
+template <class T>
+struct	Ready {
+	T	value;
+
+	bool await_ready() const noexcept { return true; }
+	void await_suspend(std::coroutine_handle<>) const noexcept {}
+	T await_resume() { return std::move(value); }
+};
+
+template <>
+struct	Ready<void> {
+	bool await_ready() const noexcept { return true; }
+	void await_suspend(std::coroutine_handle<>) const noexcept {}
+	void await_resume() const noexcept {}
+};
+
+/**
+ * Coroutine started at once and not awaited by anybody; its frame is freed,
+ * when it returns. An exception leaving it terminates the program.
+ */
+struct	Task {
+	struct	promise_type {
+		Task get_return_object() noexcept { return Task(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+class	ReadOperation;
+
+/**
+ * Event loop resuming the coroutines suspended in reads. Any number of
+ * threads may call run or poll; the coroutines are resumed in them.
+ */
+class	Loop {
+public:
+	using	Clock = std::chrono::steady_clock;
+
+	Loop() {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if ( epfd < 0 || infd < 0 || evfd < 0 || add(infd) < 0 || add(evfd) < 0 ) {
+			int e = errno;
+			closeall();
+			throw Error("fifo::Loop", e);
+		}
+	}
+	Loop(const Loop&) = delete;
+	Loop& operator=(const Loop&) = delete;
+	~Loop() { closeall(); }
+
+	/** Resume coroutines until stop is called. */
+	void run() {
+		while ( !stopped.load() ) poll(std::chrono::milliseconds(-1));
+	}
+
+	/** Let run return in all threads. */
+	void stop() {
+		stopped.store(true);
+		wake();
+	}
+
+	/**
+	 * Wait up to max (negative: until an event) for readable queues, expired
+	 * timeouts and cancellations once and resume the coroutines concerned.
+	 * Return the number of coroutines resumed.
+	 */
+	std::size_t poll(std::chrono::milliseconds max);
+
+	/** Awaitable continuing the coroutine in a thread of the loop. */
+	auto schedule() {
+		struct	Schedule {
+			Loop&	loop;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) { loop.post(h); }
+			void await_resume() const noexcept {}
+		};
+		return Schedule{*this};
+	}
+
+	/** Resume the coroutine in a thread of the loop. */
+	void post(std::coroutine_handle<> h) {
+		std::lock_guard<std::mutex> lock(mutex);
+		posted.push_back(h);
+		wake();
+	}
+
+private:
+	friend class	ReadOperation;
+
+	/* suspended read, lives in the frame of its coroutine */
+	struct	Waiter {
+		enum	State { IDLE, WAITING, TRYING, DONE };
+
+		Reader*	reader = nullptr;
+		std::span<std::byte>	buffer;
+		std::optional<Message>	result;
+		std::exception_ptr	error;
+		std::coroutine_handle<>	handle;
+		Clock::time_point	deadline = Clock::time_point::max();
+		std::multimap<Clock::time_point, Waiter*>::iterator	timer;
+		bool	timed = false;
+		int	wd[FIFOLANES + 1];	/* watches of lane and shard directories */
+		int	nwd = 0;
+		State	state = IDLE;
+		bool	cancelled = false;
+	};
+
+	int add(int fd) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	void closeall() noexcept {
+		if ( evfd >= 0 ) ::close(evfd);
+		if ( infd >= 0 ) ::close(infd);
+		if ( epfd >= 0 ) ::close(epfd);
+		evfd = infd = epfd = -1;
+	}
+
+	void wake() noexcept {
+		uint64_t one = 1;
+		if ( ::write(evfd, &one, sizeof(one)) < 0 ) {
+			/* counter is saturated, the loop is woken anyway */
+		}
+	}
+
+	/* watch the directory; the caller holds the mutex */
+	void watch(Waiter* w, const char* path) {
+		int wd = inotify_add_watch(infd, path, IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+		if ( wd < 0 ) return;
+		watches[wd].push_back(w);
+		w->wd[w->nwd++] = wd;
+	}
+
+	/* watch the directories of the lanes and of their current shards */
+	void watchall(Waiter* w) {
+		char path[64];
+		FifoDescriptor* frd = w->reader->get();
+		FifoDescriptor* fp;
+		for ( int i = 0; i < frd->lanes && w->nwd < FIFOLANES; ++i ) {
+			fp = i == 0 ? frd : frd->lane[i-1];
+			std::snprintf(path, sizeof(path), "/proc/self/fd/%d", fp->parameters->dirfd);
+			watch(w, path);
+		}
+		if ( frd->parameters->shardSize > 0 ) {
+			std::snprintf(path, sizeof(path), "/proc/self/fd/%d/s%lu", frd->parameters->dirfd,
+					frd->filePointer->current / frd->parameters->shardSize);
+			watch(w, path);
+		}
+	}
+
+	/* unlink the waiter from watches and timers; the caller holds the mutex */
+	void unlink(Waiter* w) {
+		for ( int i = 0; i < w->nwd; ++i ) {
+			auto it = watches.find(w->wd[i]);
+			if ( it == watches.end() ) continue;
+			std::vector<Waiter*>& list = it->second;
+			for ( std::size_t k = 0; k < list.size(); ++k ) {
+				if ( list[k] == w ) {
+					list[k] = list.back();
+					list.pop_back();
+					break;
+				}
+			}
+			if ( list.empty() ) {
+				inotify_rm_watch(infd, it->first);
+				watches.erase(it);
+			}
+		}
+		w->nwd = 0;
+		if ( w->timed ) timers.erase(w->timer);
+		w->timed = false;
+	}
+
+	/*
+	 * Register the waiter, unless it was cancelled meanwhile. A message written
+	 * before the watches were added is found by the check afterwards.
+	 * Return false, if the coroutine is not to be suspended.
+	 */
+	bool suspend(Waiter* w) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if ( w->cancelled ) {
+			w->state = Waiter::DONE;
+			return false;
+		}
+		return arm(w);
+	}
+
+	/*
+	 * Wait for events of the queue, the timeout or a retry; the caller holds
+	 * the mutex. A message written before the watches were added and the
+	 * commit of reserved data cause no event: they are retried soon.
+	 * Return false, if the check failed: the waiter is done with the error.
+	 */
+	bool arm(Waiter* w) {
+		time_t due;
+		int res;
+		Clock::time_point at = w->deadline;
+		w->state = Waiter::WAITING;
+		watchall(w);
+		res = fifoReadable(w->reader->get(), &due);
+		if ( res < 0 ) {
+			w->error = std::make_exception_ptr(Error("fifoReadable"));
+			unlink(w);
+			w->state = Waiter::DONE;
+			return false;
+		}
+		if ( res != 0 ) {
+			at = std::min(at, Clock::now() + RETRY);
+		} else if ( due != 0 ) {
+			at = std::min(at, Clock::now() + std::chrono::seconds(due - ::time(nullptr)));
+		}
+		if ( at != Clock::time_point::max() ) {
+			w->timer = timers.emplace(at, w);
+			w->timed = true;
+			if ( timers.begin() == w->timer ) {
+				/* earlier than the threads waiting in the loop expect */
+				wake();
+			}
+		}
+		return true;
+	}
+
+	/* called by the stop token in any thread */
+	void cancel(Waiter* w) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if ( w->state == Waiter::WAITING ) {
+			unlink(w);
+			w->state = Waiter::DONE;
+			posted.push_back(w->handle);
+			wake();
+		} else {
+			w->cancelled = true;
+		}
+	}
+
+	/* take the waiters of a watch for a try; the caller holds the mutex */
+	void take(std::vector<Waiter*>& list, std::vector<Waiter*>& tries) {
+		for ( Waiter* w : list ) {
+			if ( w->state == Waiter::WAITING ) {
+				w->state = Waiter::TRYING;
+				tries.push_back(w);
+			}
+		}
+	}
+
+	/* the inotify event concerns data files, shards, lanes or the write pointer */
+	static bool relevant(const struct inotify_event* ev) {
+		return ev->len == 0 || ev->name[0] != '.' || std::strcmp(ev->name, ".wp") == 0;
+	}
+
+	static constexpr std::chrono::milliseconds	RETRY{1};
+
+	int	epfd = -1;
+	int	infd = -1;
+	int	evfd = -1;
+	std::atomic<bool>	stopped{false};
+	std::mutex	mutex;
+	std::unordered_map<int, std::vector<Waiter*>>	watches;
+	std::multimap<Clock::time_point, Waiter*>	timers;
+	std::vector<std::coroutine_handle<>>	posted;		/* to be resumed */
+};
+
+inline std::size_t Loop::poll(std::chrono::milliseconds max) {
+	struct epoll_event events[4];
+	alignas(struct inotify_event) char buf[4096];
+	std::vector<Waiter*> tries;
+	std::vector<std::coroutine_handle<>> resume;
+	long timeout = max.count() < 0 ? -1 : static_cast<long>(max.count());
+	int n;
+	ssize_t len;
+	Clock::time_point now;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if ( !posted.empty() ) {
+			timeout = 0;
+		} else if ( !timers.empty() ) {
+			auto ms = std::chrono::ceil<std::chrono::milliseconds>(timers.begin()->first - Clock::now()).count();
+			ms = ms < 0 ? 0 : ms;
+			timeout = timeout < 0 || ms < timeout ? static_cast<long>(ms) : timeout;
+		}
+	}
+	n = epoll_wait(epfd, events, 4, timeout > INT_MAX ? INT_MAX : static_cast<int>(timeout));
+	if ( n < 0 && errno != EINTR ) throw Error("fifo::Loop epoll_wait", errno);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	for ( int i = 0; i < n; ++i ) {
+		if ( events[i].data.fd == evfd ) {
+			uint64_t count;
+			if ( ::read(evfd, &count, sizeof(count)) < 0 ) {
+				/* read by another thread */
+			}
+			continue;
+		}
+		while ( (len = ::read(infd, buf, sizeof(buf))) > 0 ) {
+			for ( char* p = buf; p < buf + len; ) {
+				const struct inotify_event* ev = reinterpret_cast<const struct inotify_event*>(p);
+				auto it = watches.find(ev->wd);
+				if ( it != watches.end() && (relevant(ev) || (ev->mask & IN_IGNORED)) ) {
+					take(it->second, tries);
+				}
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+	}
+	now = Clock::now();
+	while ( !timers.empty() && timers.begin()->first <= now ) {
+		Waiter* w = timers.begin()->second;
+		timers.erase(timers.begin());
+		w->timed = false;
+		if ( w->state == Waiter::WAITING ) {
+			w->state = Waiter::TRYING;
+			tries.push_back(w);
+		}
+	}
+	for ( Waiter* w : tries ) unlink(w);
+	resume.swap(posted);
+	lock.unlock();
+
+	for ( Waiter* w : tries ) {
+		if ( !w->cancelled ) {
+			try {
+				w->result = w->reader->read(w->buffer);
+			} catch ( ... ) {
+				w->error = std::current_exception();
+			}
+		}
+		lock.lock();
+		if ( w->cancelled || w->result || w->error || Clock::now() >= w->deadline
+				|| !arm(w) ) {
+			w->state = Waiter::DONE;
+			resume.push_back(w->handle);
+		}
+		lock.unlock();
+	}
+
+	for ( std::coroutine_handle<> h : resume ) h.resume();
+	return resume.size();
+}
+
+/**
+ * Awaitable read: the next message, or std::nullopt after timeout or
+ * cancellation. The message is a view into the buffer like Reader::read.
+ */
+class	ReadOperation : private Loop::Waiter {
+public:
+	ReadOperation(Loop& loop, Reader& reader, std::span<std::byte> buffer,
+				std::chrono::milliseconds timeout, std::stop_token token)
+		: loop(loop), token(std::move(token)) {
+		this->reader = &reader;
+		this->buffer = buffer;
+		if ( timeout.count() >= 0 ) deadline = Loop::Clock::now() + timeout;
+	}
+	ReadOperation(const ReadOperation&) = delete;
+	ReadOperation& operator=(const ReadOperation&) = delete;
+
+	bool await_ready() {
+		result = reader->read(buffer);
+		return result.has_value() || token.stop_requested() || deadline <= Loop::Clock::now();
+	}
+
+	bool await_suspend(std::coroutine_handle<> h) {
+		handle = h;
+		if ( token.stop_possible() ) callback.emplace(token, Cancel{this});
+		return loop.suspend(this);
+	}
+
+	std::optional<Message> await_resume() {
+		callback.reset();
+		if ( error ) std::rethrow_exception(error);
+		return std::move(result);
+	}
+
+private:
+	struct	Cancel {
+		ReadOperation*	op;
+		void operator()() const { op->loop.cancel(op); }
+	};
+
+	Loop&	loop;
+	std::stop_token	token;
+	std::optional<std::stop_callback<Cancel>>	callback;
+};
+
+/**
+ * Read pointer served by an event loop.
+ */
+class	AsyncReader {
+public:
+	AsyncReader(Loop& loop, Reader&& reader) : loop(&loop), r(std::move(reader)) {}
+
+	/**
+	 * co_await read(buffer): wait for the next message up to timeout
+	 * (negative: no timeout) or until stop is requested on token.
+	 */
+	ReadOperation read(std::span<std::byte> buffer,
+				std::chrono::milliseconds timeout = std::chrono::milliseconds(-1),
+				std::stop_token token = {}) {
+		return ReadOperation(*loop, r, buffer, timeout, std::move(token));
+	}
+
+	/** co_await release(): release the message read last. */
+	Ready<void> release() {
+		r.release();
+		return {};
+	}
+
+	Reader& untyped() noexcept { return r; }
+
+private:
+	Loop*	loop;
+	Reader	r;
+};
+
+/**
+ * Write pointer for coroutines. Writes are done synchronously in the calling
+ * thread, which may wait for the rollover lock or the commits of other
+ * writers; co_await returns the result.
+ */
+class	AsyncWriter {
+public:
+	explicit AsyncWriter(Writer&& writer) : w(std::move(writer)) {}
+
+	Ready<std::size_t> write(std::span<const std::byte> message) { return {w.write(message)}; }
+	Ready<std::size_t> write(std::string_view message) { return {w.write(message)}; }
+
+	template <detail::Batch R>
+	Ready<std::size_t> write(R&& batch) { return {w.write(std::forward<R>(batch))}; }
+
+	Writer& untyped() noexcept { return w; }
+
+private:
+	Writer	w;
+};
+
+}
+
+#endif
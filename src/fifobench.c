@@ -0,0 +1,395 @@
+
+#define _POSIX_C_SOURCE 200809L
+
+#include 	<time.h>
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<string.h>
+#include	<stdlib.h>
+#include	<stdint.h>
+#include	<errno.h>
+#include	<pthread.h>
+#include	<sched.h>
+#include	<sys/wait.h>
+
+#include	"fifo.h"
+
+/* end marker written after all writers finished */
+#define	ENDMARK		"\0end"
+#define	ENDLEN		4
+/* room for the write time in front of each message */
+#define	MINSIZE		16
+#define	MAXSIZE		65536
+
+static char message[1024];
+
+/* parameters of a benchmark run */
+typedef
+struct	{
+	const char*	dir;	/* queue directory, created by the run */
+	const char*	label;	/* name of library in the report */
+	int	writers;
+	int	readers;
+	int	shared;		/* readers share one read pointer */
+	int	threads;	/* threads instead of processes */
+	long	messages;	/* per writer */
+	size_t	minSize;	/* message sizes are uniform in minSize .. maxSize */
+	size_t	maxSize;
+	off_t	switchSize;
+	long	rate;		/* messages per second of a writer, 0: unlimited */
+	int	json;
+}	Bench;
+
+/* result of a reader */
+typedef
+struct	{
+	long	count;		/* messages received */
+	long	bytes;
+	uint64_t*	latency;	/* end-to-end latency of each message in ns */
+}	Result;
+
+/* a writer or reader thread */
+typedef
+struct	{
+	const Bench*	b;
+	int	n;		/* number of writer or reader */
+	pthread_t	thread;
+	Result	result;
+	int	status;
+}	Worker;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Write the messages of one writer: write time followed by filler.
+ * With a rate, the messages are paced by sleeping until their due time.
+ */
+static int writer(const Bench* b, int n) {
+	FifoDescriptor* fwd;
+	char* buffer;
+	size_t size;
+	long i;
+	uint64_t t;
+	uint64_t start = now();
+	unsigned int seed = n + 1;
+	int res = -1;
+	struct timespec ts;
+
+	buffer = (char*) malloc(b->maxSize);
+	fwd = fifoOpenW(b->dir);
+	if ( buffer == NULL || fwd == NULL ) {
+		fprintf(stderr, "writer %d: %s", n, fifoStrerror(message, sizeof(message)));
+		goto RETURN;
+	}
+	memset(buffer, 'a' + n % 26, b->maxSize);
+	for ( i = 0; i < b->messages; ++i ) {
+		size = b->minSize + (b->maxSize > b->minSize ? (size_t) rand_r(&seed) % (b->maxSize - b->minSize + 1) : 0);
+		t = now();
+		if ( b->rate > 0 && start + i * 1000000000 / b->rate > t ) {
+			t = start + i * 1000000000 / b->rate - t;
+			ts.tv_sec = t / 1000000000;
+			ts.tv_nsec = t % 1000000000;
+			nanosleep(&ts, NULL);
+			t = now();
+		}
+		memcpy(buffer, &t, sizeof(t));
+		if ( fifoWrite(fwd, buffer, size) < 0 ) {
+			fprintf(stderr, "writer %d: %s", n, fifoStrerror(message, sizeof(message)));
+			goto RETURN;
+		}
+	}
+	res = 0;
+RETURN:
+	if ( fwd ) fifoCloseW(fwd);
+	if ( buffer ) free(buffer);
+	return res;
+}
+
+/*
+ * Read messages until the end marker and record their latency.
+ */
+static int reader(const Bench* b, int n, Result* r) {
+	FifoDescriptor* frd;
+	char* buffer;
+	char name[32];
+	ssize_t size;
+	long max = b->writers * b->messages;
+	uint64_t t;
+	int res = -1;
+
+	sprintf(name, "bench%d", b->shared ? 0 : n);
+	r->count = 0;
+	r->bytes = 0;
+	r->latency = (uint64_t*) malloc((max + 1) * sizeof(uint64_t));
+	/* room for the escape characters */
+	buffer = (char*) malloc(2 * b->maxSize + 2);
+	frd = fifoOpenR(b->dir, name);
+	if ( buffer == NULL || r->latency == NULL || frd == NULL ) {
+		fprintf(stderr, "reader %d: %s", n, fifoStrerror(message, sizeof(message)));
+		goto RETURN;
+	}
+	for ( ;; ) {
+		size = fifoReadW(frd, buffer, 2 * b->maxSize + 2, 1, 60000);
+		if ( size < 0 && errno == ESPIPE && b->shared ) {
+			/* other reader of the shared pointer did not yet release */
+			sched_yield();
+			continue;
+		}
+		if ( size < 0 ) {
+			fprintf(stderr, "reader %d: %s", n, fifoStrerror(message, sizeof(message)));
+			goto RETURN;
+		}
+		t = now();
+		fifoRelease(frd);
+		if ( size == ENDLEN && memcmp(buffer, ENDMARK, ENDLEN) == 0 ) break;
+		if ( r->count < max ) {
+			memcpy(&r->latency[r->count], buffer, sizeof(uint64_t));
+			r->latency[r->count] = t - r->latency[r->count];
+		}
+		r->count++;
+		r->bytes += size;
+	}
+	res = 0;
+RETURN:
+	if ( frd ) fifoCloseR(frd);
+	if ( buffer ) free(buffer);
+	return res;
+}
+
+static void* writerthread(void* arg) {
+	Worker* w = (Worker*) arg;
+	w->status = writer(w->b, w->n);
+	return NULL;
+}
+
+static void* readerthread(void* arg) {
+	Worker* w = (Worker*) arg;
+	w->status = reader(w->b, w->n, &w->result);
+	return NULL;
+}
+
+/*
+ * Run reader in child process, send result through pipe.
+ */
+static pid_t readerprocess(const Bench* b, int n, int* fd) {
+	int p[2];
+	pid_t pid;
+	Result r;
+	int res;
+
+	if ( pipe(p) < 0 ) return -1;
+	pid = fork();
+	if ( pid == 0 ) {
+		close(p[0]);
+		res = reader(b, n, &r);
+		if ( res < 0 ) r.count = -1;
+		if ( write(p[1], &r, sizeof(r)) < 0 ||
+				(r.count > 0 && write(p[1], r.latency, r.count * sizeof(uint64_t)) < 0) ) {
+			_exit(1);
+		}
+		_exit(res < 0);
+	}
+	close(p[1]);
+	*fd = p[0];
+	return pid;
+}
+
+/*
+ * Receive result of reader process.
+ */
+static int receive(int fd, Result* r) {
+	size_t want, got = 0;
+	ssize_t rres;
+
+	if ( read(fd, r, sizeof(*r)) != sizeof(*r) || r->count < 0 ) return -1;
+	want = r->count * sizeof(uint64_t);
+	r->latency = (uint64_t*) malloc(want + 1);
+	if ( r->latency == NULL ) return -1;
+	while ( got < want && (rres = read(fd, (char*) r->latency + got, want - got)) > 0 ) {
+		got += rres;
+	}
+	return got == want ? 0 : -1;
+}
+
+static int cmplatency(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t* l, long n, double p) {
+	return n > 0 ? l[(long) (p * (n - 1))] / 1000.0 : 0.0;
+}
+
+/*
+ * Report messages/s, MB/s and latency percentiles of all readers.
+ */
+static void report(const Bench* b, Result* r, double elapsed) {
+	long i, n = 0;
+	long bytes = 0;
+	uint64_t* all;
+
+	for ( i = 0; i < b->readers; ++i ) {
+		n += r[i].count;
+		bytes += r[i].bytes;
+	}
+	all = (uint64_t*) malloc((n + 1) * sizeof(uint64_t));
+	if ( all == NULL ) return;
+	for ( i = 0, n = 0; i < b->readers; ++i ) {
+		memcpy(all + n, r[i].latency, r[i].count * sizeof(uint64_t));
+		n += r[i].count;
+	}
+	qsort(all, n, sizeof(uint64_t), cmplatency);
+	if ( b->json ) {
+		printf("{\"lib\":\"%s\",\"writers\":%d,\"readers\":%d,\"shared\":%d,\"threads\":%d,"
+				"\"messages\":%ld,\"minSize\":%lu,\"maxSize\":%lu,\"switchSize\":%ld,\"rate\":%ld,"
+				"\"elapsed\":%.6f,\"received\":%ld,\"msgsPerSec\":%.1f,\"mbPerSec\":%.3f,"
+				"\"latencyUs\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f}}\n",
+				b->label, b->writers, b->readers, b->shared, b->threads,
+				b->messages, (unsigned long) b->minSize, (unsigned long) b->maxSize,
+				(long) b->switchSize, b->rate, elapsed, n, n / elapsed, bytes / elapsed / 1e6,
+				percentile(all, n, 0.5), percentile(all, n, 0.99), percentile(all, n, 0.999));
+	} else {
+		printf("%s: %d writers %d %s readers (%s), %ld messages of %lu..%lu bytes, switch size %ld\n",
+				b->label, b->writers, b->readers, b->shared ? "shared" : "independent",
+				b->threads ? "threads" : "processes", b->messages,
+				(unsigned long) b->minSize, (unsigned long) b->maxSize, (long) b->switchSize);
+		printf("  %ld received in %.3f s: %.0f msgs/s %.2f MB/s latency p50 %.1f us p99 %.1f us p99.9 %.1f us\n",
+				n, elapsed, n / elapsed, bytes / elapsed / 1e6,
+				percentile(all, n, 0.5), percentile(all, n, 0.99), percentile(all, n, 0.999));
+	}
+	free(all);
+}
+
+/*
+ * Throughput and latency benchmark of the file queue library.
+ * N writers and M readers on independent or shared read pointers run as
+ * processes or threads on a new queue, the writers at full speed or at
+ * a given rate. Each message carries its write time,
+ * so the readers measure the end-to-end latency. After all writers finished,
+ * end markers stop the readers.
+ * Report messages/s, MB/s and latency percentiles, with -j as JSON line.
+ */
+int main(int argc, char * const* argv) {
+
+	int opt;
+	int i;
+	int res;
+	int status = 0;
+	uint64_t start;
+	char* p;
+	Bench b;
+	Worker* w = NULL;
+	Worker* r = NULL;
+	pid_t* pid = NULL;
+	int* fd = NULL;
+	Result* result = NULL;
+	FifoDescriptor* fwd;
+
+	b.label = (p = strrchr(argv[0], '/')) ? p + 1 : argv[0];
+	b.writers = 1;
+	b.readers = 1;
+	b.shared = 0;
+	b.threads = 0;
+	b.messages = 10000;
+	b.minSize = b.maxSize = 100;
+	b.switchSize = 1000000;
+	b.rate = 0;
+	b.json = 0;
+	while ( (opt = getopt(argc, argv, "jl:m:n:r:R:stw:z:")) != -1 ) {
+		switch ( opt ) {
+		case 'j': b.json = 1; break;
+		case 'l': b.label = optarg; break;
+		case 'm':
+			b.minSize = b.maxSize = strtoul(optarg, &p, 10);
+			if ( *p == ':' ) b.maxSize = strtoul(p + 1, NULL, 10);
+			break;
+		case 'n': b.messages = atol(optarg); break;
+		case 'r': b.readers = atoi(optarg); break;
+		case 'R': b.rate = atol(optarg); break;
+		case 's': b.shared = 1; break;
+		case 't': b.threads = 1; break;
+		case 'w': b.writers = atoi(optarg); break;
+		case 'z': b.switchSize = atol(optarg); break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if ( optind != argc - 1 || b.writers < 1 || b.readers < 1 ||
+			b.minSize < MINSIZE || b.maxSize < b.minSize || b.maxSize > MAXSIZE ) {
+		fprintf(stderr, "usage: %s [-w writers] [-r readers] [-s] [-t] [-n messages] "
+				"[-m size[:maxsize]] [-z switchsize] [-R rate] [-j] [-l label] newdir\n", argv[0]);
+		exit(1);
+	}
+	b.dir = argv[optind];
+
+	res = fifoCreate(b.dir, b.switchSize, '\\', '\n');
+	fwd = res < 0 ? NULL : fifoOpenW(b.dir);
+	if ( fwd == NULL ) {
+		fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
+		exit(1);
+	}
+	w = (Worker*) calloc(b.writers, sizeof(*w));
+	r = (Worker*) calloc(b.readers, sizeof(*r));
+	pid = (pid_t*) calloc(b.writers + b.readers, sizeof(*pid));
+	fd = (int*) calloc(b.readers, sizeof(*fd));
+	result = (Result*) calloc(b.readers, sizeof(*result));
+	if ( w == NULL || r == NULL || pid == NULL || fd == NULL || result == NULL ) {
+		perror("fifobench malloc");
+		exit(1);
+	}
+
+	start = now();
+	for ( i = 0; i < b.readers; ++i ) {
+		r[i].b = &b;
+		r[i].n = i;
+		if ( b.threads ) {
+			pthread_create(&r[i].thread, NULL, readerthread, &r[i]);
+		} else {
+			pid[b.writers + i] = readerprocess(&b, i, &fd[i]);
+		}
+	}
+	for ( i = 0; i < b.writers; ++i ) {
+		w[i].b = &b;
+		w[i].n = i;
+		if ( b.threads ) {
+			pthread_create(&w[i].thread, NULL, writerthread, &w[i]);
+		} else if ( (pid[i] = fork()) == 0 ) {
+			_exit(writer(&b, i) < 0);
+		}
+	}
+	for ( i = 0; i < b.writers; ++i ) {
+		if ( b.threads ) {
+			pthread_join(w[i].thread, NULL);
+			status |= w[i].status;
+		} else if ( waitpid(pid[i], &res, 0) < 0 || res != 0 ) {
+			status = -1;
+		}
+	}
+	for ( i = 0; i < (b.shared ? b.readers : 1); ++i ) {
+		fifoWrite(fwd, ENDMARK, ENDLEN);
+	}
+	for ( i = 0; i < b.readers; ++i ) {
+		if ( b.threads ) {
+			pthread_join(r[i].thread, NULL);
+			status |= r[i].status;
+			result[i] = r[i].result;
+		} else {
+			if ( receive(fd[i], &result[i]) < 0 ) status = -1;
+			close(fd[i]);
+			waitpid(pid[b.writers + i], &res, 0);
+		}
+	}
+	fifoCloseW(fwd);
+	if ( status != 0 ) {
+		fprintf(stderr, "%s: benchmark failed\n", b.label);
+		exit(1);
+	}
+	report(&b, result, (now() - start) / 1e9);
+	exit(0);
+}
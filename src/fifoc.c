@@ -0,0 +1,384 @@
+
+#define	_GNU_SOURCE
+
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<string.h>
+#include	<stdlib.h>
+#include	<errno.h>
+#include	<limits.h>
+#include	<fcntl.h>
+#include	<sys/mman.h>
+#include	<sys/socket.h>
+#include	<sys/un.h>
+
+#include	"fifod.h"
+
+#define	WINDOW		8	/* requests sent ahead of their responses */
+#define	MAXBATCH	1024	/* messages per write request */
+#define	MAXFDS		16
+
+static int fds[MAXFDS];		/* memfds received ahead of their frames */
+static int nfds;
+
+/*
+ * Send the request with its body, which is passed in a memfd, if it is large.
+ */
+static int sendframe(int sock, FifodFrame* req, const char* body) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr* cm;
+	size_t total;
+	ssize_t n;
+	int fd = -1;
+	int res = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov[0].iov_base = req;
+	iov[0].iov_len = sizeof(*req);
+	iov[1].iov_base = (void*) body;
+	iov[1].iov_len = req->size;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if ( req->size > FIFODINLINE ) {
+		fd = memfd_create("fifoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if ( fd < 0 || write(fd, body, req->size) != (ssize_t) req->size
+				|| fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) < 0 ) {
+			goto RETURN;
+		}
+		req->flags |= FIFOD_MEMFD;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	total = iov[0].iov_len + (msg.msg_iovlen > 1 ? iov[1].iov_len : 0);
+	while ( total > 0 ) {
+		n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n < 0 ) goto RETURN;
+		total -= n;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		while ( n > 0 && (size_t) n >= msg.msg_iov[0].iov_len ) {
+			n -= msg.msg_iov[0].iov_len;
+			++msg.msg_iov;
+			--msg.msg_iovlen;
+		}
+		if ( n > 0 ) {
+			msg.msg_iov[0].iov_base = (char*) msg.msg_iov[0].iov_base + n;
+			msg.msg_iov[0].iov_len -= n;
+		}
+	}
+	res = 0;
+RETURN:
+	if ( fd >= 0 ) close(fd);
+	return res;
+}
+
+/*
+ * Receive size bytes and keep the memfds passed with them.
+ */
+static int recvall(int sock, char* buffer, size_t size) {
+	char control[CMSG_SPACE(MAXFDS * sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cm;
+	ssize_t n;
+	int i, k, fd;
+
+	while ( size > 0 ) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buffer;
+		iov.iov_len = size;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if ( n < 0 && errno == EINTR ) continue;
+		if ( n <= 0 ) {
+			if ( n == 0 ) errno = ECONNRESET;
+			return -1;
+		}
+		for ( cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ) {
+			if ( cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ) continue;
+			k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for ( i = 0; i < k; ++i ) {
+				memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+				if ( nfds < MAXFDS ) {
+					fds[nfds++] = fd;
+				} else {
+					close(fd);
+				}
+			}
+		}
+		buffer += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * Receive the next response and its body, from the stream or a memfd.
+ */
+static int recvframe(int sock, FifodFrame* res, char** body, size_t* cap) {
+	char* p;
+	ssize_t n;
+	size_t pos;
+	int fd;
+
+	if ( recvall(sock, (char*) res, sizeof(*res)) < 0 ) return -1;
+	if ( res->size + 1 > *cap ) {
+		p = (char*) realloc(*body, res->size + 1);
+		if ( p == NULL ) return -1;
+		*body = p;
+		*cap = res->size + 1;
+	}
+	if ( !(res->flags & FIFOD_MEMFD) ) return recvall(sock, *body, res->size);
+	if ( nfds == 0 ) {
+		errno = EPROTO;
+		return -1;
+	}
+	fd = fds[0];
+	memmove(fds, fds + 1, --nfds * sizeof(*fds));
+	for ( pos = 0; pos < res->size; pos += n ) {
+		n = pread(fd, *body + pos, res->size - pos, pos);
+		if ( n <= 0 ) break;
+	}
+	close(fd);
+	if ( pos < res->size ) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Send a request and return its response; fail on an error response.
+ */
+static int call(int sock, FifodFrame* req, const char* body, FifodFrame* res, char** buffer, size_t* cap) {
+	if ( sendframe(sock, req, body) < 0 || recvframe(sock, res, buffer, cap) < 0 ) return -1;
+	if ( res->arg != 0 ) {
+		errno = res->arg;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write the lines of stdin as messages in batches, up to WINDOW batches
+ * ahead of their responses.
+ */
+static int writelines(int sock, uint32_t handle) {
+	char* batch = NULL;
+	size_t size = 0;
+	size_t cap = 0;
+	char* line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	uint32_t n;
+	char* body = NULL;
+	size_t bodycap = 0;
+	FifodFrame req;
+	FifodFrame res;
+	int count = 0;
+	int pending = 0;
+	int eof = 0;
+	int status = -1;
+	char* p;
+
+	memset(&req, 0, sizeof(req));
+	req.op = FIFOD_WRITE;
+	req.handle = handle;
+	while ( !eof || count > 0 || pending > 0 ) {
+		len = eof ? -1 : getline(&line, &linecap, stdin);
+		if ( len < 0 ) {
+			eof = 1;
+		} else {
+			if ( len > 0 && line[len-1] == '\n' ) --len;
+			if ( size + sizeof(n) + len > cap ) {
+				cap = size + sizeof(n) + len + FIFODINLINE;
+				p = (char*) realloc(batch, cap);
+				if ( p == NULL ) goto RETURN;
+				batch = p;
+			}
+			n = (uint32_t) len;
+			memcpy(batch + size, &n, sizeof(n));
+			memcpy(batch + size + sizeof(n), line, len);
+			size += sizeof(n) + len;
+			++count;
+		}
+		if ( count > 0 && (eof || size >= FIFODINLINE || count == MAXBATCH) ) {
+			req.size = (uint32_t) size;
+			req.count = (uint16_t) count;
+			req.flags = 0;
+			++req.id;
+			if ( sendframe(sock, &req, batch) < 0 ) goto RETURN;
+			++pending;
+			size = 0;
+			count = 0;
+		}
+		if ( pending > 0 && (eof || pending == WINDOW) ) {
+			if ( recvframe(sock, &res, &body, &bodycap) < 0 ) goto RETURN;
+			--pending;
+			if ( res.arg != 0 ) {
+				errno = res.arg;
+				goto RETURN;
+			}
+		}
+	}
+	status = 0;
+RETURN:
+	free(batch);
+	free(line);
+	free(body);
+	return status;
+}
+
+/*
+ * Print up to max messages (0: all) as lines, waiting up to wait ms for each
+ * batch. The release of a batch is sent together with the next read.
+ */
+static int readlines(int sock, uint32_t handle, long max, long wait) {
+	char* body = NULL;
+	size_t cap = 0;
+	size_t pos;
+	uint32_t len;
+	long total = 0;
+	FifodFrame rel;
+	FifodFrame req;
+	FifodFrame res;
+	int i;
+	int done = 0;
+	int status = -1;
+
+	memset(&rel, 0, sizeof(rel));
+	rel.op = FIFOD_RELEASE;
+	rel.handle = handle;
+	memset(&req, 0, sizeof(req));
+	req.op = FIFOD_READ;
+	req.handle = handle;
+	req.flags = FIFOD_REPLYFD;
+	req.arg = (int32_t) wait;
+	req.count = max > 0 && max < MAXBATCH ? (uint16_t) max : MAXBATCH;
+	if ( sendframe(sock, &req, NULL) < 0 ) goto RETURN;
+	while ( !done ) {
+		if ( recvframe(sock, &res, &body, &cap) < 0 ) goto RETURN;
+		for ( i = 0, pos = 0; i < res.count && pos + sizeof(len) <= res.size; ++i ) {
+			memcpy(&len, body + pos, sizeof(len));
+			pos += sizeof(len);
+			fwrite(body + pos, 1, len, stdout);
+			putchar('\n');
+			pos += len;
+		}
+		total += res.count;
+		if ( res.arg != 0 ) {
+			errno = res.arg;
+			goto RETURN;
+		}
+		if ( res.count == 0 ) break;
+		done = max > 0 && total >= max;
+		++rel.id;
+		if ( sendframe(sock, &rel, NULL) < 0 ) goto RETURN;
+		if ( !done ) {
+			req.count = max > 0 && max - total < MAXBATCH ? (uint16_t) (max - total) : MAXBATCH;
+			++req.id;
+			if ( sendframe(sock, &req, NULL) < 0 ) goto RETURN;
+		}
+		if ( recvframe(sock, &res, &body, &cap) < 0 ) goto RETURN;
+		if ( res.arg != 0 ) {
+			errno = res.arg;
+			goto RETURN;
+		}
+	}
+	status = 0;
+RETURN:
+	fflush(stdout);
+	free(body);
+	return status;
+}
+
+/*
+ * Client of fifod for scripts: write the lines of stdin to a queue or print
+ * messages of a read pointer, without opening the queue in the process.
+ * -n reads at most count messages, -t waits up to wait ms (-1: without limit)
+ * for the next one; by default it ends, when the queue is empty.
+ */
+int main(int argc, char * const* argv) {
+
+	int opt;
+	int sock;
+	int status;
+	long count = 0;
+	long wait = 0;
+	const char* path = FIFODSOCKET;
+	char dir[PATH_MAX];
+	char* name = NULL;
+	char* body = NULL;
+	size_t size;
+	size_t cap = 0;
+	struct sockaddr_un addr;
+	FifodFrame req;
+	FifodFrame res;
+
+	while ( (opt = getopt(argc, argv, "s:n:t:")) != -1 ) {
+		switch ( opt ) {
+		case 's': path = optarg; break;
+		case 'n': count = atol(optarg); break;
+		case 't': wait = atol(optarg); break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if ( optind + 2 > argc || strlen(path) >= sizeof(addr.sun_path)
+			|| !((argv[optind][0] == 'w' && optind + 2 == argc) || (argv[optind][0] == 'r' && optind + 3 == argc)) ) {
+		fprintf(stderr, "usage: %s [-s socket] w dir\n       %s [-s socket] [-n count] [-t wait] r dir reader\n", argv[0], argv[0]);
+		exit(1);
+	}
+	if ( realpath(argv[optind+1], dir) == NULL ) {
+		perror(argv[optind+1]);
+		exit(1);
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ( sock < 0 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 ) {
+		perror(path);
+		exit(1);
+	}
+
+	/* the name of the read pointer follows the directory */
+	memset(&req, 0, sizeof(req));
+	req.op = argv[optind][0] == 'w' ? FIFOD_OPENW : FIFOD_OPENR;
+	size = strlen(dir) + (req.op == FIFOD_OPENR ? strlen(argv[optind+2]) + 1 : 0);
+	if ( size > FIFODINLINE || (name = (char*) malloc(size + 1)) == NULL ) {
+		fprintf(stderr, "%s: invalid name\n", argv[0]);
+		exit(1);
+	}
+	strcpy(name, dir);
+	if ( req.op == FIFOD_OPENR ) strcpy(name + strlen(dir) + 1, argv[optind+2]);
+	req.size = (uint32_t) size;
+	if ( call(sock, &req, name, &res, &body, &cap) < 0 ) {
+		perror("fifod open failed");
+		exit(1);
+	}
+	if ( req.op == FIFOD_OPENW ) {
+		status = writelines(sock, res.handle);
+	} else {
+		status = readlines(sock, res.handle, count, wait);
+	}
+	if ( status < 0 ) {
+		perror("fifod failed");
+		exit(1);
+	}
+	exit(0);
+}
@@ -0,0 +1,802 @@
+
+#define	_GNU_SOURCE
+
+#include 	<time.h>
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<string.h>
+#include	<stdlib.h>
+#include	<errno.h>
+#include	<limits.h>
+#include	<fcntl.h>
+#include	<signal.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	<sys/socket.h>
+#include	<sys/un.h>
+#include	<sys/epoll.h>
+
+#include	"fifo.h"
+#include	"fifod.h"
+
+#define	MAXCLIENTS	1024	/* connections */
+#define	MAXHANDLES	256	/* open queues per connection */
+#define	MAXFDS		16	/* memfds per connection received or to be sent */
+#define	MAXEVENTS	64
+#define	MAXMESSAGE	(256 << 20)	/* max. size of a message read */
+#define	READCHUNK	65536	/* buffer space tried first for a message */
+#define	MAXINPUT	(FIFODMAXBODY + sizeof(FifodFrame))	/* input received ahead */
+
+/* descriptor kept open by the daemon for all connections */
+typedef
+struct	{
+	char*	dirname;
+	char*	reader;		/* read pointer, NULL: writer */
+	FifoDescriptor*	fd;
+	struct Client*	owner;	/* connection using the read pointer, NULL: none */
+	int	unreleased;	/* message read, but not released */
+	char*	kept;		/* copies of the messages served, but not released */
+	size_t	keptlen;	/* bytes of kept, a uint32_t size and the bytes per message */
+	size_t	keptcap;
+	size_t	served;		/* bytes of kept delivered to the owner */
+}	Queue;
+
+typedef
+struct	Client	{
+	int	sock;
+	char*	in;		/* received, not yet processed */
+	size_t	inlen;
+	size_t	incap;
+	char*	out;		/* responses not yet sent */
+	size_t	outpos;
+	size_t	outlen;
+	size_t	outcap;
+	int	fds[MAXFDS];	/* memfds received for the next frames */
+	int	nfds;
+	int	outfd[MAXFDS];	/* memfds to send with the frame at outoff */
+	size_t	outoff[MAXFDS];
+	int	noutfd;
+	int	events;		/* epoll events registered */
+	Queue*	handle[MAXHANDLES];	/* queue of handle i+1 */
+	Queue*	wait;		/* read pointer of a waiting read, NULL: none */
+	long	deadline;	/* ms of the waiting read, -1: none */
+}	Client;
+
+static char message[1024];
+static Queue** queues;
+static int nqueues;
+static Client* clients[MAXCLIENTS];
+static int nclients;
+static FifoPoll* fpl;
+static int epfd;
+static volatile sig_atomic_t stopped;
+
+/*
+ * Milliseconds of the monotonic clock.
+ */
+static long now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void stop(int sig) {
+	(void) sig;
+	stopped = 1;
+}
+
+/*
+ * Grow buffer to hold need bytes.
+ */
+static int reserve(char** buffer, size_t* cap, size_t need) {
+	size_t n = *cap > 0 ? *cap : READCHUNK;
+	char* p;
+
+	if ( need <= *cap ) return 0;
+	while ( n < need ) n *= 2;
+	p = (char*) realloc(*buffer, n);
+	if ( p == NULL ) return -1;
+	*buffer = p;
+	*cap = n;
+	return 0;
+}
+
+/*
+ * Find the open descriptor of the queue or open it. Writers are shared by all
+ * connections, a read pointer is used by one connection at a time.
+ */
+static Queue* lookup(const char* dirname, const char* reader) {
+	int i;
+	Queue* q;
+	Queue** p;
+
+	for ( i = 0; i < nqueues; ++i ) {
+		q = queues[i];
+		if ( strcmp(q->dirname, dirname) != 0 ) continue;
+		if ( (reader == NULL) != (q->reader == NULL) ) continue;
+		if ( reader == NULL || strcmp(q->reader, reader) == 0 ) return q;
+	}
+	p = (Queue**) realloc(queues, (nqueues + 1) * sizeof(*queues));
+	if ( p == NULL ) return NULL;
+	queues = p;
+	q = (Queue*) calloc(1, sizeof(*q));
+	if ( q == NULL ) return NULL;
+	q->dirname = strdup(dirname);
+	q->reader = reader ? strdup(reader) : NULL;
+	if ( q->dirname == NULL || (reader && q->reader == NULL) ) {
+		errno = ENOMEM;
+	} else {
+		q->fd = reader ? fifoOpenR(dirname, reader) : fifoOpenW(dirname);
+	}
+	if ( q->fd == NULL ) {
+		fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
+		free(q->dirname);
+		free(q->reader);
+		free(q);
+		return NULL;
+	}
+	queues[nqueues++] = q;
+	return q;
+}
+
+/*
+ * Close the descriptor and forget it.
+ */
+static void forget(Queue* q) {
+	int i;
+
+	for ( i = 0; i < nqueues && queues[i] != q; ++i );
+	if ( i < nqueues ) queues[i] = queues[--nqueues];
+	if ( q->reader ) {
+		fifoCloseR(q->fd);
+	} else {
+		fifoCloseW(q->fd);
+	}
+	free(q->dirname);
+	free(q->reader);
+	free(q->kept);
+	free(q);
+}
+
+/*
+ * End the waiting read of the connection.
+ */
+static void unwait(Client* c) {
+	if ( c->wait == NULL ) return;
+	fifoPollRemove(fpl, c->wait->fd);
+	c->wait = NULL;
+	c->deadline = -1;
+}
+
+/*
+ * Give the read pointer back. Messages read, but not released, are delivered
+ * to its next connection again.
+ */
+static void putback(Client* c, Queue* q) {
+	if ( q->reader == NULL ) return;
+	if ( c->wait == q ) unwait(c);
+	q->owner = NULL;
+	q->served = 0;
+}
+
+/*
+ * Start a response frame at the end of the output and return its offset.
+ */
+static long begin(Client* c) {
+	size_t off = c->outlen;
+
+	if ( reserve(&c->out, &c->outcap, off + sizeof(FifodFrame)) < 0 ) return -1;
+	c->outlen += sizeof(FifodFrame);
+	return (long) off;
+}
+
+/*
+ * Complete the response frame at off, whose body follows it up to the end
+ * of the output. A large body is moved into a memfd, if the client accepts it.
+ */
+static void finish(Client* c, long off, const FifodFrame* req, uint32_t handle, uint16_t count, int errnum) {
+	FifodFrame res;
+	size_t body = c->outlen - off - sizeof(res);
+	int fd;
+
+	res.size = (uint32_t) body;
+	res.id = req->id;
+	res.op = req->op;
+	res.flags = 0;
+	res.count = count;
+	res.handle = handle;
+	res.arg = errnum;
+	if ( body > FIFODINLINE && (req->flags & FIFOD_REPLYFD) && c->noutfd < MAXFDS ) {
+		fd = memfd_create("fifod", MFD_CLOEXEC);
+		if ( fd >= 0 && write(fd, c->out + off + sizeof(res), body) == (ssize_t) body ) {
+			res.flags = FIFOD_MEMFD;
+			c->outlen = off + sizeof(res);
+			c->outfd[c->noutfd] = fd;
+			c->outoff[c->noutfd++] = off;
+		} else if ( fd >= 0 ) {
+			close(fd);
+		}
+	}
+	memcpy(c->out + off, &res, sizeof(res));
+}
+
+/*
+ * Respond without body.
+ */
+static void respond(Client* c, const FifodFrame* req, uint32_t handle, uint16_t count, int errnum) {
+	long off = begin(c);
+	if ( off >= 0 ) finish(c, off, req, handle, count, errnum);
+}
+
+/*
+ * Queue of the handle, NULL if it is not open.
+ */
+static Queue* handleof(Client* c, uint32_t handle) {
+	return handle >= 1 && handle <= MAXHANDLES ? c->handle[handle - 1] : NULL;
+}
+
+static int openqueue(Client* c, const FifodFrame* req, const char* body) {
+	char name[PATH_MAX + FIFOREADERLEN + 2];
+	char* reader = NULL;
+	uint32_t h;
+	Queue* q;
+
+	if ( req->size >= sizeof(name) ) return EINVAL;
+	memcpy(name, body, req->size);
+	name[req->size] = '\0';
+	if ( req->op == FIFOD_OPENR ) {
+		if ( strlen(name) + 1 >= req->size ) return EINVAL;
+		reader = name + strlen(name) + 1;
+		if ( reader[0] == '\0' ) return EINVAL;
+	}
+	if ( name[0] != '/' ) return EINVAL;
+	for ( h = 0; h < MAXHANDLES && c->handle[h]; ++h );
+	if ( h == MAXHANDLES ) return EMFILE;
+	q = lookup(name, reader);
+	if ( q == NULL ) return errno;
+	if ( q->reader ) {
+		if ( q->owner ) return EBUSY;
+		q->owner = c;
+	}
+	c->handle[h] = q;
+	respond(c, req, h + 1, 0, 0);
+	return 0;
+}
+
+static int writequeue(Client* c, const FifodFrame* req, char* body) {
+	Queue* q = handleof(c, req->handle);
+	size_t pos = 0;
+	uint32_t len;
+	int n;
+	int errnum = 0;
+	int atomic = (req->flags & FIFOD_ATOMIC) != 0;
+
+	if ( q == NULL || q->reader ) return EBADF;
+	if ( atomic && fifoBegin(q->fd) < 0 ) return errno;
+	for ( n = 0; n < req->count; ++n ) {
+		if ( pos + sizeof(len) > req->size ) {
+			errnum = EINVAL;
+			break;
+		}
+		memcpy(&len, body + pos, sizeof(len));
+		pos += sizeof(len);
+		if ( len > req->size - pos ) {
+			errnum = EINVAL;
+			break;
+		}
+		if ( fifoWrite(q->fd, body + pos, len) < 0 ) {
+			errnum = errno;
+			break;
+		}
+		pos += len;
+	}
+	if ( atomic && errnum == 0 && fifoCommit(q->fd) < 0 ) errnum = errno;
+	if ( atomic && errnum != 0 ) {
+		fifoAbort(q->fd);
+		n = 0;
+	}
+	respond(c, req, req->handle, (uint16_t) n, errnum);
+	return 0;
+}
+
+/*
+ * Keep a copy of the messages served for their delivery to another connection,
+ * until the owner releases them.
+ */
+static void keep(Queue* q, const char* body, size_t size) {
+	char* p;
+
+	if ( size > q->keptcap ) {
+		p = (char*) realloc(q->kept, size);
+		if ( p == NULL ) {
+			free(q->kept);
+			q->kept = NULL;
+			q->keptcap = q->keptlen = q->served = 0;
+			return;
+		}
+		q->kept = p;
+		q->keptcap = size;
+	}
+	memcpy(q->kept, body, size);
+	q->keptlen = q->served = size;
+}
+
+/*
+ * Respond with up to count of the kept messages of a connection ended.
+ */
+static int redeliver(Client* c, const FifodFrame* req, Queue* q, size_t limit) {
+	size_t pos = q->served;
+	uint32_t len;
+	long off;
+	int n;
+
+	for ( n = 0; n < (req->count > 0 ? req->count : 1) && pos < q->keptlen; ++n ) {
+		if ( n > 0 && pos - q->served > limit ) break;
+		memcpy(&len, q->kept + pos, sizeof(len));
+		pos += sizeof(len) + len;
+	}
+	if ( reserve(&c->out, &c->outcap, c->outlen + sizeof(FifodFrame) + pos - q->served) < 0 ) return ENOMEM;
+	off = begin(c);
+	memcpy(c->out + c->outlen, q->kept + q->served, pos - q->served);
+	c->outlen += pos - q->served;
+	q->served = pos;
+	finish(c, off, req, req->handle, (uint16_t) n, 0);
+	return 0;
+}
+
+/*
+ * Read up to count messages into the response, while further messages are
+ * readable. The library releases each but the last in the queue, when the
+ * next is read: copies of all are kept in memory until FIFOD_RELEASE, in case
+ * the connection ends before; a restart of the daemon loses the released ones.
+ * Without message, the read waits and -1 is returned.
+ */
+static int readqueue(Client* c, const FifodFrame* req) {
+	Queue* q = handleof(c, req->handle);
+	size_t limit = (req->flags & FIFOD_REPLYFD) ? FIFODMAXBODY : FIFODINLINE;
+	size_t space;
+	uint32_t len = 0;
+	ssize_t res = 0;
+	long off;
+	int n;
+	int errnum = 0;
+
+	if ( q == NULL || q->reader == NULL ) return EBADF;
+	if ( q->served < q->keptlen ) return redeliver(c, req, q, limit);
+	off = begin(c);
+	if ( off < 0 ) return ENOMEM;
+	for ( n = 0; n < (req->count > 0 ? req->count : 1); ++n ) {
+		if ( n > 0 && (c->outlen - off > limit || fifoReadable(q->fd, NULL) != 1) ) break;
+		if ( n > 0 ) {
+			if ( fifoRelease(q->fd) < 0 ) {
+				errnum = errno;
+				break;
+			}
+			q->unreleased = 0;
+		}
+		for ( space = READCHUNK; ; space *= 4 ) {
+			if ( reserve(&c->out, &c->outcap, c->outlen + sizeof(len) + space) < 0 ) {
+				errno = ENOMEM;
+				res = -1;
+				break;
+			}
+			res = fifoReadW(q->fd, c->out + c->outlen + sizeof(len), space, 0, 0);
+			if ( res >= 0 || errno != E2BIG || space >= MAXMESSAGE ) break;
+		}
+		if ( res < 0 ) {
+			if ( errno != EAGAIN ) errnum = errno;
+			break;
+		}
+		q->unreleased = 1;
+		len = (uint32_t) res;
+		memcpy(c->out + c->outlen, &len, sizeof(len));
+		c->outlen += sizeof(len) + res;
+	}
+	if ( n > 0 ) keep(q, c->out + off + sizeof(FifodFrame), c->outlen - off - sizeof(FifodFrame));
+	if ( n == 0 && errnum == 0 && req->arg != 0 && (c->deadline < 0 || now() < c->deadline) ) {
+		/* wait in the poll set, the request is tried again */
+		c->outlen = off;
+		if ( c->wait == NULL ) {
+			if ( fifoPollAdd(fpl, q->fd) < 0 ) return errno;
+			c->wait = q;
+			c->deadline = req->arg > 0 ? now() + req->arg : -1;
+		}
+		return -1;
+	}
+	unwait(c);
+	finish(c, off, req, req->handle, (uint16_t) n, errnum);
+	return 0;
+}
+
+/*
+ * Perform a request; return 0 or the errno to respond with, -1 if it waits.
+ */
+static int request(Client* c, const FifodFrame* req, char* body) {
+	Queue* q;
+
+	switch ( req->op ) {
+	case FIFOD_OPENW:
+	case FIFOD_OPENR:
+		return openqueue(c, req, body);
+	case FIFOD_WRITE:
+		return writequeue(c, req, body);
+	case FIFOD_READ:
+		return readqueue(c, req);
+	case FIFOD_RELEASE:
+		q = handleof(c, req->handle);
+		if ( q == NULL || q->reader == NULL ) return EBADF;
+		if ( q->served < q->keptlen ) {
+			/* part of the kept messages delivered again: forget it */
+			memmove(q->kept, q->kept + q->served, q->keptlen - q->served);
+			q->keptlen -= q->served;
+			q->served = 0;
+		} else {
+			if ( fifoRelease(q->fd) < 0 ) return errno;
+			q->unreleased = 0;
+			q->keptlen = q->served = 0;
+		}
+		respond(c, req, req->handle, 0, 0);
+		return 0;
+	case FIFOD_CLOSE:
+		q = handleof(c, req->handle);
+		if ( q == NULL ) return EBADF;
+		putback(c, q);
+		c->handle[req->handle - 1] = NULL;
+		respond(c, req, 0, 0, 0);
+		return 0;
+	default:
+		return EINVAL;
+	}
+}
+
+/*
+ * Perform the complete requests received, in order, until one waits or the
+ * output is too large. Return -1, if the client broke the protocol.
+ */
+static int process(Client* c) {
+	size_t pos = 0;
+	FifodFrame req;
+	struct stat st;
+	char* body;
+	int fd;
+	int seals;
+	int res;
+
+	while ( c->inlen - pos >= sizeof(req) && c->outlen - c->outpos <= FIFODMAXBODY ) {
+		memcpy(&req, c->in + pos, sizeof(req));
+		if ( req.flags & FIFOD_MEMFD ) {
+			if ( c->nfds == 0 ) break;
+			body = NULL;
+			seals = fcntl(c->fds[0], F_GET_SEALS);
+			if ( seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(c->fds[0], &st) < 0 || st.st_size < (off_t) req.size ) {
+				/* a memfd shrinking while mapped would crash the daemon */
+				return -1;
+			}
+			if ( req.size > 0 ) {
+				body = (char*) mmap(NULL, req.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, c->fds[0], 0);
+				if ( body == MAP_FAILED ) return -1;
+			}
+		} else {
+			if ( req.size > FIFODMAXBODY ) return -1;
+			if ( c->inlen - pos - sizeof(req) < req.size ) break;
+			body = c->in + pos + sizeof(req);
+		}
+		res = request(c, &req, body);
+		if ( req.flags & FIFOD_MEMFD ) {
+			if ( body ) munmap(body, req.size);
+			if ( res >= 0 ) {
+				fd = c->fds[0];
+				memmove(c->fds, c->fds + 1, --c->nfds * sizeof(*c->fds));
+				close(fd);
+			}
+		}
+		if ( res < 0 ) break;
+		if ( res > 0 ) respond(c, &req, req.handle, 0, res);
+		pos += sizeof(req) + ((req.flags & FIFOD_MEMFD) ? 0 : req.size);
+	}
+	memmove(c->in, c->in + pos, c->inlen - pos);
+	c->inlen -= pos;
+	return 0;
+}
+
+/*
+ * Receive requests and memfds. Return -1 at end of connection.
+ */
+static int receive(Client* c) {
+	char control[CMSG_SPACE(MAXFDS * sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cm;
+	ssize_t n;
+	int i, k, fd;
+	int res = 0;
+
+	while ( c->inlen <= MAXINPUT ) {
+		if ( reserve(&c->in, &c->incap, c->inlen + READCHUNK) < 0 ) return -1;
+		iov.iov_base = c->in + c->inlen;
+		iov.iov_len = c->incap - c->inlen;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		n = recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC);
+		if ( n < 0 && (errno == EAGAIN || errno == EINTR) ) return res;
+		if ( n <= 0 ) return -1;
+		c->inlen += n;
+		for ( cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ) {
+			if ( cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ) continue;
+			k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for ( i = 0; i < k; ++i ) {
+				memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+				if ( c->nfds < MAXFDS ) {
+					c->fds[c->nfds++] = fd;
+				} else {
+					close(fd);
+					res = -1;
+				}
+			}
+		}
+		if ( msg.msg_flags & MSG_CTRUNC ) res = -1;
+	}
+	return res;
+}
+
+/*
+ * Watch the connection for input, unless too much is waiting to be processed,
+ * and for output while responses are pending.
+ */
+static void rearm(Client* c) {
+	struct epoll_event ev;
+	int events = (c->inlen <= MAXINPUT ? EPOLLIN : 0) | (c->outpos < c->outlen ? EPOLLOUT : 0);
+
+	if ( events == c->events ) return;
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+	c->events = events;
+}
+
+/*
+ * Send the responses, a memfd together with the first byte of its frame.
+ * Return -1, if the connection failed.
+ */
+static int flush(Client* c) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cm;
+	size_t end;
+	ssize_t n;
+
+	while ( c->outpos < c->outlen ) {
+		end = c->outlen;
+		memset(&msg, 0, sizeof(msg));
+		if ( c->noutfd > 0 && c->outoff[0] == c->outpos ) {
+			if ( c->noutfd > 1 ) end = c->outoff[1];
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &c->outfd[0], sizeof(int));
+		} else if ( c->noutfd > 0 ) {
+			end = c->outoff[0];
+		}
+		iov.iov_base = c->out + c->outpos;
+		iov.iov_len = end - c->outpos;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		n = sendmsg(c->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if ( n < 0 && (errno == EAGAIN || errno == EINTR) ) break;
+		if ( n < 0 ) return -1;
+		if ( msg.msg_control ) {
+			/* the memfd was sent with the first byte */
+			close(c->outfd[0]);
+			--c->noutfd;
+			memmove(c->outfd, c->outfd + 1, c->noutfd * sizeof(*c->outfd));
+			memmove(c->outoff, c->outoff + 1, c->noutfd * sizeof(*c->outoff));
+		}
+		c->outpos += n;
+	}
+	if ( c->outpos == c->outlen ) {
+		c->outpos = c->outlen = 0;
+	}
+	rearm(c);
+	return 0;
+}
+
+/*
+ * Close the connection and give its read pointers back.
+ */
+static void drop(Client* c) {
+	int i;
+
+	for ( i = 0; i < nclients && clients[i] != c; ++i );
+	if ( i < nclients ) clients[i] = clients[--nclients];
+	unwait(c);
+	for ( i = 0; i < MAXHANDLES; ++i ) {
+		if ( c->handle[i] ) putback(c, c->handle[i]);
+	}
+	for ( i = 0; i < c->nfds; ++i ) close(c->fds[i]);
+	for ( i = 0; i < c->noutfd; ++i ) close(c->outfd[i]);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+	close(c->sock);
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+/*
+ * Serve input and output of the connection.
+ */
+static void serve(Client* c, int events) {
+	if ( (events & EPOLLIN) && receive(c) < 0 ) {
+		/* answer what was received before the end of the connection */
+		if ( process(c) == 0 ) flush(c);
+		drop(c);
+		return;
+	}
+	if ( process(c) < 0 || flush(c) < 0 ) {
+		drop(c);
+		return;
+	}
+	if ( (events & (EPOLLHUP | EPOLLERR)) && !(events & EPOLLIN) ) drop(c);
+}
+
+static void accept1(int ls) {
+	struct epoll_event ev;
+	Client* c;
+	int sock;
+
+	while ( (sock = accept4(ls, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0 ) {
+		c = nclients < MAXCLIENTS ? (Client*) calloc(1, sizeof(*c)) : NULL;
+		if ( c == NULL ) {
+			close(sock);
+			continue;
+		}
+		c->sock = sock;
+		c->deadline = -1;
+		c->events = EPOLLIN;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if ( epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0 ) {
+			close(sock);
+			free(c);
+			continue;
+		}
+		clients[nclients++] = c;
+	}
+}
+
+/*
+ * Retry the waiting reads, whose queues are readable or whose time is up.
+ */
+static void wakeup(void) {
+	FifoDescriptor* ready[MAXEVENTS];
+	int i, k, n = 0;
+	long t = now();
+	Client* c;
+
+	/* even without waiting reads: it drains the events of removed watches,
+	 * which keep fpl->fd readable otherwise */
+	n = fifoPoll(fpl, ready, MAXEVENTS, 0);
+	if ( n < 0 ) n = 0;
+	for ( i = 0; i < nclients; ++i ) {
+		c = clients[i];
+		if ( c->wait == NULL ) continue;
+		for ( k = 0; k < n && ready[k] != c->wait->fd; ++k );
+		if ( k == n && (c->deadline < 0 || t < c->deadline) ) continue;
+		if ( process(c) < 0 || flush(c) < 0 ) {
+			drop(c);
+			--i;
+		}
+	}
+}
+
+/*
+ * Milliseconds until the next waiting read is to be retried, -1: none.
+ */
+static int timeout(void) {
+	long t = now();
+	long res = fpl->count > 0 ? fpl->wait : -1;
+	int i;
+
+	for ( i = 0; i < nclients; ++i ) {
+		if ( clients[i]->wait == NULL || clients[i]->deadline < 0 ) continue;
+		if ( res < 0 || clients[i]->deadline - t < res ) {
+			res = clients[i]->deadline > t ? clients[i]->deadline - t : 0;
+		}
+	}
+	return res > INT_MAX ? INT_MAX : (int) res;
+}
+
+/*
+ * Local queue daemon. It keeps the queues open for short-lived clients, which
+ * send batched write, read and release requests over a Unix stream socket
+ * (see fifod.h), so they neither open the queues themselves nor take their
+ * locks; all locking is done by the single thread of the daemon. Reads wait
+ * in a fifoPoll set of the daemon instead of a thread per reader.
+ */
+int main(int argc, char * const* argv) {
+
+	int opt;
+	int i, n;
+	int ls;
+	const char* path = FIFODSOCKET;
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct epoll_event events[MAXEVENTS];
+	struct sigaction sa;
+	mode_t mask;
+
+	while ( (opt = getopt(argc, argv, "s:")) != -1 ) {
+		switch ( opt ) {
+		case 's': path = optarg; break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if ( optind != argc || strlen(path) >= sizeof(addr.sun_path) ) {
+		fprintf(stderr, "usage: %s [-s socket]\n", argv[0]);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fpl = fifoPollCreate();
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	ls = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ( fpl == NULL || epfd < 0 || ls < 0 ) {
+		perror("fifod setup failed");
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	/* only the user of the daemon may connect */
+	mask = umask(077);
+	n = bind(ls, (struct sockaddr*) &addr, sizeof(addr));
+	umask(mask);
+	if ( n < 0 || listen(ls, SOMAXCONN) < 0 ) {
+		perror("fifod bind failed");
+		exit(1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ls, &ev);
+	if ( fpl->fd >= 0 ) {
+		ev.data.ptr = fpl;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fpl->fd, &ev);
+	}
+
+	while ( !stopped ) {
+		n = epoll_wait(epfd, events, MAXEVENTS, timeout());
+		if ( n < 0 && errno != EINTR ) {
+			perror("fifod epoll_wait failed");
+			break;
+		}
+		for ( i = 0; i < n; ++i ) {
+			if ( events[i].data.ptr == NULL ) {
+				accept1(ls);
+			} else if ( events[i].data.ptr != fpl ) {
+				serve((Client*) events[i].data.ptr, events[i].events);
+			}
+		}
+		wakeup();
+	}
+
+	while ( nclients > 0 ) drop(clients[0]);
+	while ( nqueues > 0 ) forget(queues[0]);
+	fifoPollClose(fpl);
+	close(ls);
+	unlink(path);
+	exit(0);
+}
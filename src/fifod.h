@@ -0,0 +1,68 @@
+
+/*
+ * Protocol of fifod, the local queue daemon, on a Unix stream socket.
+ * Each request and response is a frame followed by size bytes of body.
+ * Requests may be pipelined: the daemon answers them in order and echoes
+ * the id. Integers are in the byte order of the host.
+ *
+ * FIFOD_OPENW	body: directory (absolute path). Response: handle.
+ * FIFOD_OPENR	body: directory '\0' read pointer. Response: handle.
+ *		A read pointer is used by one connection at a time (EBUSY).
+ * FIFOD_WRITE	body: count messages, each a uint32_t size and its bytes.
+ *		FIFOD_ATOMIC writes them as one transaction.
+ *		Response: count of messages written.
+ * FIFOD_READ	read up to count messages, waiting arg ms (negative: without
+ *		limit) for the first. For the connections they stay unreleased
+ *		until FIFOD_RELEASE, which may be pipelined with the next
+ *		FIFOD_READ: if the handle is given back before, the next
+ *		connection reads them again. In the queue only the last stays
+ *		unreleased; the others are released when the next one is read and
+ *		kept as copies in the memory of the daemon, so a crash or restart
+ *		of the daemon loses them: they are delivered at most once then.
+ *		Read with count 1 for at least once across restarts.
+ *		Response: count messages like FIFOD_WRITE.
+ * FIFOD_RELEASE	release the messages read last.
+ * FIFOD_CLOSE	give the handle back; the daemon keeps the queue open.
+ *
+ * The arg of a response is 0 or the errno of the failure. A body above
+ * FIFODINLINE bytes may be passed in a memfd with SCM_RIGHTS instead of the
+ * stream: the frame has FIFOD_MEMFD set and size is the size of the memfd,
+ * which the client seals against shrinking (F_SEAL_SHRINK). The daemon
+ * answers with a memfd only, if the request had FIFOD_REPLYFD set.
+ */
+
+#ifndef	FIFOD_H
+#define	FIFOD_H
+
+#include	<stdint.h>
+
+#define	FIFODSOCKET	"/tmp/fifod.sock"	/* default path of the socket */
+#define	FIFODINLINE	65536		/* max. body passed in the stream by fifoc and fifod */
+#define	FIFODMAXBODY	(16 << 20)	/* max. body in the stream, larger only in a memfd */
+
+typedef
+enum	{
+	FIFOD_OPENW = 1,
+	FIFOD_OPENR,
+	FIFOD_WRITE,
+	FIFOD_READ,
+	FIFOD_RELEASE,
+	FIFOD_CLOSE
+}	FifodOp;
+
+#define	FIFOD_MEMFD	1	/* body in a memfd passed with the frame */
+#define	FIFOD_ATOMIC	2	/* write the messages as one transaction */
+#define	FIFOD_REPLYFD	4	/* the body of the response may be passed in a memfd */
+
+typedef
+struct	{
+	uint32_t	size;		/* size of the body following the frame */
+	uint32_t	id;		/* chosen by the client, returned in the response */
+	uint8_t	op;		/* FifodOp */
+	uint8_t	flags;		/* FIFOD_MEMFD, FIFOD_ATOMIC */
+	uint16_t	count;		/* messages in the body, max. messages to read */
+	uint32_t	handle;		/* queue opened by FIFOD_OPENW or FIFOD_OPENR */
+	int32_t	arg;		/* request: ms to wait for a message, response: errno */
+}	FifodFrame;
+
+#endif
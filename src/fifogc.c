@@ -0,0 +1,77 @@
+
+#define	_POSIX_SOURCE
+#define _POSIX_C_SOURCE 200112L
+
+#include 	<time.h>
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<string.h>
+#include	<stdlib.h>
+#include	<errno.h>
+
+#include	"fifo.h"
+
+static char message[1024];
+
+/*
+ * Retention daemon for file queues.
+ * Remove or archive data file generations, which have been released by
+ * all read pointers, and enforce the optional age and size limits.
+ * With -s the policy is stored in the queue, so writers apply it at rollover.
+ * With -i the collection is repeated every interval seconds.
+ */
+int main(int argc, char * const* argv) {
+
+	int opt;
+	int i;
+	int store = 0;
+	long interval = 0;
+	long maxage = 0;
+	long maxbytes = 0;
+	long res;
+	char* archive = NULL;
+	struct timespec ts;
+
+	while ( (opt = getopt(argc, argv, "a:b:d:i:s")) != -1 ) {
+		switch ( opt ) {
+		case 'a': maxage = atol(optarg); break;
+		case 'b': maxbytes = atol(optarg); break;
+		case 'd': archive = optarg; break;
+		case 'i': interval = atol(optarg); break;
+		case 's': store = 1; break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if ( optind >= argc ) {
+		fprintf(stderr, "usage: %s [-a maxage] [-b maxbytes] [-d archivedir] [-i interval] [-s] dir ...\n", argv[0]);
+		exit(1);
+	}
+
+	if ( store ) {
+		for ( i = optind; i < argc; ++i ) {
+			if ( fifoRetention(argv[i], maxage, maxbytes, archive) < 0 ) {
+				perror("fifoRetention failed");
+				fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
+			}
+		}
+	}
+
+	ts.tv_sec = interval;
+	ts.tv_nsec = 0;
+	do {
+		for ( i = optind; i < argc; ++i ) {
+			res = fifoCollect(argv[i], maxage, maxbytes, archive);
+			if ( res < 0 ) {
+				perror("fifoCollect failed");
+				fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
+			} else if ( res > 0 ) {
+				printf("%s: %ld generations removed\n", argv[i], res);
+				fflush(stdout);
+			}
+		}
+	} while ( interval > 0 && nanosleep(&ts, NULL) == 0 );
+
+	exit(0);
+}
@@ -0,0 +1,73 @@
+
+#define	_POSIX_SOURCE
+#define _POSIX_C_SOURCE 200112L
+
+#include 	<time.h>
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<string.h>
+#include	<stdlib.h>
+#include	<errno.h>
+
+#include	"fifo.h"
+
+#define	MAXREADERS	1024
+
+static char message[1024];
+static FifoLag lags[MAXREADERS];
+
+/*
+ * List the consumer lag of every read pointer of file queues in bytes and
+ * messages, computed from the logical offsets kept by writers and readers
+ * without a scan of the data files.
+ * With -i the list is repeated every interval seconds.
+ */
+int main(int argc, char * const* argv) {
+
+	int opt;
+	int i;
+	int status = 0;
+	long interval = 0;
+	long k;
+	long res;
+	struct timespec ts;
+
+	while ( (opt = getopt(argc, argv, "i:")) != -1 ) {
+		switch ( opt ) {
+		case 'i': interval = atol(optarg); break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if ( optind >= argc ) {
+		fprintf(stderr, "usage: %s [-i interval] dir ...\n", argv[0]);
+		exit(1);
+	}
+
+	ts.tv_sec = interval;
+	ts.tv_nsec = 0;
+	do {
+		printf("%-24s %-16s %14s %12s %14s %12s\n",
+				"queue", "reader", "written", "messages", "lag bytes", "lag msgs");
+		for ( i = optind; i < argc; ++i ) {
+			res = fifoLagList(argv[i], lags, MAXREADERS);
+			if ( res < 0 ) {
+				perror("fifoLagList failed");
+				fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
+				status = 1;
+				continue;
+			}
+			for ( k = 0; k < res; ++k ) {
+				printf("%-24s %-16s %14llu %12llu %14llu %12llu\n", argv[i], lags[k].reader,
+						(unsigned long long) lags[k].written,
+						(unsigned long long) lags[k].writtenMessages,
+						(unsigned long long) lags[k].bytes,
+						(unsigned long long) lags[k].messages);
+			}
+		}
+		fflush(stdout);
+	} while ( interval > 0 && nanosleep(&ts, NULL) == 0 );
+
+	exit(status);
+}
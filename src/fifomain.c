@@ -16,7 +16,7 @@
 
 #include	"fifo.h"
 
-char fifoERROR[10240];
+static char message[1024];
 
 int main(int argc, char * const* argv) {
 
@@ -45,7 +45,7 @@ int main(int argc, char * const* argv) {
 	res = fifoCreate(filename, 1000, '\\', '\n');
 	if ( res < 0 ) {
 		perror("fifoCreate failed");
-		fprintf(stderr, fifoERROR);
+		fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
 		goto RETURN;
 	}
 
@@ -53,7 +53,7 @@ int main(int argc, char * const* argv) {
 		fwd = fifoOpenW(filename);
 		if ( fwd == NULL ) {
 			perror("fifoOpenW failed");
-			fprintf(stderr, fifoERROR);
+			fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
 			goto RETURN;
 		}
 
@@ -64,7 +64,7 @@ int main(int argc, char * const* argv) {
 			wres = fifoWrite(fwd, buffer, size);
 			if ( wres < 0 ) {
 				perror("fifoWrite failed: ");
-				fprintf(stderr, fifoERROR);
+				fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
 			}
 		}
 		fifoCloseW(fwd);
@@ -75,7 +75,7 @@ int main(int argc, char * const* argv) {
 		frd= fifoOpenR(filename, "0000");
 		if ( frd == NULL ) {
 			perror("fifoOpenR failed");
-			fprintf(stderr, fifoERROR);
+			fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
 			goto RETURN;
 		}
 
@@ -86,7 +86,7 @@ int main(int argc, char * const* argv) {
 		}
 		if ( rres < 0 ) {
 			perror("fifoRead failed");
-			fprintf(stderr, fifoERROR);
+			fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
 			goto RETURN;
 		}
 
@@ -1,15 +1,35 @@
 
+#ifndef	_POSIX_SOURCE
 #define _POSIX_SOURCE
+#endif
 #include <sys/types.h>
+#include <time.h>
+#include <stdint.h>
 #include	<unistd.h>
 
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
 typedef
 struct {
-	char*	pathName;	/* absolute name of directory */
+	char*	pathName;	/* name of directory as given at open */
+	int	dirfd;		/* open directory, base of all file names */
+	struct FifoLocks*	locks;	/* process internal locks of the queue (fifop.c) */
+	struct FifoTail*	tail;	/* mapped header dir/.tail shared by writers and readers */
+	int	writers;	/* dir/.writers locked shared by an open writer, -1: none */
+	int	slot;		/* slot of an open writer in dir/.tail, -1: none */
 	off_t	switchSize;	/* if file size greater: new generation */
+	unsigned long	shardSize;	/* generations per subdirectory, 0: flat layout */
 	char	escape[2];		/* mask special characters if record bounds */
 	char	separator[2];	/* record separator */
 	char	rollmark[4];	/* roll mark = escape '@' separator */
+	int	retain;		/* retention policy found in .retain */
+	long	maxAge;		/* retention: max age of data files in seconds */
+	off_t	maxBytes;	/* retention: max total size of data files */
+	char*	archive;	/* retention: archive directory, NULL: remove */
+	size_t	recordSize;	/* fixed size of records stored without framing, 0: messages */
+	uint64_t	fingerprint;	/* type of the records, 0: none */
 }	FifoParameters;
 
 typedef
@@ -21,26 +41,182 @@ struct	{
 	pid_t	pid;		/* pid of process that read last */
 	size_t	fileSize;	/* file size read */
 	int	roll;		/* indicate that next release shall roll to next file */
+	int	header;		/* last message read has a binary header */
+	uint64_t	base;	/* logical offset of the start of generation current */
+	uint64_t	messages;	/* read pointer: messages released, write pointer: written before current */
 }	FifoFilePointer;	
 
 
+#define	FIFOATTRLEN	1024	/* max. size of user attributes in header */
+
 typedef
 struct	{
+	uint64_t	time;		/* write time, nanoseconds since the epoch */
+	uint64_t	sequence;	/* sequence number in the queue or of the producer */
+	uint32_t	producer;	/* producer id, 0: anonymous */
+	uint16_t	attrSize;	/* size of user attributes */
+	const void*	attributes;	/* user attributes, point into read buffer */
+}	FifoHeader;
+
+#define	FIFOLANES	8	/* max. number of priority lanes */
+
+typedef
+struct	FifoDescriptor	{
 	FifoParameters* parameters;
 	FifoFilePointer* filePointer;
 	unsigned long	current;/* number of current write file */
 	int	fd;
 	int	fdp;		/* fd of read pointer file */
+	struct FifoDescriptor**	lane;	/* lanes 1 .. lanes-1, NULL: single lane */
+	int	lanes;		/* number of priority lanes */
+	int	readLane;	/* lane of last message read */
+	struct FifoProducer*	producer;	/* idempotent producer, NULL: none */
+	struct FifoTransaction*	transaction;	/* staged messages, NULL: none */
+	struct FifoStatsBlock*	stats;	/* counters and histograms, NULL: built without FIFO_STATS */
 }	FifoDescriptor;
 
+typedef
+struct	{
+	int	count;		/* number of partitions of the queue */
+	FifoDescriptor**	part;	/* descriptor per partition, NULL if not bound */
+	int	next;		/* partition to visit first at next read */
+	int	last;		/* partition of unreleased message, -1: none */
+}	FifoPartitions;
+
+typedef
+struct	{
+	int	fd;		/* inotify descriptor, readable if a queue changed, -1: none */
+	int	count;		/* number of read descriptors in the set */
+	int	size;		/* allocated entries */
+	FifoDescriptor**	desc;	/* read descriptors */
+	int*	wd;		/* watches of lanes and shard per descriptor, -1: none */
+	unsigned long*	shard;	/* shard watched per descriptor */
+	int	next;		/* descriptor to check first at next poll */
+	long	wait;		/* ms until the set must be checked without event, -1: none */
+}	FifoPoll;
+
+#define	FIFOBUCKETS	32	/* buckets of latency histograms */
+
+typedef
+enum	{
+	FIFO_TLOCK = 0,		/* lock acquisition of read, release and rollover */
+	FIFO_TWRITE,		/* write of a message: reservation, write and commit */
+	FIFO_TREAD,		/* read of a message or finding none */
+	FIFO_TRELEASE,		/* release of a message */
+	FIFO_TROLLOVER,		/* rollover to a new data file */
+	FIFO_TIMERS
+}	FifoTimer;
+
+typedef
+struct	{
+	uint64_t	count;
+	uint64_t	total;		/* sum of latencies in ns */
+	uint64_t	max;		/* max. latency in ns */
+	uint64_t	bucket[FIFOBUCKETS];	/* bucket i > 0: latency 2^(i-1) .. 2^i-1 ns, the last: above */
+}	FifoHistogram;
+
+typedef
+struct	{
+	uint64_t	messages;	/* messages written or read, a transaction as one */
+	uint64_t	bytes;		/* bytes written or read, as stored */
+	uint64_t	polls;		/* reads finding no message */
+	uint64_t	rollovers;	/* rollovers done */
+	FifoHistogram	time[FIFO_TIMERS];
+}	FifoStats;
+
+#define	FIFOREADERLEN	256	/* max. length of read pointer name */
+
+typedef
+struct	{
+	char	reader[FIFOREADERLEN];	/* name of the read pointer */
+	uint64_t	written;	/* logical offset of the end of the committed data */
+	uint64_t	released;	/* logical offset of the release position */
+	uint64_t	bytes;		/* lag in bytes */
+	uint64_t	writtenMessages;	/* messages written to the queue */
+	uint64_t	releasedMessages;	/* messages released by the read pointer */
+	uint64_t	messages;	/* lag in messages */
+}	FifoLag;
+
+typedef
+struct	{
+	pid_t	pid;		/* process of the descriptor */
+	int	slot;		/* slot in dir/.stats */
+	char	role;		/* 'w' writer, 'r' reader */
+	char	reader[FIFOREADERLEN];	/* name of the read pointer, may be truncated */
+	FifoStats	stats;
+}	FifoStatsEntry;
+
+typedef
+enum	{
+	FIFO_OK = 0,		/* no error */
+	FIFO_ESYSTEM,		/* system call failed, see errnum */
+	FIFO_ENOMEM,		/* out of memory */
+	FIFO_EBUSY,		/* lock held by other process */
+	FIFO_EFORMAT,		/* invalid contents of administration or data file */
+	FIFO_ETOOBIG,		/* message longer than receive buffer */
+	FIFO_ESEQUENCE		/* read without release or concurrent use of read pointer */
+}	FifoErrorCode;
+
+#define	FIFOTRACE	8	/* max. number of operations in error trace */
+
+typedef
+struct	{
+	FifoErrorCode	code;
+	int	errnum;		/* errno at failing operation */
+	int	depth;		/* number of entries in trace */
+	const char*	trace[FIFOTRACE];	/* failing operation followed by callers */
+	char	path[256];	/* file name concerned, relative to queue directory */
+}	FifoError;
+
+/* esc must not be a marker character '@', 'H', 'B', 'C' or 'P' (EINVAL), ' ': none */
 int fifoCreate(const char* dirname, off_t swithSize, char esc, char sep);
+int fifoCreateShards(const char* dirname, off_t swithSize, char esc, char sep, unsigned long shardSize);
+int fifoCreateLanes(const char* dirname, off_t swithSize, char esc, char sep, int lanes);
+int fifoCreateRecords(const char* dirname, off_t swithSize, char esc, char sep, size_t recordSize, uint64_t fingerprint);
 FifoDescriptor* fifoOpenW(const char* filename);
 FifoDescriptor* fifoOpenR(const char* filename, const char* readpointer);
 ssize_t fifoWrite(FifoDescriptor* fp, void* buffer, size_t size);
+ssize_t fifoWriteAt(FifoDescriptor* fp, time_t notBefore, void* buffer, size_t size);
+ssize_t fifoWriteH(FifoDescriptor* fp, FifoHeader* header, void* buffer, size_t size);
+int fifoProducer(FifoDescriptor* fp, uint32_t producer, uint64_t* sequence);
+ssize_t fifoWriteSeq(FifoDescriptor* fp, uint64_t sequence, void* buffer, size_t size);
+int fifoBegin(FifoDescriptor* fp);
+int fifoCommit(FifoDescriptor* fp);
+int fifoAbort(FifoDescriptor* fp);
+ssize_t fifoWriteLane(FifoDescriptor* fp, int lane, void* buffer, size_t size);
 ssize_t fifoRead(FifoDescriptor* fp, void* buffer, size_t size);
 ssize_t fifoReadW(FifoDescriptor* frd, void* buffer, size_t size, long wtim, long maxtim);
+ssize_t fifoReadH(FifoDescriptor* frd, void* buffer, size_t size, long wtim, long maxtim, FifoHeader* header, void** payload);
 ssize_t fifoRelease(FifoDescriptor* fp);
+int fifoReadable(FifoDescriptor* frd, time_t* due);
+FifoPoll* fifoPollCreate(void);
+int fifoPollAdd(FifoPoll* fpl, FifoDescriptor* frd);
+int fifoPollRemove(FifoPoll* fpl, FifoDescriptor* frd);
+int fifoPoll(FifoPoll* fpl, FifoDescriptor** ready, int max, long timeout);
+void fifoPollClose(FifoPoll* fpl);
 void fifoCloseR(FifoDescriptor* fp);
 void fifoCloseW(FifoDescriptor* fp);
+int fifoRetention(const char* dirname, long maxAge, off_t maxBytes, const char* archive);
+long fifoCollect(const char* dirname, long maxAge, off_t maxBytes, const char* archive);
+off_t fifoRecover(const char* dirname);
+int fifoLag(FifoDescriptor* frd, FifoLag* lag);
+long fifoLagList(const char* dirname, FifoLag* lags, long max);
+int fifoCreatePartitions(const char* dirname, off_t swithSize, char esc, char sep, int partitions);
+int fifoPartitionCount(const char* dirname);
+unsigned long fifoHash(const void* key, size_t size);
+FifoPartitions* fifoOpenPartW(const char* dirname);
+FifoPartitions* fifoOpenPartR(const char* dirname, const char* readpointer, const int* bind, int nbind);
+ssize_t fifoWritePart(FifoPartitions* fpw, unsigned long hash, void* buffer, size_t size);
+ssize_t fifoReadPart(FifoPartitions* fpr, void* buffer, size_t size, long wtim, long maxtim);
+ssize_t fifoReleasePart(FifoPartitions* fpr);
+void fifoClosePart(FifoPartitions* fp);
+const FifoError* fifoError(void);
+char* fifoStrerror(char* buffer, size_t size);
+int fifoStats(FifoDescriptor* fp, FifoStats* stats, int queue);
+int fifoStatsList(const char* dirname, FifoStatsEntry* list, int max);
+
+#ifdef	__cplusplus
+}
+#endif
 
 
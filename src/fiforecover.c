@@ -0,0 +1,44 @@
+
+#define	_POSIX_SOURCE
+#define _POSIX_C_SOURCE 200112L
+
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<string.h>
+#include	<stdlib.h>
+#include	<errno.h>
+
+#include	"fifo.h"
+
+static char message[1024];
+
+/*
+ * Offline recovery of file queues after a crash of their writers.
+ * Cut off an incomplete record or transaction group at the end of the
+ * current data file and repair write and read pointers, like the first
+ * writer opening the queue does. A queue with an open writer is skipped.
+ */
+int main(int argc, char * const* argv) {
+
+	int i;
+	int status = 0;
+	off_t res;
+
+	if ( argc < 2 ) {
+		fprintf(stderr, "usage: %s dir ...\n", argv[0]);
+		exit(1);
+	}
+
+	for ( i = 1; i < argc; ++i ) {
+		res = fifoRecover(argv[i]);
+		if ( res < 0 ) {
+			perror("fifoRecover failed");
+			fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
+			status = 1;
+		} else {
+			printf("%s: %ld bytes cut off\n", argv[i], (long) res);
+		}
+	}
+
+	exit(status);
+}
@@ -0,0 +1,191 @@
+
+#define	_POSIX_SOURCE
+#define _POSIX_C_SOURCE 200112L
+
+#include 	<time.h>
+#include	<stdio.h>
+#include	<unistd.h>
+#include	<string.h>
+#include	<stdlib.h>
+#include	<errno.h>
+
+#include	"fifo.h"
+
+#define	MAXENTRIES	64	/* descriptors per queue */
+#define	MAXREADERS	1024
+
+static char message[1024];
+static FifoLag lags[MAXREADERS];
+
+/* last sample of a queue */
+typedef
+struct	{
+	char*	name;
+	int	count;
+	FifoStatsEntry	entry[MAXENTRIES];
+}	Sample;
+
+/*
+ * Upper bound of the latency in us, below which the fraction p of the
+ * operations of the interval took place.
+ */
+static double percentile(const FifoHistogram* h, const FifoHistogram* o, double p) {
+	uint64_t count = h->count - o->count;
+	uint64_t sum = 0;
+	int i;
+
+	if ( count == 0 ) return 0.0;
+	for ( i = 0; i < FIFOBUCKETS; ++i ) {
+		sum += h->bucket[i] - o->bucket[i];
+		if ( sum >= p * count ) break;
+	}
+	return i == 0 ? 0.0 : (double) (UINT64_C(1) << i) / 1000.0;
+}
+
+/*
+ * Average latency of the interval in us.
+ */
+static double average(const FifoHistogram* h, const FifoHistogram* o) {
+	uint64_t count = h->count - o->count;
+	return count == 0 ? 0.0 : (double) (h->total - o->total) / count / 1000.0;
+}
+
+/*
+ * Print throughput and latency of the interval for each descriptor of the
+ * queue, which was attached at the last sample, too.
+ */
+static void show(const Sample* cur, const Sample* old, double seconds) {
+	int i, j;
+	long k;
+	long n;
+	const FifoStatsEntry* e;
+	const FifoStatsEntry* o;
+	const FifoStats* s;
+	const FifoStats* t;
+	FifoTimer op;
+	char lag[24];
+
+	n = fifoLagList(cur->name, lags, MAXREADERS);
+	for ( i = 0; i < cur->count; ++i ) {
+		e = &cur->entry[i];
+		for ( j = 0; j < old->count; ++j ) {
+			o = &old->entry[j];
+			if ( o->slot == e->slot && o->pid == e->pid && o->stats.messages <= e->stats.messages ) break;
+		}
+		if ( j == old->count ) continue;
+		s = &e->stats;
+		t = &o->stats;
+		op = e->role == 'w' ? FIFO_TWRITE : FIFO_TREAD;
+		strcpy(lag, "-");
+		for ( k = 0; e->role == 'r' && k < n; ++k ) {
+			if ( strcmp(lags[k].reader, e->reader) == 0 ) {
+				sprintf(lag, "%llu", (unsigned long long) lags[k].messages);
+				break;
+			}
+		}
+		printf("%-20s %7ld %c %-12s %10.0f %8.2f %8.0f %8.1f %8.1f %8.1f %6.0f %8.2f %10s\n",
+				cur->name, (long) e->pid, e->role, e->reader,
+				(s->messages - t->messages) / seconds,
+				(s->bytes - t->bytes) / seconds / 1e6,
+				(s->polls - t->polls) / seconds,
+				average(&s->time[FIFO_TLOCK], &t->time[FIFO_TLOCK]),
+				average(&s->time[op], &t->time[op]),
+				percentile(&s->time[op], &t->time[op], 0.99),
+				(s->rollovers - t->rollovers) / seconds,
+				average(&s->time[FIFO_TROLLOVER], &t->time[FIFO_TROLLOVER]) / 1000.0,
+				lag);
+	}
+}
+
+/*
+ * Live monitor of file queues. Each process built with -DFIFO_STATS publishes
+ * the statistics of its read and write pointers in the segment dir/.stats of
+ * the queue; fifotop samples the segments every interval seconds and prints
+ * rates, lock wait and operation latency, rollovers and the lag of the readers.
+ * The partitions of a partitioned queue are shown separately.
+ */
+int main(int argc, char * const* argv) {
+
+	int opt;
+	int i, j, p, n;
+	int q = 0;
+	long interval = 1;
+	long count = 0;
+	long round;
+	char* path;
+	Sample* samples;
+	Sample* cur;
+	Sample* old;
+	struct timespec ts;
+
+	while ( (opt = getopt(argc, argv, "i:n:")) != -1 ) {
+		switch ( opt ) {
+		case 'i': interval = atol(optarg); break;
+		case 'n': count = atol(optarg); break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if ( optind >= argc || interval <= 0 ) {
+		fprintf(stderr, "usage: %s [-i interval] [-n count] dir ...\n", argv[0]);
+		exit(1);
+	}
+
+	/* two samples per queue, partitions as queues of their own */
+	for ( i = optind, n = 0; i < argc; ++i ) {
+		p = fifoPartitionCount(argv[i]);
+		n += p > 0 ? p : 1;
+	}
+	samples = (Sample*) calloc(2 * n, sizeof(Sample));
+	if ( samples == NULL ) {
+		perror("calloc failed");
+		exit(1);
+	}
+	for ( i = optind; i < argc; ++i ) {
+		p = fifoPartitionCount(argv[i]);
+		if ( p <= 0 ) {
+			samples[2 * q++].name = argv[i];
+			continue;
+		}
+		for ( j = 0; j < p; ++j ) {
+			path = (char*) malloc(strlen(argv[i]) + 16);
+			if ( path == NULL ) {
+				perror("malloc failed");
+				exit(1);
+			}
+			sprintf(path, "%s/p%d", argv[i], j);
+			samples[2 * q++].name = path;
+		}
+	}
+
+	ts.tv_sec = interval;
+	ts.tv_nsec = 0;
+	for ( round = 0; ; ++round ) {
+		if ( round > 0 ) {
+			printf("%-20s %7s %c %-12s %10s %8s %8s %8s %8s %8s %6s %8s %10s\n",
+					"queue", "pid", ' ', "reader", "msgs/s", "MB/s", "polls/s",
+					"lock us", "op us", "p99 us", "roll/s", "roll ms", "lag msgs");
+		}
+		for ( i = 0; i < q; ++i ) {
+			cur = &samples[2 * i + round % 2];
+			old = &samples[2 * i + (round + 1) % 2];
+			cur->name = samples[2 * i].name;
+			cur->count = fifoStatsList(cur->name, cur->entry, MAXENTRIES);
+			if ( cur->count < 0 ) {
+				perror("fifoStatsList failed");
+				fprintf(stderr, "%s", fifoStrerror(message, sizeof(message)));
+				cur->count = 0;
+			}
+			if ( round > 0 ) show(cur, old, (double) interval);
+		}
+		if ( round > 0 ) {
+			printf("\n");
+			fflush(stdout);
+		}
+		if ( count > 0 && round == count ) break;
+		if ( nanosleep(&ts, NULL) < 0 ) break;
+	}
+
+	exit(0);
+}